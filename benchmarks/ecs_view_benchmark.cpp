@@ -0,0 +1,100 @@
+//ECS queries at 10k and 100k entities: the lookup pattern systems used before views (walk one
+//component array, look up the others through the owner entity) against ECS.each<Ts...>().
+//Every entity has a Transform, half have a Mesh and a tenth a Collider. Half of the entities
+//are destroyed and created again first, so component arrays are not in entity order, as in
+//a scene which has been running for a while. Prints best time of each query per entity
+#include "EntityComponentStore.h"
+#include <chrono>
+#include <cstdio>
+#include <algorithm>
+#include <random>
+
+static const int REPEATS = 30;
+
+//best time of REPEATS runs of f, in ns per entity
+template<typename F>
+static double timeQuery(int num_entities, F f) {
+	double best = 1e30;
+	for (int r = 0; r < REPEATS; r++) {
+		auto start = std::chrono::high_resolution_clock::now();
+		f();
+		double ns = std::chrono::duration<double, std::nano>(std::chrono::high_resolution_clock::now() - start).count();
+		best = std::min(best, ns);
+	}
+	return best / num_entities;
+}
+
+static void addComponents(EntityComponentStore& store, int ent, int i) {
+	store.getComponentFromEntity<Transform>(ent).translate((float)i, 0.0f, 0.0f);
+	if (i % 2 == 0) {
+		Mesh& mesh = store.createComponentForEntity<Mesh>(ent);
+		mesh.geometry = i % 7;
+		mesh.material = 0;
+	}
+	if (i % 10 == 0)
+		store.createComponentForEntity<Collider>(ent).max_distance = 1.0f;
+}
+
+static void run(int num_entities) {
+	EntityComponentStore store;
+	for (int i = 0; i < num_entities; i++)
+		addComponents(store, store.createEntity("e"), i);
+	//recreate every other entity, in random order, so arrays end up shuffled against entity ids
+	std::vector<int> recreated;
+	for (int i = 1; i < num_entities; i += 2)
+		recreated.push_back(i);
+	std::shuffle(recreated.begin(), recreated.end(), std::mt19937(1));
+	for (int ent : recreated)
+		store.destroyEntity(ent);
+	for (int ent : recreated)
+		addComponents(store, store.createEntity("e"), ent);
+
+	volatile float sink = 0.0f;
+	float sum;
+
+	//Mesh + Transform: most entities match
+	double lookup_mt = timeQuery(num_entities, [&]() {
+		sum = 0.0f;
+		for (Mesh& mesh : store.getAllComponents<Mesh>())
+			sum += store.getComponentFromEntity<Transform>(mesh.owner).world.m[12] * mesh.geometry;
+		sink = sum;
+	});
+	double view_mt = timeQuery(num_entities, [&]() {
+		sum = 0.0f;
+		store.each<Mesh, Transform>([&sum](int ent, Mesh& mesh, Transform& transform) {
+			sum += transform.world.m[12] * mesh.geometry;
+		});
+		sink = sum;
+	});
+
+	//Mesh + Transform + Collider: few entities match
+	double lookup_mtc = timeQuery(num_entities, [&]() {
+		sum = 0.0f;
+		for (Mesh& mesh : store.getAllComponents<Mesh>()) {
+			if (!store.hasComponents<Collider>(mesh.owner)) continue;
+			sum += store.getComponentFromEntity<Transform>(mesh.owner).world.m[12] *
+				store.getComponentFromEntity<Collider>(mesh.owner).max_distance;
+		}
+		sink = sum;
+	});
+	double view_mtc = timeQuery(num_entities, [&]() {
+		sum = 0.0f;
+		store.each<Mesh, Transform, Collider>([&sum](int ent, Mesh& mesh, Transform& transform, Collider& collider) {
+			sum += transform.world.m[12] * collider.max_distance;
+		});
+		sink = sum;
+	});
+	(void)sink;
+
+	printf("%7d entities  Mesh+Transform           lookup %6.2f ns  each %6.2f ns  (%.2fx)\n",
+		num_entities, lookup_mt, view_mt, lookup_mt / view_mt);
+	printf("%7d entities  Mesh+Transform+Collider  lookup %6.2f ns  each %6.2f ns  (%.2fx)\n",
+		num_entities, lookup_mtc, view_mtc, lookup_mtc / view_mtc);
+}
+
+int main() {
+	printf("ns per entity, best of %d runs\n", REPEATS);
+	run(10000);
+	run(100000);
+	return 0;
+}
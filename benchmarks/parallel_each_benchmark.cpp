@@ -0,0 +1,93 @@
+//ECS.parallel_each<T>() on 100k components, on 1..N threads (N is the number of cores, or
+//the first argument) and a few grain sizes. Two loops, as in the engine:
+//- transform: world and normal matrices of a two level hierarchy (TransformSystem::update)
+//- collider reset: three stores per component (CollisionSystem::update)
+//Prints mean time of each loop and speedup against one thread with the same grain size
+#include "EntityComponentStore.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+static const int NUM_ENTITIES = 100000;
+static const int NUM_ROOTS = 1000; //rest are children of these
+static const int REPEATS = 50;
+static const int GRAIN_SIZES[] = { 64, 256, 1024 };
+static const int NUM_GRAIN_SIZES = sizeof(GRAIN_SIZES) / sizeof(GRAIN_SIZES[0]);
+
+//mean time of REPEATS runs of f, in ms, after one warm up run
+template<typename F>
+static double timeLoop(F f) {
+	f();
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int r = 0; r < REPEATS; r++)
+		f();
+	return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / REPEATS;
+}
+
+//roots first, then their children, so both levels are contiguous as TransformSystem sorts them
+static void createScene(EntityComponentStore& store) {
+	for (int i = 0; i < NUM_ENTITIES; i++) {
+		int ent = store.createEntity("e");
+		Transform& t = store.getComponentFromEntity<Transform>(ent);
+		t.translate((float)(i % 100), (float)(i / 100 % 100), (float)(i / 10000));
+		t.rotateLocal(i * 0.01f, lm::vec3(0.0f, 1.0f, 0.0f));
+		t.scaleLocal(1.0f, 1.0f + (i % 3), 1.0f);
+		if (i >= NUM_ROOTS) t.setParent(i % NUM_ROOTS);
+		store.createComponentForEntity<Collider>(ent);
+	}
+}
+
+int main(int argc, char** argv) {
+	int max_threads = argc > 1 ? atoi(argv[1]) : (int)std::thread::hardware_concurrency();
+	if (max_threads < 1) max_threads = 1;
+
+	EntityComponentStore store;
+	createScene(store);
+	auto& transforms = store.getAllComponents<Transform>();
+
+	double transform_ms[NUM_GRAIN_SIZES], reset_ms[NUM_GRAIN_SIZES];
+	double transform_base[NUM_GRAIN_SIZES], reset_base[NUM_GRAIN_SIZES];
+
+	printf("%d entities, mean of %d runs, %d cores\n", NUM_ENTITIES, REPEATS, (int)std::thread::hardware_concurrency());
+	for (int threads = 1; threads <= max_threads; threads++) {
+		JobSystem jobs;
+		jobs.init(threads - 1);
+		for (int g = 0; g < NUM_GRAIN_SIZES; g++) {
+			const int grain = GRAIN_SIZES[g];
+			transform_ms[g] = timeLoop([&]() {
+				//one pass per level, as parents must be done before their children
+				int levels[] = { 0, NUM_ROOTS, NUM_ENTITIES };
+				for (int l = 0; l < 2; l++) {
+					store.parallel_each<Transform>(jobs, 0, signatureOf<Transform>(), grain, levels[l], levels[l + 1],
+												   [&transforms](int i, Transform& t) {
+						if (t.parent != -1)
+							t.world = transforms[t.parent].world * t;
+						else
+							t.world = t;
+						t.normal_matrix = lm::Affine3x4(t.world).inverseTranspose().toMat4();
+					});
+				}
+			});
+			reset_ms[g] = timeLoop([&]() {
+				store.parallel_each<Collider>(jobs, 0, signatureOf<Collider>(), grain, [](int i, Collider& col) {
+					col.colliding = false;
+					col.collision_distance = 10000000.0f;
+					col.other = -1;
+				});
+			});
+			if (threads == 1) {
+				transform_base[g] = transform_ms[g];
+				reset_base[g] = reset_ms[g];
+			}
+		}
+		jobs.shutdown();
+
+		for (int g = 0; g < NUM_GRAIN_SIZES; g++) {
+			printf("%2d threads  grain %4d  transform %7.3f ms (%.2fx)  collider reset %7.3f ms (%.2fx)\n",
+				   threads, GRAIN_SIZES[g], transform_ms[g], transform_base[g] / transform_ms[g],
+				   reset_ms[g], reset_base[g] / reset_ms[g]);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,215 @@
+//Renders a generated scene in a hidden window and prints draw calls, frame time and shadow
+//pass times, for comparing the render paths switched by GraphicsSystem flags.
+//Scene: a floor, a square grid of cubes and a row of shadow casting lights looking down on it.
+//Run from the repository root, so that data/ is found:
+//	render_benchmark [-instances N] [-lights N] [-frames N] [-no-instancing] [-layered] [-dynamic]
+// -instances N    cubes in grid (default 50000)
+// -lights N       shadow casting lights (default 1)
+// -frames N       frames measured, after WARMUP_FRAMES (default 50)
+// -no-instancing  one draw call per mesh (GraphicsSystem::use_instancing off)
+// -layered        casters of all lights in one layered pass (GraphicsSystem::use_layered_shadows)
+// -dynamic        move every cube each frame, so no caster is ever cached as static
+#include "includes.h"
+#include "extern.h"
+#include "GraphicsSystem.h"
+#include "TransformSystem.h"
+#include "Shader.h"
+#include "Parsers.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+EntityComponentStore ECS;
+JobSystem JOBS;
+GLState GLSTATE;
+
+bool glCheckError() {
+	GLenum errCode;
+	if ((errCode = glGetError()) != GL_NO_ERROR) {
+		std::cerr << "OpenGL Error: " << errCode << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void print(lm::vec3 v) { std::cout << v.x << ", " << v.y << ", " << v.z << "\n"; }
+void print(std::string s) { std::cout << s << "\n"; }
+void print(float f) { std::cout << f << "\n"; }
+void print(int i) { std::cout << i << "\n"; }
+
+static const int WINDOW_WIDTH = 800;
+static const int WINDOW_HEIGHT = 600;
+static const int WARMUP_FRAMES = 5; //shaders, buffers and static shadow caches settle here
+
+struct Options {
+	int instances = 50000;
+	int lights = 1;
+	int frames = 50;
+	bool instancing = true;
+	bool layered = false;
+	bool dynamic = false;
+};
+
+static bool parseOptions_(int argc, char** argv, Options& options) {
+	for (int i = 1; i < argc; i++) {
+		const bool has_value = i + 1 < argc;
+		if (!strcmp(argv[i], "-instances") && has_value) options.instances = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-lights") && has_value) options.lights = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-frames") && has_value) options.frames = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-no-instancing")) options.instancing = false;
+		else if (!strcmp(argv[i], "-layered")) options.layered = true;
+		else if (!strcmp(argv[i], "-dynamic")) options.dynamic = true;
+		else {
+			std::cerr << "ERROR: unknown option " << argv[i] << std::endl;
+			return false;
+		}
+	}
+	return options.frames > 0;
+}
+
+//floor, square grid of cubes centered on origin (as Game::createInstanceField_) and a
+//row of lights above the grid, each with an orthographic shadow tile looking down
+static void createScene_(GraphicsSystem& graphics, const Options& options) {
+	Shader* phong_shader = graphics.loadShader("data/shaders/phong.vert", "data/shaders/phong.frag");
+	int geom_floor = graphics.createGeometryFromFile("data/assets/floor_40x40.obj");
+	int geom_cube = graphics.createGeometryFromFile("data/assets/cubemap.obj");
+
+	int mat_index = graphics.createMaterial();
+	Material& mat = graphics.getMaterial(mat_index);
+	mat.shader_id = phong_shader->program;
+	mat.diffuse_map = Parsers::parseTexture("data/assets/block_blue.tga");
+	mat.specular = lm::vec3(0.0f, 0.0f, 0.0f);
+	mat.ambient = lm::vec3(0.0f, 0.0f, 0.0f);
+
+	int floor_entity = ECS.createEntity("floor");
+	Mesh& floor_mesh = ECS.createComponentForEntity<Mesh>(floor_entity);
+	floor_mesh.geometry = geom_floor;
+	floor_mesh.material = mat_index;
+	floor_mesh.cast_shadows = false;
+
+	int side = (int)ceilf(sqrtf((float)options.instances));
+	float spacing = 1.5f;
+	float start = -0.5f * spacing * (side - 1);
+	for (int i = 0; i < options.instances; i++) {
+		int ent = ECS.createEntity("instance_" + std::to_string(i));
+		Transform& t = ECS.getComponentFromEntity<Transform>(ent);
+		t.translate(start + spacing * (i % side), 0.5f, start + spacing * (i / side));
+		t.scale(0.5f, 0.5f, 0.5f);
+		Mesh& mesh = ECS.createComponentForEntity<Mesh>(ent);
+		mesh.geometry = geom_cube;
+		mesh.material = mat_index;
+	}
+
+	for (int i = 0; i < options.lights; i++) {
+		int ent = ECS.createEntity("light_" + std::to_string(i));
+		lm::vec3 position(-12.0f + 24.0f * (i + 0.5f) / options.lights, 6.0f, 0.0f);
+		ECS.getComponentFromEntity<Transform>(ent).translate(position);
+		Light& light = ECS.createComponentForEntity<Light>(ent);
+		light.type = 1;
+		light.direction = lm::vec3(0.0f, -1.0f, 0.0f);
+		light.color = lm::vec3(1.0f, 1.0f, 1.0f) * (1.0f / options.lights);
+		light.position = position;
+		light.forward = light.direction;
+		light.up = lm::vec3(0.0f, 0.0f, -1.0f);
+		light.setOrthographic(-6, 6, -6, 6, 0.1f, 30);
+		light.cast_shadow = 1;
+		light.resolution = 1024;
+		light.update();
+	}
+
+	int camera_entity = ECS.createEntity("camera");
+	Camera& camera = ECS.createComponentForEntity<Camera>(camera_entity);
+	lm::vec3 camera_position(0.0f, 5.0f, 15.0f);
+	ECS.getComponentFromEntity<Transform>(camera_entity).translate(camera_position);
+	camera.position = camera_position;
+	camera.forward = lm::vec3(0, -0.3f, -1.0f);
+	camera.setPerspective(60.0f*DEG2RAD, (float)WINDOW_WIDTH / (float)WINDOW_HEIGHT, 0.1f, 10000.0f);
+	ECS.main_camera = ECS.getComponentID<Camera>(camera_entity);
+}
+
+int main(int argc, char** argv) {
+	Options options;
+	if (!parseOptions_(argc, argv, options)) {
+		std::cerr << "usage: render_benchmark [-instances N] [-lights N] [-frames N] [-no-instancing] [-layered] [-dynamic]" << std::endl;
+		return -1;
+	}
+
+	if (!glfwInit())
+		return -1;
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	GLFWwindow* window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "render_benchmark", NULL, NULL);
+	if (!window) {
+		std::cerr << "ERROR: could not create window" << std::endl;
+		glfwTerminate();
+		return -1;
+	}
+	glfwMakeContextCurrent(window);
+	glfwSwapInterval(0);
+	glewExperimental = GL_TRUE;
+	glewInit();
+	std::cout << "Renderer: " << glGetString(GL_RENDERER) << "; version: " << glGetString(GL_VERSION) << std::endl;
+
+	//systems are created after the context, and destroyed before it
+	{
+		JOBS.init();
+		GraphicsSystem graphics;
+		TransformSystem transforms;
+		transforms.init();
+		graphics.init(WINDOW_WIDTH, WINDOW_HEIGHT, "data/assets/");
+		createScene_(graphics, options);
+		graphics.lateInit();
+		graphics.updateMainViewport(WINDOW_WIDTH, WINDOW_HEIGHT);
+		graphics.use_instancing = options.instancing;
+		graphics.use_layered_shadows = options.layered;
+
+		const float dt = 1.0f / 60.0f;
+		double draw_calls = 0.0, shadow_cpu_ms = 0.0, shadow_gpu_ms = 0.0;
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int frame = 0; frame < WARMUP_FRAMES + options.frames; frame++) {
+			if (frame == WARMUP_FRAMES) {
+				glFinish();
+				start = std::chrono::high_resolution_clock::now();
+			}
+			if (options.dynamic) {
+				float offset = (frame % 2 ? 0.01f : -0.01f);
+				for (Mesh& mesh : ECS.getAllComponents<Mesh>())
+					ECS.getComponentFromEntity<Transform>(mesh.owner).translate(0.0f, offset, 0.0f);
+			}
+
+			//same order as Game frame graph, on this thread
+			GLSTATE.beginFrame();
+			transforms.update(dt);
+			graphics.updateCameras();
+			graphics.cullMeshes();
+			graphics.update(dt);
+			JOBS.endFrame();
+			glfwSwapBuffers(window);
+
+			if (frame >= WARMUP_FRAMES) {
+				draw_calls += graphics.getDrawCalls();
+				shadow_cpu_ms += graphics.getShadowTime(false);
+				shadow_gpu_ms += graphics.getShadowTime(true);
+			}
+		}
+		glFinish();
+		glCheckError();
+		double frame_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / options.frames;
+
+		printf("%d cubes, %d shadow lights, instancing %s, layered shadows %s, %s casters\n",
+			options.instances, options.lights, options.instancing ? "on" : "off",
+			options.layered ? "on" : "off", options.dynamic ? "dynamic" : "static");
+		printf("mean of %d frames: draw calls %.0f, frame %.2f ms, shadow pass CPU %.2f ms, GPU %.2f ms\n",
+			options.frames, draw_calls / options.frames, frame_ms,
+			shadow_cpu_ms / options.frames, shadow_gpu_ms / options.frames);
+		JOBS.shutdown();
+	}
+
+	glfwDestroyWindow(window);
+	glfwTerminate();
+	return 0;
+}
@@ -1,26 +1,44 @@
 #version 330
 
-in vec2 v_uv;
-out vec4 fragColor;
-
 layout (location = 0) out vec4 g_phong;
-layout (location = 1) out vec3 g_bloom;
 
-//basic material uniforms
-uniform sampler2D u_tex_position;
-uniform sampler2D u_tex_normal;
+//gbuffer, see Framebuffer::initGBuffer2
+uniform sampler2D u_tex_depth;
+uniform sampler2D u_tex_normal; // octahedron encoded
 uniform sampler2D u_tex_albedo;
-uniform sampler2D u_tex_ambient;
+uniform usampler2D u_tex_material; // material index, bloom flag in top bit
+uniform mat4 u_inv_vp; // of main camera, to rebuild position from depth
+
+const uint BLOOM_BIT = 0x8000u;
 
-// Bloom texture
-uniform sampler2D u_tex_bloom;
+//ambient of each material, same block as gbuffer.frag
+struct Material {
+    vec4 ambient;
+    vec4 diffuse;
+    vec4 specular;
+    float specular_gloss;
+    int bloom;
+    int diffuse_array;
+    int diffuse_layer;
+};
+const int MAX_MATERIALS = 256;
+layout(std140) uniform u_materials_ubo
+{
+    Material materials[MAX_MATERIALS];
+};
 
 uniform vec3 u_cam_pos; 
 
-const int MAX_LIGHTS = 8;
+//shadows: one tile of the atlas per light which casts them, or per cascade
+uniform sampler2D u_shadow_atlas;
 
-//shadows
-uniform sampler2D u_shadow_map[MAX_LIGHTS];
+//matrix and tile of every shadow tile, for the cascades of directional lights
+const int MAX_SHADOW_MAPS = 8;
+layout(std140) uniform u_shadow_tiles_ubo
+{
+    mat4 u_tile_vp[MAX_SHADOW_MAPS];
+    vec4 u_tile_rect[MAX_SHADOW_MAPS];
+};
 
 //light structs and uniforms
 struct Light {
@@ -34,13 +52,80 @@ struct Light {
     mat4 view_projection;
     int type; // 0 - directional; 1 - point; 2 - spot
     int cast_shadow;
+    int shadow_map; // -1 if none
+    int shadow_cascades; // tiles from shadow_map on, in u_shadow_tiles_ubo
+    vec4 shadow_tile; // x, y and size in atlas uv, and size in texels
 };
-uniform int u_num_lights;
 
-layout (std140) uniform u_lights_ubo
-{
-    Light lights[MAX_LIGHTS]; 
-};
+//all lights, 10 texels each (GraphicsSystem::LightBlock), as raw bits
+uniform usamplerBuffer u_lights;
+
+Light fetchLight(int i) {
+    int t = i * 10;
+    Light l;
+    l.position = uintBitsToFloat(texelFetch(u_lights, t));
+    l.direction = uintBitsToFloat(texelFetch(u_lights, t + 1));
+    l.color = uintBitsToFloat(texelFetch(u_lights, t + 2));
+    vec4 att = uintBitsToFloat(texelFetch(u_lights, t + 3));
+    l.linear_att = att.x;
+    l.quadratic_att = att.y;
+    l.spot_inner_cosine = att.z;
+    l.spot_outer_cosine = att.w;
+    l.view_projection = mat4(uintBitsToFloat(texelFetch(u_lights, t + 4)), uintBitsToFloat(texelFetch(u_lights, t + 5)),
+                             uintBitsToFloat(texelFetch(u_lights, t + 6)), uintBitsToFloat(texelFetch(u_lights, t + 7)));
+    ivec4 ints = ivec4(texelFetch(u_lights, t + 8));
+    l.type = ints.x;
+    l.cast_shadow = ints.y;
+    l.shadow_map = ints.z;
+    l.shadow_cascades = ints.w;
+    l.shadow_tile = uintBitsToFloat(texelFetch(u_lights, t + 9));
+    return l;
+}
+
+//light clusters (see LightClusters): grid has (offset, count) in u_cluster_lights per cluster
+uniform usamplerBuffer u_cluster_grid;
+uniform usamplerBuffer u_cluster_lights;
+uniform mat4 u_view;
+uniform vec3 u_cluster_dims;
+uniform vec3 u_cluster_depth; // near plane, slices per log unit of depth
+uniform int u_light_heatmap;
+
+//lights shaded by a pass, see GraphicsSystem::renderGbuffer
+const int LIGHTS_CLUSTERED = -1; // all lights of pixel's cluster, plus ambient
+const int LIGHTS_NONE = -2; // only ambient, light volume passes add lights after
+uniform int u_light_index; // or >= 0: only this light, added to what earlier passes drew
+
+//cluster of a pixel, from its screen tile and view depth
+int clusterIndex(vec2 uv, vec3 position) {
+    ivec3 dims = ivec3(u_cluster_dims);
+    ivec2 tile = ivec2(uv * u_cluster_dims.xy);
+    float depth = -(u_view * vec4(position, 1.0)).z;
+    int slice = int(floor(log(max(depth, u_cluster_depth.x) / u_cluster_depth.x) * u_cluster_depth.y));
+    tile = clamp(tile, ivec2(0), dims.xy - 1);
+    slice = clamp(slice, 0, dims.z - 1);
+    return tile.x + dims.x * (tile.y + dims.y * slice);
+}
+
+//blue (few lights) to red (many), t in 0..1
+vec3 heatmap(float t) {
+    t = clamp(t, 0.0, 1.0);
+    return clamp(vec3(1.5 - abs(4.0 * t - 3.0), 1.5 - abs(4.0 * t - 2.0), 1.5 - abs(4.0 * t - 1.0)), 0.0, 1.0);
+}
+
+//inverse of octEncode in gbuffer.frag
+vec3 octDecode(vec2 e) {
+    e = e * 2.0 - 1.0;
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (n.z < 0.0)
+        n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return normalize(n);
+}
+
+//world position of a pixel from its depth buffer value
+vec3 worldPosition(vec2 uv, float depth) {
+    vec4 p = u_inv_vp * vec4(vec3(uv, depth) * 2.0 - 1.0, 1.0);
+    return p.xyz / p.w;
+}
 
 float random(vec4 seed4){
     float dot_product = dot(seed4, vec4(12.9898,78.233,45.164,94.673));
@@ -54,7 +139,12 @@ vec2 poissonDisk[4] = vec2[](
                              vec2( 0.34495938, 0.29387760 )
                              );
 
-float shadowCalculationPoisson(vec4 fragment_light_space, float NdotL, int light_index) {
+//position in light clip space is inside a tile, away from its border
+bool inShadowTile(vec4 position_light_space) {
+    return all(lessThan(abs(position_light_space.xyz), vec3(0.98 * position_light_space.w)));
+}
+
+float shadowCalculationPoisson(vec4 fragment_light_space, float NdotL, vec4 shadow_tile) {
     
     //gl_position does this divide automatically. But we need to do it manually
     //result is current fragment coordinates in light clip space
@@ -76,13 +166,14 @@ float shadowCalculationPoisson(vec4 fragment_light_space, float NdotL, int light
         
         float bias = max(0.05 * (1.0 - NdotL), 0.005);
 
-        vec2 texel_size = 1.0 / textureSize(u_shadow_map[light_index], 0);
+        //samples are kept half a texel inside the tile, so they never read its neighbours
+        float texel_size = 1.0 / shadow_tile.w;
         for (int i = 0;i < 4; i++){
             
             int index = int(4*random(vec4(gl_FragCoord.xyy, i))) % 4;
             
-            float poisson_depth = texture( u_shadow_map[light_index],
-                                          proj_coords.xy + poissonDisk[index] * texel_size).r;
+            vec2 tile_uv = clamp(proj_coords.xy + poissonDisk[index] * texel_size, 0.5 * texel_size, 1.0 - 0.5 * texel_size);
+            float poisson_depth = texture(u_shadow_atlas, shadow_tile.xy + tile_uv * shadow_tile.z).r;
             
             shadow += current_depth - bias > poisson_depth ? 1.0 : 0.0;
         }
@@ -93,78 +184,98 @@ float shadowCalculationPoisson(vec4 fragment_light_space, float NdotL, int light
     return shadow;
 }
 
-void main(){
+vec3 shadeLight(Light light, vec3 position, vec3 normal, vec3 diffuse, float specular) {
 
-	//get basic material from texture
-    vec3 position = texture(u_tex_position, v_uv).xyz;
-    vec3 normal = texture(u_tex_normal, v_uv).xyz;
-    vec4 albedo = texture(u_tex_albedo, v_uv).xyzw;
-    vec3 diffuse = albedo.xyz;
-    float specular = albedo.w;
-
-    vec3 final_color = vec3 (0.0, 0.0, 0.0);
-    for (int i = 0; i < u_num_lights; i++) {
+    float attenuation = 1.0;
+    
+    float spot_cone_intensity = 1.0;
+    
+    vec3 L = normalize(-light.direction.xyz); // for directional light
+    vec3 N = normalize(normal); //normal
+    vec3 R = reflect(-L,N); //reflection vector
+    vec3 V = normalize(u_cam_pos - position); //to camera
+    
+    if (light.type > 0) {
+    
+        vec3 point_to_light = light.position.xyz - position;
+        L = normalize(point_to_light);
 
-        float attenuation = 1.0;
-        
-        float spot_cone_intensity = 1.0;
-        
-        vec3 L = normalize(-lights[i].direction.xyz); // for directional light
-        vec3 N = normalize(normal); //normal
-        vec3 R = reflect(-L,N); //reflection vector
-        vec3 V = normalize(u_cam_pos - position); //to camera
-        
-        if (lights[i].type > 0) {
-        
-            vec3 point_to_light = lights[i].position.xyz - position;
-            L = normalize(point_to_light);
-
-            // soft spot cone
-            if (lights[i].type == 2) {
-                vec3 D = normalize(lights[i].direction.xyz);
-                float cos_theta = dot(D, -L);
-                
-                float numer = cos_theta - lights[i].spot_outer_cosine;
-                float denom = lights[i].spot_inner_cosine - lights[i].spot_outer_cosine;
-                spot_cone_intensity = clamp(numer/denom, 0.0, 1.0);
-            }
+        // soft spot cone
+        if (light.type == 2) {
+            vec3 D = normalize(light.direction.xyz);
+            float cos_theta = dot(D, -L);
             
-            //attenuation
-            float distance = length(point_to_light);
-            attenuation = 1.0 / (1.0 + lights[i].linear_att * distance + lights[i].quadratic_att * (distance * distance));
+            float numer = cos_theta - light.spot_outer_cosine;
+            float denom = light.spot_inner_cosine - light.spot_outer_cosine;
+            spot_cone_intensity = clamp(numer/denom, 0.0, 1.0);
         }
         
-        
-        //diffuse color
-        float NdotL = max(0.0, dot(N, L));
-        vec3 diffuse_color = NdotL * diffuse * lights[i].color.xyx;
-                             
-        //specular color
-        float RdotV = max(0.0, dot(R, V)); //calculate dot product
-        RdotV = pow(RdotV, 1.0f); //raise to power for glossiness effect
-        vec3 specular_color = RdotV * lights[i].color.xyz * specular;
-
-        //shadow
-        
-        vec4 position_light_space = lights[i].view_projection * vec4(position, 1.0);
-        
-        float shadow = (lights[i].cast_shadow == 1 ? shadowCalculationPoisson(position_light_space, NdotL, i) : 0.0);
+        //attenuation
+        float distance = length(point_to_light);
+        attenuation = 1.0 / (1.0 + light.linear_att * distance + light.quadratic_att * (distance * distance));
+    }
+    
+    
+    //diffuse color
+    float NdotL = max(0.0, dot(N, L));
+    vec3 diffuse_color = NdotL * diffuse * light.color.xyx;
+                         
+    //specular color
+    float RdotV = max(0.0, dot(R, V)); //calculate dot product
+    RdotV = pow(RdotV, 1.0f); //raise to power for glossiness effect
+    vec3 specular_color = RdotV * light.color.xyz * specular;
+
+    //shadow, from the first cascade whose tile holds the position
+    
+    vec4 position_light_space = light.view_projection * vec4(position, 1.0);
+    vec4 shadow_tile = light.shadow_tile;
+    for (int c = 1; c < light.shadow_cascades && !inShadowTile(position_light_space); c++) {
+        position_light_space = u_tile_vp[light.shadow_map + c] * vec4(position, 1.0);
+        shadow_tile = u_tile_rect[light.shadow_map + c];
+    }
+    
+    float shadow = (light.cast_shadow == 1 && light.shadow_map >= 0 ? shadowCalculationPoisson(position_light_space, NdotL, shadow_tile) : 0.0);
+
+    //final color
+    return ((diffuse_color + specular_color) * attenuation * spot_cone_intensity) * (1.0 - shadow);
+}
 
-        //final color
-        final_color += ((diffuse_color + specular_color) * attenuation * spot_cone_intensity) * (1.0 - shadow);
+void main(){
+
+    //light volumes are not full screen, so uv comes from pixel position
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    ivec2 gbuffer_size = textureSize(u_tex_depth, 0);
+    vec2 uv = gl_FragCoord.xy / vec2(gbuffer_size);
+
+	//get basic material from texture
+    float depth = texelFetch(u_tex_depth, pixel, 0).r;
+    bool has_geometry = depth < 1.0;
+    vec3 position = worldPosition(uv, depth);
+    vec3 normal = octDecode(texelFetch(u_tex_normal, pixel, 0).xy);
+    vec4 albedo = texelFetch(u_tex_albedo, pixel, 0);
+    vec3 diffuse = albedo.xyz;
+    float specular = albedo.w;
+
+    //one light, blended onto earlier passes
+    if (u_light_index >= 0) {
+        g_phong = vec4(shadeLight(fetchLight(u_light_index), position, normal, diffuse, specular), 1.0);
+        return;
     }
 
-    final_color += texture(u_tex_ambient, v_uv).xyz;
-    g_phong = vec4(final_color, 1.0);
+    //only lights touching this pixel's cluster
+    uvec2 cluster = uvec2(0u);
+    if (u_light_index == LIGHTS_CLUSTERED && has_geometry)
+        cluster = texelFetch(u_cluster_grid, clusterIndex(uv, position)).xy;
 
-    vec2 tex_size = 1.0 / textureSize(u_tex_bloom, 0);
-    vec3 bloom = vec3(0,0,0);
-    int size = 10;
-    for(int i = -size; i < size; ++i) {
-        for(int j = -size; j < size; ++j) {
-            bloom += texture(u_tex_bloom, v_uv + vec2(tex_size.x * j * 7, tex_size.y * i * 7)).rgb;
-        }
+    vec3 final_color = vec3 (0.0, 0.0, 0.0);
+    for (uint k = 0u; k < cluster.y; k++) {
+        Light light = fetchLight(int(texelFetch(u_cluster_lights, int(cluster.x + k)).x));
+        final_color += shadeLight(light, position, normal, diffuse, specular);
     }
-    g_bloom = bloom / ((2 * size + 1) *(2 * size + 1));
 
+    if (has_geometry)
+        final_color += materials[texelFetch(u_tex_material, pixel, 0).x & ~BLOOM_BIT].ambient.xyz;
+    if (u_light_heatmap == 1)
+        final_color = mix(final_color, cluster.y == 0u ? vec3(0.0) : heatmap(float(cluster.y) / 64.0), 0.75);
+    g_phong = vec4(final_color, 1.0);
 }
@@ -0,0 +1,18 @@
+#version 330
+
+in vec2 v_uv;
+out vec4 fragColor;
+
+uniform sampler2D u_tex_bloom; // previous (larger) level
+uniform vec2 u_texel_size; // of previous level
+
+//dual filter downsample: center and 4 diagonal bilinear taps, 1 texel away, cover 4x4 texels
+void main() {
+    vec2 d = u_texel_size;
+    vec3 color = texture(u_tex_bloom, v_uv).rgb * 4.0;
+    color += texture(u_tex_bloom, v_uv + vec2(-d.x, -d.y)).rgb;
+    color += texture(u_tex_bloom, v_uv + vec2( d.x, -d.y)).rgb;
+    color += texture(u_tex_bloom, v_uv + vec2(-d.x,  d.y)).rgb;
+    color += texture(u_tex_bloom, v_uv + vec2( d.x,  d.y)).rgb;
+    fragColor = vec4(color / 8.0, 1.0);
+}
@@ -0,0 +1,25 @@
+#version 330
+
+in vec2 v_uv;
+out vec4 fragColor;
+
+//gbuffer, see Framebuffer::initGBuffer2
+uniform sampler2D u_tex_albedo;
+uniform usampler2D u_tex_material; // material index, bloom flag in top bit
+
+const uint BLOOM_BIT = 0x8000u;
+
+//bright pass: albedo of bloom materials, averaged over the 2x2 gbuffer pixels under
+//this texel of the first bloom level
+void main() {
+    ivec2 size = textureSize(u_tex_albedo, 0);
+    ivec2 first = ivec2(floor(v_uv * vec2(size) - 0.5));
+
+    vec3 color = vec3(0.0);
+    for (int i = 0; i < 4; i++) {
+        ivec2 p = clamp(first + ivec2(i & 1, i >> 1), ivec2(0), size - 1);
+        if ((texelFetch(u_tex_material, p, 0).x & BLOOM_BIT) != 0u)
+            color += texelFetch(u_tex_albedo, p, 0).rgb;
+    }
+    fragColor = vec4(color * 0.25, 1.0);
+}
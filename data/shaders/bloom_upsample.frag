@@ -0,0 +1,24 @@
+#version 330
+
+in vec2 v_uv;
+out vec4 fragColor;
+
+uniform sampler2D u_tex_bloom; // next (smaller) level
+uniform vec2 u_texel_size; // of next level
+uniform float u_bloom_radius; // share of this level replaced by the wider one
+
+//dual filter upsample: tent of 4 diagonal taps half a texel away and 4 axis taps one texel
+//away. Alpha is the blend factor with what this level holds (see GraphicsSystem::renderBloom_)
+void main() {
+    vec2 d = u_texel_size;
+    vec3 color = vec3(0.0);
+    color += texture(u_tex_bloom, v_uv + vec2(-d.x, 0.0)).rgb;
+    color += texture(u_tex_bloom, v_uv + vec2( d.x, 0.0)).rgb;
+    color += texture(u_tex_bloom, v_uv + vec2(0.0, -d.y)).rgb;
+    color += texture(u_tex_bloom, v_uv + vec2(0.0,  d.y)).rgb;
+    color += texture(u_tex_bloom, v_uv + vec2(-d.x, -d.y) * 0.5).rgb * 2.0;
+    color += texture(u_tex_bloom, v_uv + vec2( d.x, -d.y) * 0.5).rgb * 2.0;
+    color += texture(u_tex_bloom, v_uv + vec2(-d.x,  d.y) * 0.5).rgb * 2.0;
+    color += texture(u_tex_bloom, v_uv + vec2( d.x,  d.y) * 0.5).rgb * 2.0;
+    fragColor = vec4(color / 12.0, u_bloom_radius);
+}
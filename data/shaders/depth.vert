@@ -2,8 +2,19 @@
 
 layout(location = 0) in vec3 a_vertex;
 
-uniform mat4 u_mvp;
+//light view projection
+layout(std140) uniform u_view_ubo
+{
+    mat4 u_vp;
+    vec4 u_cam_pos;
+};
+
+//per draw block, selected with an offset in uniform ring
+layout(std140) uniform u_draw_ubo
+{
+    mat4 u_model;
+};
 
 void main() {
-    gl_Position = u_mvp * vec4(a_vertex, 1);
+    gl_Position = u_vp * u_model * vec4(a_vertex, 1);
 }
\ No newline at end of file
@@ -0,0 +1,17 @@
+#version 330
+
+layout(location = 0) in vec3 a_vertex;
+
+//per instance model matrix (takes locations 4 to 7)
+layout(location = 4) in mat4 a_model;
+
+//light view projection
+layout(std140) uniform u_view_ubo
+{
+    mat4 u_vp;
+    vec4 u_cam_pos;
+};
+
+void main() {
+    gl_Position = u_vp * a_model * vec4(a_vertex, 1);
+}
\ No newline at end of file
@@ -0,0 +1,36 @@
+#version 330
+
+layout(location = 0) in vec3 a_vertex;
+
+//per instance model matrix (takes locations 4 to 7), shared by the u_num_layers
+//consecutive instances which draw it into each layer
+layout(location = 4) in mat4 a_model;
+
+const int MAX_SHADOW_MAPS = 8;
+
+//light and shadow atlas tile of each layer (GraphicsSystem::ShadowLayersBlock). Tile is
+//in atlas clip space: x, y of its lower corner, and its size
+layout(std140) uniform u_shadow_layers_ubo
+{
+    mat4 u_layer_vp[MAX_SHADOW_MAPS];
+    vec4 u_layer_tile[MAX_SHADOW_MAPS];
+};
+uniform int u_num_layers;
+
+out float gl_ClipDistance[4];
+
+void main() {
+    int layer = gl_InstanceID % u_num_layers;
+    vec4 position = u_layer_vp[layer] * a_model * vec4(a_vertex, 1);
+
+    //clip to the sides of the light frustum, which become the sides of the tile
+    gl_ClipDistance[0] = position.w + position.x;
+    gl_ClipDistance[1] = position.w - position.x;
+    gl_ClipDistance[2] = position.w + position.y;
+    gl_ClipDistance[3] = position.w - position.y;
+
+    //light clip space -1..1 to the tile, before the divide by w
+    vec4 tile = u_layer_tile[layer];
+    position.xy = position.xy * tile.z * 0.5 + (tile.xy + tile.z * 0.5) * position.w;
+    gl_Position = position;
+}
@@ -1,24 +1,57 @@
 #version 330
 
-layout (location = 0) out vec3 g_position;
-layout (location = 1) out vec3 g_normal;
-layout (location = 2) out vec4 g_albedo;
-layout (location = 3) out vec3 g_bloom;
-layout (location = 4) out vec3 g_depth;
-layout (location = 5) out vec3 g_ambient;
+//see Framebuffer::initGBuffer2. Position is rebuilt from depth in lighting
+layout (location = 0) out vec4 g_albedo;
+layout (location = 1) out vec2 g_normal; // octahedron encoded
+layout (location = 2) out uint g_material; // material index, bloom flag in top bit
+
+const uint BLOOM_BIT = 0x8000u;
 
 in vec2 v_uv;
 in vec3 v_normal;
 in vec3 v_vertex_world_pos;
+flat in int v_material;
 
 uniform float u_normal_factor;
 
-uniform int u_use_diffuse_map;
-uniform sampler2D u_diffuse_map;
-uniform vec3 u_diffuse;
-uniform vec3 u_specular;
-uniform vec3 u_ambient;
-uniform int u_bloom;
+//parameters of all materials, indexed by material id
+struct Material {
+    vec4 ambient;
+    vec4 diffuse;
+    vec4 specular;
+    float specular_gloss;
+    int bloom;
+    int diffuse_array; //-1 if no diffuse map
+    int diffuse_layer;
+};
+const int MAX_MATERIALS = 256;
+layout(std140) uniform u_materials_ubo
+{
+    Material materials[MAX_MATERIALS];
+};
+
+//diffuse maps of all materials, one array per map size
+uniform sampler2DArray u_diffuse_arrays[4];
+
+//arrays can only be indexed with constants. Gradients come from outside the branch, as
+//derivatives are undefined where neighbour fragments take another branch
+vec3 sampleDiffuseMap(int array, int layer, vec2 uv, vec2 uv_dx, vec2 uv_dy) {
+    vec3 coord = vec3(uv, float(layer));
+    if (array == 0) return textureGrad(u_diffuse_arrays[0], coord, uv_dx, uv_dy).xyz;
+    if (array == 1) return textureGrad(u_diffuse_arrays[1], coord, uv_dx, uv_dy).xyz;
+    if (array == 2) return textureGrad(u_diffuse_arrays[2], coord, uv_dx, uv_dy).xyz;
+    return textureGrad(u_diffuse_arrays[3], coord, uv_dx, uv_dy).xyz;
+}
+
+//unit normal to a point of the octahedron |x|+|y|+|z| = 1, whose lower half is folded over
+//the upper one, so it fits in a square. Result is mapped to 0..1
+vec2 octEncode(vec3 n) {
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    vec2 e = n.xy;
+    if (n.z < 0.0)
+        e = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return e * 0.5 + 0.5;
+}
 
 mat3 cotangent_frame(vec3 N, vec3 p, vec2 uv)
 {
@@ -54,26 +87,20 @@ vec3 perturbNormal( vec3 N, vec3 P, vec2 texcoord, vec3 normal_sample )
 
 void main() {
 
-    g_position = v_vertex_world_pos;
+    g_normal = octEncode(normalize(v_normal));
 
-    g_normal = normalize(v_normal);
+    Material m = materials[v_material];
+    vec2 uv_dx = dFdx(v_uv);
+    vec2 uv_dy = dFdy(v_uv);
 
-    vec3 diffuse_color = u_diffuse;
-    if (u_use_diffuse_map == 1)
-        diffuse_color *= texture(u_diffuse_map, v_uv).xyz;
+    vec3 diffuse_color = m.diffuse.xyz;
+    if (m.diffuse_array >= 0)
+        diffuse_color *= sampleDiffuseMap(m.diffuse_array, m.diffuse_layer, v_uv, uv_dx, uv_dy);
 
-    float specular = (u_specular.x + u_specular.y + u_specular.z) / 3.0;
+    float specular = (m.specular.x + m.specular.y + m.specular.z) / 3.0;
 
     g_albedo = vec4(diffuse_color, specular); 
 
-    if (u_bloom == 1){
-        g_bloom = diffuse_color.xyz;
-    } else {
-        g_bloom = vec3(0.0,0.0,0.0);
-    }
-
-    g_depth = vec3(gl_FragCoord.z / gl_FragCoord.w, 1.0, 0.0);
-    
-    g_ambient = u_ambient;
+    //ambient is read from material, bloom color is albedo
+    g_material = uint(v_material) | (m.bloom == 1 ? BLOOM_BIT : 0u);
 }
-
@@ -4,19 +4,33 @@ layout(location = 0) in vec3 a_vertex;
 layout(location = 1) in vec2 a_uv;
 layout(location = 2) in vec3 a_normal;
 
-uniform mat4 u_mvp;
-uniform mat4 u_model;
-uniform mat4 u_normal_matrix;
+//per view block, bound once per pass
+layout(std140) uniform u_view_ubo
+{
+	mat4 u_vp;
+	vec4 u_cam_pos;
+};
+
+//per draw block, selected with an offset in uniform ring
+layout(std140) uniform u_draw_ubo
+{
+	mat4 u_model;
+	mat4 u_normal_matrix;
+	ivec4 u_material; //x: index in u_materials_ubo
+};
 
 out vec2 v_uv;
 out vec3 v_normal;
 out vec3 v_vertex_world_pos;
+flat out int v_material;
 
 void main(){
 
 	v_uv = a_uv;
+	v_material = u_material.x;
 	v_normal = (u_normal_matrix * vec4(a_normal, 1.0)).xyz;
-	v_vertex_world_pos = (u_model * vec4(a_vertex, 1.0)).xyz;
+	vec4 world_pos = u_model * vec4(a_vertex, 1.0);
+	v_vertex_world_pos = world_pos.xyz;
 
-	gl_Position = u_mvp * vec4(a_vertex, 1.0);
+	gl_Position = u_vp * world_pos;
 }
\ No newline at end of file
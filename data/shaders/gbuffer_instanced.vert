@@ -0,0 +1,33 @@
+#version 330
+
+layout(location = 0) in vec3 a_vertex;
+layout(location = 1) in vec2 a_uv;
+layout(location = 2) in vec3 a_normal;
+
+//per instance: model and normal matrix (a mat4 takes 4 locations), and material index
+layout(location = 4) in mat4 a_model;
+layout(location = 8) in mat4 a_normal_matrix;
+layout(location = 12) in int a_material;
+
+//per view block, bound once per pass
+layout(std140) uniform u_view_ubo
+{
+	mat4 u_vp;
+	vec4 u_cam_pos;
+};
+
+out vec2 v_uv;
+out vec3 v_normal;
+out vec3 v_vertex_world_pos;
+flat out int v_material;
+
+void main(){
+
+	v_uv = a_uv;
+	v_material = a_material;
+	v_normal = (a_normal_matrix * vec4(a_normal, 1.0)).xyz;
+	vec4 world_pos = a_model * vec4(a_vertex, 1.0);
+	v_vertex_world_pos = world_pos.xyz;
+
+	gl_Position = u_vp * world_pos;
+}
\ No newline at end of file
@@ -4,13 +4,13 @@ in vec2 v_uv;
 out vec4 fragColor;
 
 uniform sampler2D u_tex_phong;
-uniform sampler2D u_tex_bloom;
-uniform sampler2D u_tex_background;
+uniform sampler2D u_tex_bloom; // first bloom level, half size or less
+uniform float u_bloom_intensity;
 
 void main(){
 
-    vec3 col = texture(u_tex_phong, v_uv).xyz + texture(u_tex_background, v_uv).xyz;
-    vec3 col_bloom = texture(u_tex_bloom, v_uv).xyz;
+    vec3 col = texture(u_tex_phong, v_uv).xyz;
+    vec3 col_bloom = texture(u_tex_bloom, v_uv).xyz * u_bloom_intensity;
     col = col * 0.9 + col_bloom;
 
     fragColor = vec4(col, 1.0);
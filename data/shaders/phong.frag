@@ -20,8 +20,8 @@ uniform sampler2D u_diffuse_map;
 
 const int MAX_LIGHTS = 8;
 
-//shadows
-uniform sampler2D u_shadow_map[MAX_LIGHTS];
+//shadows: one tile of the atlas per light which casts them, or per cascade
+uniform sampler2D u_shadow_atlas;
 
 //light structs and uniforms
 struct Light {
@@ -35,6 +35,9 @@ struct Light {
     mat4 view_projection;
     int type; // 0 - directional; 1 - point; 2 - spot
     int cast_shadow;
+    int shadow_map; // -1 if none
+    int shadow_cascades; // tiles from shadow_map on, in u_shadow_tiles_ubo
+    vec4 shadow_tile; // x, y and size in atlas uv, and size in texels
 };
 
 
@@ -50,7 +53,25 @@ float random(vec4 seed4){
     return fract(sin(dot_product) * 43758.5453);
 }
 
-float shadowCalculationHard(vec4 fragment_light_space, int light_index) {
+//matrix and tile of every shadow tile, for the cascades of directional lights
+const int MAX_SHADOW_MAPS = 8;
+layout (std140) uniform u_shadow_tiles_ubo
+{
+    mat4 u_tile_vp[MAX_SHADOW_MAPS];
+    vec4 u_tile_rect[MAX_SHADOW_MAPS];
+};
+
+//position in light clip space is inside a tile, away from its border
+bool inShadowTile(vec4 position_light_space) {
+    return all(lessThan(abs(position_light_space.xyz), vec3(0.98 * position_light_space.w)));
+}
+
+//depth in a shadow tile, at uv in the tile, kept half a texel inside it
+float shadowDepth(vec4 tile, vec2 uv) {
+    return texture(u_shadow_atlas, tile.xy + clamp(uv, 0.5 / tile.w, 1.0 - 0.5 / tile.w) * tile.z).r;
+}
+
+float shadowCalculationHard(vec4 fragment_light_space, vec4 tile) {
     float shadow = 0.0; //default no shadow
     
     //gl_position does this divide automatically. But we need to do it manually
@@ -67,7 +88,7 @@ float shadowCalculationHard(vec4 fragment_light_space, int light_index) {
         
         //distances
         float current_depth = proj_coords.z;
-        float shadow_map_depth = texture(u_shadow_map[light_index], proj_coords.xy).r;
+        float shadow_map_depth = shadowDepth(tile, proj_coords.xy);
         
         //subtract bias to remove acne
         float bias = 0.005;
@@ -78,14 +99,14 @@ float shadowCalculationHard(vec4 fragment_light_space, int light_index) {
     return shadow;
 }
 
-float shadowCalculationAdvBias(vec4 fragment_light_space, float NdotL, int light_index) {
+float shadowCalculationAdvBias(vec4 fragment_light_space, float NdotL, vec4 tile) {
     float shadow = 0.0;
     vec3 proj_coords = fragment_light_space.xyz / fragment_light_space.w;
     proj_coords = proj_coords * 0.5 + 0.5;
     if (clamp(proj_coords, 0.0, 1.0) == proj_coords) {
 
         float current_depth = proj_coords.z;
-        float shadow_map_depth = texture(u_shadow_map[light_index], proj_coords.xy).r;
+        float shadow_map_depth = shadowDepth(tile, proj_coords.xy);
 
         //the crude bias is not good as surfaces facing light (NdotL = 1) need less bias, whereas
         //surfaces perpedicular to light need a large bias
@@ -99,7 +120,7 @@ float shadowCalculationAdvBias(vec4 fragment_light_space, float NdotL, int light
     return shadow;
 }
 
-float shadowCalculationPCF(vec4 fragment_light_space, float NdotL, int light_index) {
+float shadowCalculationPCF(vec4 fragment_light_space, float NdotL, vec4 tile) {
     
     //gl_position does this divide automatically. But we need to do it manually
     //result is current fragment coordinates in light clip space
@@ -120,7 +141,7 @@ float shadowCalculationPCF(vec4 fragment_light_space, float NdotL, int light_ind
         float current_depth = proj_coords.z;
 
         //BASIC: now get depth from our shadow map, at the x,y location in light clip space
-        //float shadow_map_depth = texture(u_shadow_map, proj_coords.xy).r;
+        //float shadow_map_depth = shadowDepth(tile, proj_coords.xy);
 
         //float bias = 0.005; // crude bias
         //the crude bias is not good as surfaces facing light (NdotL = 1) need less bias, whereas
@@ -130,11 +151,10 @@ float shadowCalculationPCF(vec4 fragment_light_space, float NdotL, int light_ind
         //shadow = current_depth - bias > shadow_map_depth ? 1.0 : 0.0;
 
         //PCF
-        vec2 texel_size = 1.0 / textureSize(u_shadow_map[light_index], 0);
+        vec2 texel_size = vec2(1.0 / tile.w);
         for (int x = -1; x <= 1; x++) {
             for (int y = -1; y <= 1; y++) {
-                float pcf_depth = texture(u_shadow_map[light_index],
-                                          proj_coords.xy + vec2(x,y) * texel_size).r;
+                float pcf_depth = shadowDepth(tile, proj_coords.xy + vec2(x,y) * texel_size);
                 shadow += current_depth - bias > pcf_depth ? 1.0 : 0.0;
             }
         }
@@ -151,7 +171,7 @@ vec2 poissonDisk[4] = vec2[](
                              vec2( 0.34495938, 0.29387760 )
                              );
 
-float shadowCalculationPoisson(vec4 fragment_light_space, float NdotL, int light_index) {
+float shadowCalculationPoisson(vec4 fragment_light_space, float NdotL, vec4 tile) {
     
     //gl_position does this divide automatically. But we need to do it manually
     //result is current fragment coordinates in light clip space
@@ -173,13 +193,12 @@ float shadowCalculationPoisson(vec4 fragment_light_space, float NdotL, int light
         
         float bias = max(0.05 * (1.0 - NdotL), 0.005);
 
-        vec2 texel_size = 1.0 / textureSize(u_shadow_map[light_index], 0);
+        vec2 texel_size = vec2(1.0 / tile.w);
         for (int i = 0;i < 4; i++){
             
             int index = int(4*random(vec4(gl_FragCoord.xyy, i))) % 4;
             
-            float poisson_depth = texture( u_shadow_map[light_index],
-                                          proj_coords.xy + poissonDisk[index] * texel_size).r;
+            float poisson_depth = shadowDepth(tile, proj_coords.xy + poissonDisk[index] * texel_size);
             
             shadow += current_depth - bias > poisson_depth ? 1.0 : 0.0;
         }
@@ -249,9 +268,15 @@ void main(){
 
         //shadow
         
+        //from the first cascade whose tile holds the position
         vec4 position_light_space = lights[i].view_projection * vec4(v_vertex_world_pos, 1.0);
+        vec4 shadow_tile = lights[i].shadow_tile;
+        for (int c = 1; c < lights[i].shadow_cascades && !inShadowTile(position_light_space); c++) {
+            position_light_space = u_tile_vp[lights[i].shadow_map + c] * vec4(v_vertex_world_pos, 1.0);
+            shadow_tile = u_tile_rect[lights[i].shadow_map + c];
+        }
         
-        float shadow = (lights[i].cast_shadow == 1 ? shadowCalculationPoisson(position_light_space, NdotL, i) : 0.0);
+        float shadow = (lights[i].cast_shadow == 1 && lights[i].shadow_map >= 0 ? shadowCalculationPoisson(position_light_space, NdotL, shadow_tile) : 0.0);
 
         //final color
         final_color += ((diffuse_color + specular_color) * attenuation * spot_cone_intensity) * (1.0 - shadow);
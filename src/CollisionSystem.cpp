@@ -14,11 +14,11 @@ void CollisionSystem::update(float dt) {
     
     //reset all collisions every frame
     auto& colliders = ECS.getAllComponents<Collider>();
-    for (auto& col : colliders){
+    ECS.parallel_each<Collider>(JOBS, 0, signatureOf<Collider>(), 256, [](int i, Collider& col) {
         col.colliding = false;
         col.collision_distance = 10000000.0f;
         col.other = -1;
-    }
+    });
     
     //test ray-box collision. This works by looping over ray colliders. For each one, we loop over box colliders
     //test collision between ray and box, updating collision distance for each collision found
@@ -71,12 +71,9 @@ bool CollisionSystem::intersectSegmentBox(Collider& ray, Collider& box, lm::vec3
     //get model matrices
     Transform& ray_model = ECS.getComponentFromEntity<Transform>(ray.owner);
     Transform& box_model = ECS.getComponentFromEntity<Transform>(box.owner);
-    //get reference to all transforms in ECS, for world pos calculations
-    std::vector<Transform>& all_transforms = ECS.getAllComponents<Transform>();
-    
     //*** TRANSFORM BOX TO WORLD ***//
-    //get world matrices from scene graph
-    mat4 box_global = box_model.getGlobalMatrix(all_transforms);
+    //get cached world matrices from scene graph
+    const mat4& box_global = box_model.getGlobalMatrix();
     
     //get each corner of box in local space
     float x = box.local_halfwidth.x;
@@ -102,7 +99,7 @@ bool CollisionSystem::intersectSegmentBox(Collider& ray, Collider& box, lm::vec3
     
     
     //*** TRANSFORM RAY TO WORLD ***//
-    mat4 ray_global = ray_model.getGlobalMatrix(all_transforms);
+    mat4 ray_global = ray_model.getGlobalMatrix();
     
     //translate the center of ray locally before applying global positionthen get position
     ray_global.translateLocal(ray.local_center.x, ray.local_center.y, ray.local_center.z);
@@ -113,7 +110,7 @@ bool CollisionSystem::intersectSegmentBox(Collider& ray, Collider& box, lm::vec3
     //setting translation component to zero first. This is similar to the normal matrix in a shader
     mat4 inv = ray_global;
     inv.m[12] = 0.0; inv.m[13] = 0.0; inv.m[14] = 0.0;
-    inv.inverse();
+    inv.inverseAffine();
     mat4 inv_trans = inv.transpose();
     vec3 q = inv_trans * ray.direction.normalize(); //normalize direction as there's no guarantee it's length = 1!
     
@@ -6,6 +6,10 @@ class CollisionSystem {
 public:
     void init();
     void update(float dt);
+
+    //component access of update, used to schedule it in Game task graph
+    static constexpr ComponentSignature reads = signatureOf<Transform>();
+    static constexpr ComponentSignature writes = signatureOf<Collider>();
     bool intersectSegmentBox(Collider& ray, Collider& box, lm::vec3& col_point, float& col_distance, float max_distance = 100000.0f);
     
     bool intersectSegmentTriangle(lm::vec3 p, lm::vec3 q, lm::vec3 a, lm::vec3 b, lm::vec3 c);
@@ -10,13 +10,15 @@
 //
 //    TO ADD A NEW COMPONENT TYPE:
 //    - define it as a sub-class of Component
-//    - add it to the ComponentArrays tuple
-//    - add it as a subtemplate of typetoint() and increment 'result' variable
-//    - increment NUM_TYPE_COMPONENTS
+//    - add it to the ComponentRegistry list, choosing a storage policy
+//    - if other components store array indices of the new type, fix them up in
+//      EntityComponentStore::componentMoved_ / componentRemoved_
 //
 #pragma once
 #include "includes.h"
 #include <vector>
+#include <tuple>
+#include <type_traits>
 #include <functional>
 
 /**** COMPONENTS ****/
@@ -24,29 +26,61 @@
 //Component (base class)
 // - owner: id of Entity which owns the instance of the component
 struct Component {
-    int owner;
+    int owner = -1; //entity id, -1 if component has no entity
     int index = -1;
 };
 
 // Transform Component
-// - inherits a mat4 which represents a model matrix
-// - all_transform - reference to vector of all transforms
+// - inherits a mat4 which represents the LOCAL model matrix (relative to parent)
+// - parent: id of parent transform in ECS array, -1 if root. Use setParent() to change
+// - world: cached global model matrix, rebuilt once per frame by TransformSystem
+// - normal_matrix: cached inverse transpose of world, rebuilt only when world changes
+// - dirty: local matrix has changed since last world matrix update
+// - world_changed: world matrix was recalculated during last TransformSystem update
+// all mat4 functions which modify the matrix are wrapped here so that they mark
+// the transform as dirty
 struct Transform : public Component, public lm::mat4 {
     int parent = -1;
-    lm::mat4 getGlobalMatrix(std::vector<Transform>& transforms) {
-        if (parent != - 1){
-            return transforms.at(parent).getGlobalMatrix(transforms) * *this;
-        }
-        else return *this;
-    }
+    lm::mat4 world;
+    lm::mat4 normal_matrix;
+    bool dirty = true;
+    bool world_changed = true;
+
+    //returns cached world matrix (valid after TransformSystem::update)
+    const lm::mat4& getGlobalMatrix() const { return world; }
+    const lm::mat4& getNormalMatrix() const { return normal_matrix; }
+
+    void setParent(int parent_id) { parent = parent_id; dirty = true; }
+
+    //wrapped mat4 setters
+    void set(lm::mat4 m) { lm::mat4::set(m); dirty = true; }
+    void setIdentity() { lm::mat4::setIdentity(); dirty = true; }
+    void front(float x, float y, float z) { lm::mat4::front(x, y, z); dirty = true; }
+    void front(lm::vec3 f) { lm::mat4::front(f); dirty = true; }
+    void position(float x, float y, float z) { lm::mat4::position(x, y, z); dirty = true; }
+    void position(const lm::vec3& p) { lm::mat4::position(p); dirty = true; }
+    void translate(float x, float y, float z) { lm::mat4::translate(x, y, z); dirty = true; }
+    void translate(const lm::vec3& t) { lm::mat4::translate(t); dirty = true; }
+    void rotate(float angle_in_rad, const lm::vec3& axis) { lm::mat4::rotate(angle_in_rad, axis); dirty = true; }
+    void scale(float x, float y, float z) { lm::mat4::scale(x, y, z); dirty = true; }
+    void scale(const lm::vec3& s) { lm::mat4::scale(s); dirty = true; }
+    void translateLocal(float x, float y, float z) { lm::mat4::translateLocal(x, y, z); dirty = true; }
+    void rotateLocal(float angle_in_rad, const lm::vec3& axis) { lm::mat4::rotateLocal(angle_in_rad, axis); dirty = true; }
+    void scaleLocal(float x, float y, float z) { lm::mat4::scaleLocal(x, y, z); dirty = true; }
+
+    //getters need to be redeclared as the setters above hide them
+    lm::vec3 front() const { return lm::mat4::front(); }
+    lm::vec3 position() const { return lm::mat4::position(); }
 };
 
 // Mesh Component
 // - geometry - name of geometry resource
 // - material - name of material resource
+// - cast_shadows - if false, mesh is never drawn into shadow maps (e.g. floors)
 struct Mesh : public Component {
     int geometry;
     int material;
+    bool cast_shadows = true;
 };
 
 
@@ -95,6 +129,10 @@ struct Camera : public Component {
 
 //Light Component
 // - id of transform in ECS array
+// - resolution - size of shadow tile when light's range covers the whole screen
+// - shadow_cascades - directional lights: tiles splitting the camera's view depth, 1 to
+//   MAX_SHADOW_CASCADES, each of resolution size. Used when their shadows are fitted to the
+//   camera, see GraphicsSystem::fit_directional_shadows
 struct Light : public Camera {
     //position is given by transform
     
@@ -107,6 +145,7 @@ struct Light : public Camera {
     float spot_outer;
 	int resolution;
     int cast_shadow;
+	int shadow_cascades;
     
     Light() {
         type = 0;
@@ -118,6 +157,20 @@ struct Light : public Camera {
         spot_outer = 30.0f;
 		resolution = 1024;
         cast_shadow = 0;
+		shadow_cascades = 1;
+    }
+
+    //distance at which attenuation falls below cutoff, i.e. radius of sphere
+    //the light affects. Returns -1 if light has no attenuation (e.g. directional)
+    float getRange(float cutoff = 1.0f / 256.0f) const {
+        if (type == 0) return -1.0f;
+        //solve 1 / (1 + linear*d + quadratic*d^2) = cutoff
+        float c = 1.0f - 1.0f / cutoff;
+        if (quadratic_att > 0.0f)
+            return (-linear_att + sqrtf(linear_att * linear_att - 4.0f * quadratic_att * c)) / (2.0f * quadratic_att);
+        if (linear_att > 0.0f)
+            return -c / linear_att;
+        return -1.0f;
     }
 };
 
@@ -199,48 +252,201 @@ struct GUIText : public GUIElement {
 	lm::vec3 color = lm::vec3(1.0, 1.0, 1.0);
 };
 
-/**** COMPONENT STORAGE ****/
+/**** ENTITY ****/
 
-//add new component type vectors here to store them in *ECS*
-typedef std::tuple<
-std::vector<Transform>,
-std::vector<Mesh>,
-std::vector<Camera>,
-std::vector<Light>,
-std::vector<Collider>,
-std::vector<GUIElement>,
-std::vector<GUIText>
-> ComponentArrays;
+//bitmask with one bit set (1 << type2int) for each component type an entity has
+typedef unsigned int ComponentSignature;
 
-//way of mapping different types to an integer value i.e.
-//the index within ComponentArrays
-template< typename T >
-struct type2int{};
-template<> struct type2int<Transform> { enum { result = 0 }; };
-template<> struct type2int<Mesh> { enum { result = 1 }; };
-template<> struct type2int<Camera> { enum { result = 2 }; };
-template<> struct type2int<Light> { enum { result = 3 }; };
-template<> struct type2int<Collider> { enum { result = 4 }; };
-template<> struct type2int<GUIElement> { enum { result = 5 }; };
-template<> struct type2int<GUIText> { enum { result = 6 }; };
-//UPDATE THIS!
-const int NUM_TYPE_COMPONENTS = 7;
+//number of set bits in signature, without branches
+constexpr int countBits(ComponentSignature v) {
+    v = v - ((v >> 1) & 0x55555555u);
+    v = (v & 0x33333333u) + ((v >> 2) & 0x33333333u);
+    return (int)((((v + (v >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24);
+}
 
-/**** ENTITY ****/
+//maximum number of component types registered with DenseStorage, which
+//is the size of the id array inside every entity
+const int MAX_DENSE_COMPONENTS = 4;
 
 struct Entity {
     //name is used to store entity
     std::string name;
-    //array of handles into ECM component arrays
-    int components[NUM_TYPE_COMPONENTS];
+    //ids of attached components whose storage keeps them in the entity (see DenseStorage)
+    //one slot per Dense type, -1 if not attached. Rare components use other storages
+    //and cost the entity nothing
+    int component_ids[MAX_DENSE_COMPONENTS];
     //sets active or not
     bool active = true;
+    //false if entity has been destroyed and its slot is waiting to be reused
+    bool alive = true;
+    //incremented every time the entity slot is destroyed, to invalidate old handles
+    int generation = 0;
+    //one bit set for each component type attached, see signatureOf()
+    ComponentSignature signature = 0;
     
-    Entity() {
-        for (int i = 0; i < NUM_TYPE_COMPONENTS; i++) { components[i] = -1;}
+    Entity() { clearComponentIds(); }
+    Entity(std::string a_name) : name(a_name) { clearComponentIds(); }
+
+    void clearComponentIds() {
+        for (int& id : component_ids) id = -1;
     }
-    Entity(std::string a_name) : name(a_name) {
-        for (int i = 0; i < NUM_TYPE_COMPONENTS; i++) { components[i] = -1;}
+};
+
+/**** COMPONENT STORAGE ****/
+
+template<typename T> struct type2int;
+
+//Storage policies. Each one stores components of type T in a contiguous vector
+//(so systems can always iterate getAllComponents<T>()), but they differ in how
+//an entity finds its component. All lookups are branch-free
+// - find: array index of component owned by entity (entity must have one)
+// - attach/relocate/detach: record, update, or forget the index of entity's component
+// - full: true if no more components can be created
+
+//Dense: component index is stored in entity component_ids, at a slot given by
+//the number of packed types in the registry with a lower type index.
+//Best for components that most entities have
+template<typename T>
+struct DenseStorage {
+    typedef T component_type;
+    enum { packed = true };
+    std::vector<T> data;
+
+    bool full() const { return false; }
+    int find(const Entity& ent, int entity_id) const { return ent.component_ids[slot_()]; }
+    void attach(Entity& ent, int entity_id, int comp_index) { ent.component_ids[slot_()] = comp_index; }
+    void relocate(Entity& ent, int entity_id, int comp_index) { ent.component_ids[slot_()] = comp_index; }
+    void detach(Entity& ent, int entity_id) { ent.component_ids[slot_()] = -1; }
+
+private:
+    static constexpr int slot_() { return countBits(type2int<T>::packed_rank_mask); }
+};
+
+//Sparse set: storage keeps an array from entity id to component index, so
+//entities without this component pay nothing. Best for rare components
+template<typename T>
+struct SparseSetStorage {
+    typedef T component_type;
+    enum { packed = false };
+    std::vector<T> data;
+    std::vector<int> sparse; //component index for each entity id, -1 if none
+
+    bool full() const { return false; }
+    int find(const Entity& ent, int entity_id) const { return sparse[entity_id]; }
+    void attach(Entity& ent, int entity_id, int comp_index) {
+        if (entity_id >= (int)sparse.size()) sparse.resize(entity_id + 1, -1);
+        sparse[entity_id] = comp_index;
     }
+    void relocate(Entity& ent, int entity_id, int comp_index) { sparse[entity_id] = comp_index; }
+    void detach(Entity& ent, int entity_id) { sparse[entity_id] = -1; }
+};
+
+//Singleton: at most one component of this type exists, always at index 0.
+//Creating a second one takes it away from its previous owner
+template<typename T>
+struct SingletonStorage {
+    typedef T component_type;
+    enum { packed = false };
+    std::vector<T> data;
+
+    bool full() const { return !data.empty(); }
+    int find(const Entity& ent, int entity_id) const { return 0; }
+    void attach(Entity& ent, int entity_id, int comp_index) {}
+    void relocate(Entity& ent, int entity_id, int comp_index) {}
+    void detach(Entity& ent, int entity_id) {}
+};
+
+//compile time list of types
+template<typename... Ts>
+struct TypeList {
+    enum { size = sizeof...(Ts) };
+};
+
+//add new component types here, with their storage policy, to store them in *ECS*
+//type indices, storage and entity signatures are all generated from this list
+typedef TypeList<
+DenseStorage<Transform>,
+DenseStorage<Mesh>,
+DenseStorage<Camera>,
+DenseStorage<Light>,
+SparseSetStorage<Collider>,
+SparseSetStorage<GUIElement>,
+SparseSetStorage<GUIText>
+> ComponentRegistry;
+
+//tuple with one storage object for each registered type
+template<typename List> struct StorageTuple;
+template<typename... Storages>
+struct StorageTuple<TypeList<Storages...>> {
+    typedef std::tuple<Storages...> type;
+};
+typedef StorageTuple<ComponentRegistry>::type ComponentArrays;
+
+//position of component type T in registry, -1 if not registered
+template<typename T, typename... Storages>
+constexpr int componentIndex(TypeList<Storages...>) {
+    const bool matches[] = { false, std::is_same<T, typename Storages::component_type>::value... };
+    for (int i = 1; i <= (int)sizeof...(Storages); i++)
+        if (matches[i]) return i - 1;
+    return -1;
+}
+
+//bits of all types whose storage keeps component ids in the entity
+template<typename... Storages>
+constexpr ComponentSignature packedSignatureOf(TypeList<Storages...>) {
+    const bool packed[] = { false, (bool)Storages::packed... };
+    ComponentSignature sig = 0;
+    for (int i = 1; i <= (int)sizeof...(Storages); i++)
+        if (packed[i]) sig |= 1u << (i - 1);
+    return sig;
+}
+
+const int NUM_TYPE_COMPONENTS = ComponentRegistry::size;
+static_assert(NUM_TYPE_COMPONENTS <= 32, "ComponentSignature has one bit per component type");
+static_assert(countBits(packedSignatureOf(ComponentRegistry())) <= MAX_DENSE_COMPONENTS,
+              "too many DenseStorage types, raise MAX_DENSE_COMPONENTS");
+
+//way of mapping different types to an integer value i.e.
+//the index within ComponentArrays
+// - result: type index
+// - packed_rank_mask: packed types with a lower index, used by DenseStorage
+template<typename T>
+struct type2int {
+    enum { result = componentIndex<T>(ComponentRegistry()) };
+    static_assert(result >= 0, "component type is not in ComponentRegistry");
+    enum : ComponentSignature { packed_rank_mask = packedSignatureOf(ComponentRegistry()) & ((1u << result) - 1) };
+};
+
+//signature with every registered type set
+const ComponentSignature ALL_COMPONENTS = NUM_TYPE_COMPONENTS == 32 ? ~0u : (1u << NUM_TYPE_COMPONENTS) - 1;
+
+//returns signature with the bits of all types Ts set
+template<typename... Ts>
+constexpr ComponentSignature signatureOf() {
+    const int type_indices[] = { -1, type2int<Ts>::result... };
+    ComponentSignature sig = 0;
+    for (int type_index : type_indices)
+        if (type_index >= 0) sig |= 1u << type_index;
+    return sig;
+}
+
+/**** HANDLES ****/
+
+//Generational handle to an entity
+// - id: slot of the entity in the ECS entities array
+// - generation: generation of the slot when handle was created. If the entity is
+//   destroyed and the slot reused, the generations no longer match and the handle is stale
+struct EntityHandle {
+    int id = -1;
+    int generation = 0;
+};
+
+//Handle to the component of type T owned by an entity.
+//Components are moved inside their arrays when others are removed (swap and pop)
+//so the array index is not stable. Instead we store the generational handle of the owner
+//and look up its current component index when resolving
+template<typename T>
+struct ComponentHandle {
+    EntityHandle entity;
 };
 
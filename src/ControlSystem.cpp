@@ -101,12 +101,13 @@ void ControlSystem::updateFPS(float dt) {
 	}
 
 	//fps control should have five ray colliders assigned
-	auto& colliders = ECS.getAllComponents<Collider>();
-	Collider& collider_down = colliders[FPS_collider_down];
-	Collider& collider_forward = colliders[FPS_collider_forward];
-	Collider& collider_left = colliders[FPS_collider_left];
-	Collider& collider_right = colliders[FPS_collider_right];
-	Collider& collider_back = colliders[FPS_collider_back];
+	if (!ECS.isValid(FPS_collider_down) || !ECS.isValid(FPS_collider_forward) || !ECS.isValid(FPS_collider_left) ||
+		!ECS.isValid(FPS_collider_right) || !ECS.isValid(FPS_collider_back)) return;
+	Collider& collider_down = ECS.getComponent(FPS_collider_down);
+	Collider& collider_forward = ECS.getComponent(FPS_collider_forward);
+	Collider& collider_left = ECS.getComponent(FPS_collider_left);
+	Collider& collider_right = ECS.getComponent(FPS_collider_right);
+	Collider& collider_back = ECS.getComponent(FPS_collider_back);
 
 	//collisions and gravity
 	//player down ray is always colliding, we need to keep player at 'FPS_height' units above nearest collider
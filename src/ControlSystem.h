@@ -22,6 +22,10 @@ public:
 	void init();
 	void update(float dt);
 
+	//component access of update, used to schedule it in Game task graph
+	static constexpr ComponentSignature reads = signatureOf<Collider>();
+	static constexpr ComponentSignature writes = signatureOf<Transform, Camera>();
+
 	//functions called directly from main.cpp, via game
 	void updateMousePosition(int new_x, int new_y);
 	void key_mouse_callback(int key, int action, int mods);
@@ -36,11 +40,12 @@ public:
 	Mouse mouse;
 
 	//FPS stuff
-	int FPS_collider_down;
-	int FPS_collider_left;
-	int FPS_collider_right;
-	int FPS_collider_forward;
-	int FPS_collider_back;
+	//colliders are stored as handles so they survive removal of other colliders
+	ComponentHandle<Collider> FPS_collider_down;
+	ComponentHandle<Collider> FPS_collider_left;
+	ComponentHandle<Collider> FPS_collider_right;
+	ComponentHandle<Collider> FPS_collider_forward;
+	ComponentHandle<Collider> FPS_collider_back;
 	bool FPS_can_jump = true;
 	float FPS_jump_force = 0.0f;
 	float FPS_jump_initial_force = 12.0f;
@@ -0,0 +1,121 @@
+#include "Culling.h"
+#if defined(LM_AVX2)
+#include <immintrin.h>
+#elif defined(LM_SSE2)
+#include <emmintrin.h>
+#endif
+
+// ****** FRUSTUM ***** //
+
+//each plane is the sum or difference of the 4th row of the matrix and one of the others
+//(e.g. left plane is where clip x == -clip w). Matrix is column major, so row r is M[0..3][r]
+void Frustum::extract(const lm::mat4& vp) {
+	for (int p = 0; p < 6; p++) {
+		int row = p / 2;
+		float sign = (p % 2 == 0) ? 1.0f : -1.0f;
+		lm::vec4 plane(vp.M[0][3] + sign * vp.M[0][row],
+					   vp.M[1][3] + sign * vp.M[1][row],
+					   vp.M[2][3] + sign * vp.M[2][row],
+					   vp.M[3][3] + sign * vp.M[3][row]);
+		float length = sqrtf(plane.x * plane.x + plane.y * plane.y + plane.z * plane.z);
+		if (length > 0.0f) plane = plane * (1.0f / length);
+		planes[p] = plane;
+	}
+}
+
+bool Frustum::testSphere(const lm::vec3& c, float radius) const {
+	for (int p = 0; p < 6; p++) {
+		const lm::vec4& pl = planes[p];
+		if (pl.x * c.x + pl.y * c.y + pl.z * c.z + pl.w < -radius) return false;
+	}
+	return true;
+}
+
+//box is outside a plane if its corner furthest along the plane normal is behind it
+bool Frustum::testAABB(const lm::vec3& c, const lm::vec3& h) const {
+	for (int p = 0; p < 6; p++) {
+		const lm::vec4& pl = planes[p];
+		float dist = pl.x * c.x + pl.y * c.y + pl.z * c.z + pl.w;
+		float extent = fabsf(pl.x) * h.x + fabsf(pl.y) * h.y + fabsf(pl.z) * h.z;
+		if (dist + extent < 0.0f) return false;
+	}
+	return true;
+}
+
+// ****** WORLD BOUNDS ***** //
+
+void WorldBounds::resize(int n) {
+	count = n;
+	size_t padded = (size_t)((n + 7) & ~7);
+	center_x.resize(padded); center_y.resize(padded); center_z.resize(padded);
+	half_x.resize(padded); half_y.resize(padded); half_z.resize(padded);
+	radius.resize(padded);
+}
+
+// ****** CULLING ***** //
+
+//same tests as Frustum::testSphere and testAABB, but on 8 (AVX2), 4 (SSE2) or 1 object at a time
+int cullBounds(const WorldBounds& b, const Frustum& frustum, int first, int last, int* out) {
+	int num_visible = 0;
+
+	//plane normals are broadcast once, abs of normal is used for the AABB extent
+	float nx[6], ny[6], nz[6], d[6], ax[6], ay[6], az[6];
+	for (int p = 0; p < 6; p++) {
+		nx[p] = frustum.planes[p].x; ny[p] = frustum.planes[p].y; nz[p] = frustum.planes[p].z; d[p] = frustum.planes[p].w;
+		ax[p] = fabsf(nx[p]); ay[p] = fabsf(ny[p]); az[p] = fabsf(nz[p]);
+	}
+
+#if defined(LM_AVX2)
+	const int width = 8;
+	for (int base = first; base < last; base += width) {
+		__m256 cx = _mm256_loadu_ps(&b.center_x[base]), cy = _mm256_loadu_ps(&b.center_y[base]), cz = _mm256_loadu_ps(&b.center_z[base]);
+		__m256 hx = _mm256_loadu_ps(&b.half_x[base]), hy = _mm256_loadu_ps(&b.half_y[base]), hz = _mm256_loadu_ps(&b.half_z[base]);
+		__m256 neg_r = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(&b.radius[base]));
+		__m256 outside = _mm256_setzero_ps();
+		for (int p = 0; p < 6; p++) {
+			__m256 dist = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+				_mm256_mul_ps(cx, _mm256_set1_ps(nx[p])), _mm256_mul_ps(cy, _mm256_set1_ps(ny[p]))),
+				_mm256_mul_ps(cz, _mm256_set1_ps(nz[p]))), _mm256_set1_ps(d[p]));
+			__m256 extent = _mm256_add_ps(_mm256_add_ps(
+				_mm256_mul_ps(hx, _mm256_set1_ps(ax[p])), _mm256_mul_ps(hy, _mm256_set1_ps(ay[p]))),
+				_mm256_mul_ps(hz, _mm256_set1_ps(az[p])));
+			outside = _mm256_or_ps(outside, _mm256_cmp_ps(dist, neg_r, _CMP_LT_OQ));
+			outside = _mm256_or_ps(outside, _mm256_cmp_ps(_mm256_add_ps(dist, extent), _mm256_setzero_ps(), _CMP_LT_OQ));
+		}
+		int visible_mask = ~_mm256_movemask_ps(outside) & 0xFF;
+#elif defined(LM_SSE2)
+	const int width = 4;
+	for (int base = first; base < last; base += width) {
+		__m128 cx = _mm_loadu_ps(&b.center_x[base]), cy = _mm_loadu_ps(&b.center_y[base]), cz = _mm_loadu_ps(&b.center_z[base]);
+		__m128 hx = _mm_loadu_ps(&b.half_x[base]), hy = _mm_loadu_ps(&b.half_y[base]), hz = _mm_loadu_ps(&b.half_z[base]);
+		__m128 neg_r = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&b.radius[base]));
+		__m128 outside = _mm_setzero_ps();
+		for (int p = 0; p < 6; p++) {
+			__m128 dist = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(cx, _mm_set1_ps(nx[p])), _mm_mul_ps(cy, _mm_set1_ps(ny[p]))),
+				_mm_mul_ps(cz, _mm_set1_ps(nz[p]))), _mm_set1_ps(d[p]));
+			__m128 extent = _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(hx, _mm_set1_ps(ax[p])), _mm_mul_ps(hy, _mm_set1_ps(ay[p]))),
+				_mm_mul_ps(hz, _mm_set1_ps(az[p])));
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(dist, neg_r));
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(dist, extent), _mm_setzero_ps()));
+		}
+		int visible_mask = ~_mm_movemask_ps(outside) & 0xF;
+#else
+	const int width = 1;
+	for (int base = first; base < last; base += width) {
+		bool outside = false;
+		for (int p = 0; p < 6 && !outside; p++) {
+			float dist = b.center_x[base] * nx[p] + b.center_y[base] * ny[p] + b.center_z[base] * nz[p] + d[p];
+			float extent = b.half_x[base] * ax[p] + b.half_y[base] * ay[p] + b.half_z[base] * az[p];
+			outside = dist < -b.radius[base] || dist + extent < 0.0f;
+		}
+		int visible_mask = outside ? 0 : 1;
+#endif
+		//compact: write indices of set bits, ignoring padding past last
+		for (int k = 0; k < width && base + k < last; k++) {
+			if (visible_mask & (1 << k)) out[num_visible++] = base + k;
+		}
+	}
+	return num_visible;
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include "includes.h"
+#include "GraphicsUtilities.h"
+#include <vector>
+
+//6 planes of a view frustum in world space: left, right, bottom, top, near, far
+//Each plane is (nx, ny, nz, d) with a normalized normal pointing into the frustum,
+//so dot(n, p) + d is the signed distance from point p to the plane
+struct Frustum {
+	lm::vec4 planes[6];
+
+	//extracts planes from rows of view projection matrix (Gribb & Hartmann)
+	void extract(const lm::mat4& view_projection);
+
+	//scalar tests, for single objects
+	bool testSphere(const lm::vec3& center, float radius) const;
+	bool testAABB(const lm::vec3& center, const lm::vec3& half_width) const;
+};
+
+//World space bounds (AABB and bounding sphere, sharing a center) of a set of objects,
+//stored as structure of arrays so that SIMD code tests 4 (SSE2) or 8 (AVX2) objects
+//against a plane at once. Arrays are padded to a multiple of 8
+struct WorldBounds {
+	std::vector<float> center_x, center_y, center_z;
+	std::vector<float> half_x, half_y, half_z;
+	std::vector<float> radius;
+	int count = 0;
+
+	void resize(int n);
+	void set(int i, const AABB& world_aabb, float sphere_radius) {
+		center_x[i] = world_aabb.center.x; center_y[i] = world_aabb.center.y; center_z[i] = world_aabb.center.z;
+		half_x[i] = world_aabb.half_width.x; half_y[i] = world_aabb.half_width.y; half_z[i] = world_aabb.half_width.z;
+		radius[i] = sphere_radius;
+	}
+};
+
+//writes the index of every object in [first, last) whose bounds intersect frustum to out,
+//in increasing order, and returns how many were written. An object is culled if either its
+//sphere or its AABB is fully outside any plane. first must be a multiple of 8
+int cullBounds(const WorldBounds& bounds, const Frustum& frustum, int first, int last, int* out);
@@ -8,7 +8,10 @@ DebugSystem::~DebugSystem() {
 	delete icon_shader_;
 }
 
-void DebugSystem::lateInit() {
+void DebugSystem::lateInit(TransformSystem* transform_system, GraphicsSystem* graphics_system) {
+	transform_system_ = transform_system;
+	graphics_system_ = graphics_system;
+
 	//init booleans
 	draw_grid_ = false;
 	draw_icons_ = false;
@@ -21,6 +24,10 @@ void DebugSystem::lateInit() {
 	icon_shader_ = new Shader();
 	icon_shader_->compileFromStrings(g_shader_icon_vertex, g_shader_icon_fragment);
 
+	//line colors never change, so set once (u_color is an array, which Shader has no setter for)
+	GLSTATE.useProgram(grid_shader_->program);
+	glUniform3fv(grid_shader_->getUniformLocation(U_COLOR), 4, grid_colors);
+
 	//create geometries
 	createGrid_();
 	createIcon_();
@@ -59,23 +66,15 @@ void DebugSystem::update(float dt) {
 	if (draw_grid_ || draw_frustra_ || draw_colliders_) {
 
 		//use line shader to draw all lines and boxes
-		glUseProgram(grid_shader_->program);
-		GLint u_mvp = glGetUniformLocation(grid_shader_->program, "u_mvp");
-		GLint u_color = glGetUniformLocation(grid_shader_->program, "u_color");
-		GLint u_color_mod = glGetUniformLocation(grid_shader_->program, "u_color_mod");
-		GLint u_size_scale = glGetUniformLocation(grid_shader_->program, "u_size_scale");
-		GLint u_center_mod = glGetUniformLocation(grid_shader_->program, "u_center_mod");
-
-
+		GLSTATE.useProgram(grid_shader_->program);
 
 		if (draw_grid_) {
 			//set uniforms and draw grid
-			glUniformMatrix4fv(u_mvp, 1, GL_FALSE, vp.m);
-			glUniform3fv(u_color, 4, grid_colors);
-			glUniform3f(u_size_scale, 1.0, 1.0, 1.0);
-			glUniform3f(u_center_mod, 0.0, 0.0, 0.0);
-			glUniform1i(u_color_mod, 0);
-			glBindVertexArray(grid_vao_); //GRID
+			grid_shader_->setUniform(U_MVP, vp);
+			grid_shader_->setUniform(U_SIZE_SCALE, lm::vec3(1.0, 1.0, 1.0));
+			grid_shader_->setUniform(U_CENTER_MOD, lm::vec3(0.0, 0.0, 0.0));
+			grid_shader_->setUniform(U_COLOR_MOD, 0);
+			GLSTATE.bindVertexArray(grid_vao_); //GRID
 			glDrawElements(GL_LINES, grid_num_indices, GL_UNSIGNED_INT, 0);
 		}
 
@@ -89,7 +88,7 @@ void DebugSystem::update(float dt) {
                 counter++;
                 
 				lm::mat4 cam_iv = cc.view_matrix;
-				cam_iv.inverse();
+				cam_iv.inverseAffine();
 				lm::mat4 cam_ip = cc.projection_matrix;
 				cam_ip.inverse();
 				lm::mat4 cam_ivp = cc.view_projection;
@@ -97,9 +96,9 @@ void DebugSystem::update(float dt) {
 				lm::mat4 mvp = vp * cam_ivp;
 
 				//set uniforms and draw cube
-				glUniformMatrix4fv(u_mvp, 1, GL_FALSE, mvp.m);
-				glUniform1i(u_color_mod, 1); //set color to index 1 (red)
-				glBindVertexArray(cube_vao_); //CUBE
+				grid_shader_->setUniform(U_MVP, mvp);
+				grid_shader_->setUniform(U_COLOR_MOD, 1); //set color to index 1 (red)
+				GLSTATE.bindVertexArray(cube_vao_); //CUBE
 				glDrawElements(GL_LINES, 24, GL_UNSIGNED_INT, 0);
 			}
 
@@ -111,21 +110,18 @@ void DebugSystem::update(float dt) {
 				lm::mat4 mvp = vp * light_ivp;
 
 				//set uniforms and draw cube
-				glUniformMatrix4fv(u_mvp, 1, GL_FALSE, mvp.m);
-				glUniform1i(u_color_mod, 1); //set color to index 1 (red)
-				glBindVertexArray(cube_vao_); //CUBE
+				grid_shader_->setUniform(U_MVP, mvp);
+				grid_shader_->setUniform(U_COLOR_MOD, 1); //set color to index 1 (red)
+				GLSTATE.bindVertexArray(cube_vao_); //CUBE
 				glDrawElements(GL_LINES, 24, GL_UNSIGNED_INT, 0);
 			}
 		}
 
 		if (draw_colliders_) {
 			//draw all colliders
-			auto& colliders = ECS.getAllComponents<Collider>();
-			for (auto& cc : colliders) {
-				//get transform for collider
-				Transform& tc = ECS.getComponentFromEntity<Transform>(cc.owner);
+			ECS.each<Collider, Transform>([&](int ent, Collider& cc, Transform& tc) {
 				//get the colliders local model matrix in order to draw correctly
-				lm::mat4 collider_matrix = tc.getGlobalMatrix(ECS.getAllComponents<Transform>());
+				lm::mat4 collider_matrix = tc.getGlobalMatrix();
 
 				if (cc.collider_type == ColliderTypeBox) {
 
@@ -137,9 +133,9 @@ void DebugSystem::update(float dt) {
 					lm::mat4 mvp = vp * collider_matrix;
 
 					//set uniforms and draw
-					glUniformMatrix4fv(u_mvp, 1, GL_FALSE, mvp.m);
-					glUniform1i(u_color_mod, 2); //set color to index 2 (green)
-					glBindVertexArray(cube_vao_); //CUBE
+					grid_shader_->setUniform(U_MVP, mvp);
+					grid_shader_->setUniform(U_COLOR_MOD, 2); //set color to index 2 (green)
+					GLSTATE.bindVertexArray(cube_vao_); //CUBE
 					glDrawElements(GL_LINES, 24, GL_UNSIGNED_INT, 0);
 				}
 
@@ -170,37 +166,27 @@ void DebugSystem::update(float dt) {
 
 					//set uniforms
 					lm::mat4 mvp = vp * collider_matrix;
-					glUniformMatrix4fv(u_mvp, 1, GL_FALSE, mvp.m);
+					grid_shader_->setUniform(U_MVP, mvp);
 					//set color to index 2 (green)
-					glUniform1i(u_color_mod, 3);
+					grid_shader_->setUniform(U_COLOR_MOD, 3);
 
 					//bind the cube vao
-					glBindVertexArray(collider_ray_vao_);
+					GLSTATE.bindVertexArray(collider_ray_vao_);
 					glDrawElements(GL_LINES, 2, GL_UNSIGNED_INT, 0);
 				}
-			}
+			});
 		}
 	}
 
 	if (draw_icons_) {
 		//switch to icon shader
-		glUseProgram(icon_shader_->program);
-
-		//get uniforms
-		GLint u_mvp = glGetUniformLocation(icon_shader_->program, "u_mvp");
-		GLint u_icon = glGetUniformLocation(icon_shader_->program, "u_icon");
-		glUniform1i(u_icon, 0);
-
+		GLSTATE.useProgram(icon_shader_->program);
 
 		//for each light - bind light texture
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, icon_light_texture_);
-
-		auto& lights = ECS.getAllComponents<Light>();
-		for (auto& curr_light : lights) {
-			Transform& curr_light_transform = ECS.getComponentFromEntity<Transform>(curr_light.owner);
+		icon_shader_->setTexture(U_ICON, icon_light_texture_);
 
-			lm::mat4 mvp_matrix = vp * curr_light_transform.getGlobalMatrix(ECS.getAllComponents<Transform>());;
+		ECS.each<Light, Transform>([&](int ent, Light& curr_light, Transform& curr_light_transform) {
+			lm::mat4 mvp_matrix = vp * curr_light_transform.getGlobalMatrix();
 			//BILLBOARDS
 			//the mvp for the light contains rotation information. We want it to look at the camera always.
 			//So we zero out first three columns of matrix, which contain the rotation information
@@ -209,31 +195,27 @@ void DebugSystem::update(float dt) {
 			for (int i = 12; i < 16; i++) bill_matrix.m[i] = mvp_matrix.m[i];
 
 			//send this new matrix as the MVP
-			glUniformMatrix4fv(u_mvp, 1, GL_FALSE, bill_matrix.m);
-			glBindVertexArray(icon_vao_);
+			icon_shader_->setUniform(U_MVP, bill_matrix);
+			GLSTATE.bindVertexArray(icon_vao_);
 			glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-		}
+		});
 
 		//bind camera texture
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, icon_camera_texture_);
+		icon_shader_->setTexture(U_ICON, icon_camera_texture_);
 
 		//for each camera, exactly the same but with camera texture
-		auto& cameras = ECS.getAllComponents<Camera>();
-		for (auto& curr_camera : cameras) {
-			Transform& curr_cam_transform = ECS.getComponentFromEntity<Transform>(curr_camera.owner);
-			lm::mat4 mvp_matrix = vp * curr_cam_transform.getGlobalMatrix(ECS.getAllComponents<Transform>());
+		ECS.each<Camera, Transform>([&](int ent, Camera& curr_camera, Transform& curr_cam_transform) {
+			lm::mat4 mvp_matrix = vp * curr_cam_transform.getGlobalMatrix();
 
 			// billboard as above
 			lm::mat4 bill_matrix;
 			for (int i = 12; i < 16; i++) bill_matrix.m[i] = mvp_matrix.m[i];
-			glUniformMatrix4fv(u_mvp, 1, GL_FALSE, bill_matrix.m);
-			glBindVertexArray(icon_vao_);
+			icon_shader_->setUniform(U_MVP, bill_matrix);
+			GLSTATE.bindVertexArray(icon_vao_);
 			glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
 
-		}
+		});
 	}
-	glBindVertexArray(0);
 
 	//imGUI
 	updateimGUI_(dt);
@@ -246,8 +228,9 @@ void imGuiRenderTransformNode(TransformNode& trans) {
 		Transform& transform = ECS.getComponentFromEntity<Transform>(ent.name);
 		lm::vec3 pos = transform.position();
 		float pos_array[3] = { pos.x, pos.y, pos.z };
-		ImGui::DragFloat3("Position", pos_array);
-		transform.position(pos_array[0], pos_array[1], pos_array[2]);
+		//only set position if user changed it, so we don't dirty the transform every frame
+		if (ImGui::DragFloat3("Position", pos_array))
+			transform.position(pos_array[0], pos_array[1], pos_array[2]);
 
 		for (auto& child : trans.children) {
 
@@ -310,6 +293,136 @@ void DebugSystem::updateimGUI_(float dt) {
 			ImGui::TreePop();
 		}
 
+		//job system: how busy each thread was running jobs last frame
+		if (ImGui::TreeNode("Jobs")) {
+			for (int i = 0; i < JOBS.getNumThreads(); i++) {
+				std::string label = (i == 0 ? std::string("main") : "worker " + std::to_string(i));
+				ImGui::ProgressBar(JOBS.getUtilization(i), ImVec2(-1, 0), label.c_str());
+			}
+			ImGui::TreePop();
+		}
+
+		//normal matrices are only recomputed for transforms whose world matrix changed
+		if (ImGui::TreeNode("Transforms")) {
+			ImGui::Text("Normal matrices recomputed: %d", transform_system_->getNormalsRecomputed());
+			ImGui::Text("  uniform scale fast path: %d", transform_system_->getNormalsUniformScale());
+			ImGui::Text("Normal matrices reused: %d", transform_system_->getNormalsReused());
+			ImGui::TreePop();
+		}
+
+		//draw calls of graphics system, with and without instancing
+		if (ImGui::TreeNode("Rendering")) {
+			ImGui::Checkbox("Instancing", &graphics_system_->use_instancing);
+			if (graphics_system_->isMultiDrawIndirectSupported())
+				ImGui::Checkbox("Multi draw indirect", &graphics_system_->use_multi_draw_indirect);
+			ImGui::Text("Draw calls: %d", graphics_system_->getDrawCalls());
+			ImGui::Text("G-buffer: %d bytes per pixel", graphics_system_->getGBufferBytesPerPixel());
+			//GL calls made (issued) or skipped as redundant (elided) last frame
+			const char* gl_call_names[GLCallCount] = { "Program", "Vertex array", "Framebuffer", "Texture", "Fixed function", "Uniform" };
+			ImGui::Columns(3, "gl_calls");
+			ImGui::Text("GL calls"); ImGui::NextColumn(); ImGui::Text("Issued"); ImGui::NextColumn(); ImGui::Text("Elided"); ImGui::NextColumn();
+			for (int c = 0; c < GLCallCount; c++) {
+				ImGui::Text("%s", gl_call_names[c]); ImGui::NextColumn();
+				ImGui::Text("%d", GLSTATE.getIssued((GLStateCall)c)); ImGui::NextColumn();
+				ImGui::Text("%d", GLSTATE.getElided((GLStateCall)c)); ImGui::NextColumn();
+			}
+			ImGui::Columns(1);
+			ImGui::TreePop();
+		}
+
+		//passes and targets of last frame. Targets with the same texture share it
+		if (ImGui::TreeNode("Render graph")) {
+			const RenderGraph& graph = graphics_system_->getRenderGraph();
+			const RenderGraph::Stats& graph_stats = graph.getStats();
+			ImGui::Text("Passes: %d (%d culled)", graph_stats.passes, graph_stats.culled_passes);
+			ImGui::Text("Targets: %d in %d textures, %.1f MB", graph_stats.targets, graph_stats.textures,
+				graph_stats.texture_bytes / (1024.0f * 1024.0f));
+			ImGui::Text("Textures created this frame: %d", graph_stats.textures_created);
+			if (ImGui::Button("Dump to render_graph.dot"))
+				graphics_system_->dump_render_graph = true;
+			for (int p = 0; p < graph.getNumPasses(); p++)
+				ImGui::Text("%2d %s%s", p, graph.getPassName(p).c_str(), graph.isPassCulled(p) ? " (culled)" : "");
+			for (int r = 0; r < graph.getNumResources(); r++) {
+				if (graph.isImported(r)) continue;
+				const RenderTargetDesc& desc = graph.getDesc(r);
+				ImGui::Text("%s: %dx%d, passes %d-%d, texture %u", graph.getResourceName(r).c_str(), desc.width, desc.height,
+					graph.getFirstPass(r), graph.getLastPass(r), graph.getTexture(r));
+			}
+			ImGui::TreePop();
+		}
+
+		//lights assigned to clusters of main camera last frame
+		if (ImGui::TreeNode("Light clusters")) {
+			const LightClusters& clusters = graphics_system_->getLightClusters();
+			ImGui::Checkbox("Heatmap", &graphics_system_->show_light_heatmap);
+			ImGui::Text("Clusters: %d x %d x %d", LightClusters::DIM_X, LightClusters::DIM_Y, LightClusters::DIM_Z);
+			ImGui::Text("Light indices: %d", (int)clusters.getLightIndices().size());
+			ImGui::Text("Most lights in a cluster: %d", clusters.getMaxLightsPerCluster());
+			ImGui::TreePop();
+		}
+
+		//lights drawn as volumes instead of clusters, last frame
+		if (ImGui::TreeNode("Light volumes")) {
+			const auto& volume_stats = graphics_system_->getLightVolumeStats();
+			ImGui::Checkbox("Stencil light volumes", &graphics_system_->use_light_volumes);
+			ImGui::Text("Full screen lights: %d", volume_stats.full_screen);
+			ImGui::Text("Volumes drawn: %d", volume_stats.volumes);
+			ImGui::Text("Volumes culled: %d", volume_stats.culled);
+			ImGui::TreePop();
+		}
+
+		//bloom mip chain, with gpu time of each level's passes
+		if (ImGui::TreeNode("Bloom")) {
+			ImGui::SliderFloat("Intensity", &graphics_system_->bloom_intensity, 0.0f, 4.0f);
+			ImGui::SliderFloat("Radius", &graphics_system_->bloom_radius, 0.0f, 1.0f);
+			float total_ms = 0.0f;
+			for (int l = 0; l < BLOOM_LEVELS; l++) {
+				int width, height;
+				graphics_system_->getBloomLevelSize(l, width, height);
+				float down_ms = graphics_system_->getBloomTime(l, false);
+				float up_ms = graphics_system_->getBloomTime(l, true);
+				ImGui::Text("Level %d: %dx%d, down %.3f ms, up %.3f ms", l, width, height, down_ms, up_ms);
+				total_ms += down_ms + up_ms;
+			}
+			ImGui::Text("Total: %.3f ms (budget %.1f ms)", total_ms, BLOOM_BUDGET_MS);
+			ImGui::TreePop();
+		}
+
+		//shadow atlas tiles of lights, which were redrawn this frame, and their texel density
+		if (ImGui::TreeNode("Shadows")) {
+			ImGui::SliderInt("Budget (texels)", &graphics_system_->shadow_budget_texels, 0, SHADOW_ATLAS_SIZE * SHADOW_ATLAS_SIZE);
+			ImGui::SliderFloat("Near coverage", &graphics_system_->shadow_near_coverage, 0.0f, 1.0f);
+			ImGui::Checkbox("Layered (all lights in one pass)", &graphics_system_->use_layered_shadows);
+			ImGui::Checkbox("Fit directional lights to camera", &graphics_system_->fit_directional_shadows);
+			ImGui::SliderFloat("Cascade split (uniform to log)", &graphics_system_->cascade_split_lambda, 0.0f, 1.0f);
+			ImGui::Text("Shadow pass: CPU %.3f ms, GPU %.3f ms", graphics_system_->getShadowTime(false), graphics_system_->getShadowTime(true));
+			const auto& frame_stats = graphics_system_->getShadowFrameStats();
+			ImGui::Text("Refreshed: %d tiles, %d static redraws, %.2f Mtexels", frame_stats.refreshed,
+				frame_stats.static_redrawn, frame_stats.texels / (1024.0f * 1024.0f));
+			const auto& shadow_stats = graphics_system_->getShadowStats();
+			for (size_t s = 0; s < shadow_stats.size(); s++) {
+				const auto& stats = shadow_stats[s];
+				if (stats.skipped) {
+					ImGui::Text("Light %d cascade %d: skipped", stats.light, stats.cascade);
+					continue;
+				}
+				ImGui::Text("Light %d cascade %d: %d tile at (%d, %d), coverage %.2f", stats.light, stats.cascade,
+					stats.tile_size, stats.tile_x, stats.tile_y, stats.coverage);
+				if (stats.split_far > 0.0f)
+					ImGui::Text("  depth %.2f to %.2f, %.1f texels/unit, %.2f texels/pixel", stats.split_near, stats.split_far,
+						stats.texels_per_unit, stats.texels_per_pixel);
+				else if (stats.texels_per_unit > 0.0f)
+					ImGui::Text("  %.1f texels/unit", stats.texels_per_unit);
+				ImGui::Text("  %d static + %d dynamic casters, %d skipped", stats.static_casters,
+					stats.dynamic_casters, stats.casters_skipped);
+				if (stats.refreshed)
+					ImGui::Text("  refreshed%s", stats.static_redrawn ? ", static redrawn" : "");
+				else
+					ImGui::Text("  refreshed %d frames ago", stats.frames_since_refresh);
+			}
+			ImGui::TreePop();
+		}
+
 		//create a tree of TransformNodes objects (defined in DebugSystem.h)
         //which represents the current scene graph
         
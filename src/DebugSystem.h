@@ -1,6 +1,9 @@
 #pragma once
 #include "includes.h"
 #include "Shader.h"
+#include "Components.h"
+#include "TransformSystem.h"
+#include "GraphicsSystem.h"
 #include <vector>
 
 
@@ -15,9 +18,15 @@ struct TransformNode {
 class DebugSystem {
 public:
 	~DebugSystem();
-	void lateInit();
+	//other systems are only read, to show their stats
+	void lateInit(TransformSystem* transform_system, GraphicsSystem* graphics_system);
 	void update(float dt);
 
+	//component access of update, used to schedule it in Game task graph
+	//(imGUI can edit transforms and cameras, picking ray writes its collider)
+	static constexpr ComponentSignature reads = ALL_COMPONENTS;
+	static constexpr ComponentSignature writes = signatureOf<Transform, Camera, Collider>();
+
 	void setActive(bool a);
 
 	//public imGUI functions
@@ -63,6 +72,10 @@ private:
 	Shader* grid_shader_;
 	Shader* icon_shader_;
 
+	//systems which show stats in imGUI
+	TransformSystem* transform_system_ = nullptr;
+	GraphicsSystem* graphics_system_ = nullptr;
+
 	//imGUI
 	bool show_imGUI_ = false;
 	void updateimGUI_(float dt);
@@ -1,11 +1,31 @@
 #pragma once
 #include "Components.h"
+#include "JobSystem.h"
 #include <vector>
 #include <unordered_map>
 #include <map>
+#include <utility>
+#include <algorithm>
+#include <atomic>
 
 using namespace std;
 
+//debug builds check that tasks and parallel loops running at the same time don't
+//write the same component arrays. Define ECS_CHECK_ACCESS to force checks on
+#if !defined(ECS_CHECK_ACCESS) && (defined(_DEBUG) || defined(DEBUG))
+#define ECS_CHECK_ACCESS
+#endif
+
+template<typename... Ts> class View;
+
+//component types read and written by a task or parallel loop, see EntityComponentStore::beginAccess
+struct ComponentAccess {
+    const char* name;
+    ComponentSignature reads;
+    ComponentSignature writes;
+    ComponentAccess* outer = nullptr; //access of the task this one runs inside, on same thread
+};
+
 /**** ENTITY COMPONENT STORE ****/
 
 //the entity component manager is a global struct that contains an array of
@@ -18,44 +38,101 @@ struct EntityComponentStore {
     ComponentArrays components; // defined at bottom of Components.h
     
     //create Entity and add transform component by default
+    //reuses the slot of a destroyed entity if there is one, so that the
+    //entities array does not grow without bound
     //return array id of new entity
     int createEntity(string name) {
-        entities.emplace_back(name);
-        createComponentForEntity<Transform>((int)entities.size() - 1);
-        return (int)entities.size() - 1;
+        int entity_id;
+        if (!free_entities_.empty()) {
+            entity_id = free_entities_.back();
+            free_entities_.pop_back();
+            Entity& ent = entities[entity_id];
+            ent.name = name;
+            ent.active = true;
+            ent.alive = true;
+            ent.signature = 0;
+            ent.clearComponentIds();
+        }
+        else {
+            entities.emplace_back(name);
+            entity_id = (int)entities.size() - 1;
+        }
+        createComponentForEntity<Transform>(entity_id);
+        return entity_id;
     }
 
 	//returns id of entity
 	int getEntity(string name) {
 		for (size_t i = 0; i < entities.size(); i++)
-			if (entities[i].name == name) return (int)i;
+			if (entities[i].alive && entities[i].name == name) return (int)i;
 		return -1;
 	}
+
+    //returns generational handle to entity with array id
+    EntityHandle getEntityHandle(int entity_id) {
+        EntityHandle handle;
+        handle.id = entity_id;
+        handle.generation = entities[entity_id].generation;
+        return handle;
+    }
+
+    //true if handle points to an entity which has not been destroyed since
+    //the handle was created
+    bool isValid(EntityHandle handle) {
+        if (handle.id < 0 || handle.id >= (int)entities.size()) return false;
+        const Entity& ent = entities[handle.id];
+        return ent.alive && ent.generation == handle.generation;
+    }
+
+    //destroys entity and all its components. The entity slot is
+    //added to free list and its generation incremented, so all existing handles
+    //to it become invalid
+    void destroyEntity(int entity_id) {
+        if (entity_id < 0 || entity_id >= (int)entities.size() || !entities[entity_id].alive) return;
+        removeAllComponents_(entity_id, make_index_sequence<tuple_size<ComponentArrays>::value>());
+        Entity& ent = entities[entity_id];
+        ent.alive = false;
+        ent.active = false;
+        ent.generation++;
+        ent.name.clear();
+        free_entities_.push_back(entity_id);
+    }
+
+    void destroyEntity(EntityHandle handle) {
+        if (isValid(handle)) destroyEntity(handle.id);
+    }
     
     //creates a new component with no entity parent
+    //its owner is -1, so views and entity lookups skip it
     template<typename T>
     int createComponent(){
         // get reference to vector
-        vector<T>& the_vec = get<vector<T>>(components);
+        vector<T>& the_vec = storage_<T>().data;
         // add a new object at back of vector
         the_vec.emplace_back();
         // return index of new object in vector
-        return (int)the_vec->size() - 1;
+        return (int)the_vec.size() - 1;
     }
     
     //creates a new component and associates it with an entity
     template<typename T>
     T& createComponentForEntity(int entity_id){
+        //get storage for this component type
+        auto& storage = storage_<T>();
+        //singleton storage: take component away from previous owner
+        if (storage.full()) {
+            if (storage.data[0].owner >= 0) removeComponent<T>(storage.data[0].owner);
+            else storage.data.pop_back();
+        }
         // get reference to vector
-        vector<T>& the_vec = get<vector<T>>(components);
+        vector<T>& the_vec = storage.data;
         // add a new object at back of vector
         the_vec.emplace_back();
         
-        //get index type of ComponentType
-        const int type_index = type2int<T>::result;
-        
-        //set index of entity component array to index of newly added component
-        entities[entity_id].components[type_index] = (int)the_vec.size() - 1;
+        //tell storage where new component is, then mark entity as having it
+        Entity& ent = entities[entity_id];
+        storage.attach(ent, entity_id, (int)the_vec.size() - 1);
+        ent.signature |= signatureOf<T>();
         
         //set owner of component to entity
         Component& new_comp = the_vec.back();
@@ -64,21 +141,54 @@ struct EntityComponentStore {
         return the_vec.back(); // return pointer to new component
     }
     
+    //removes component of type T from entity in O(1): last component in array
+    //is moved into the slot of the removed one (swap and pop), and
+    //the entity which owns the moved component is updated to point to new slot
+    //returns false if entity did not have component of this type
+    template<typename T>
+    bool removeComponent(int entity_id) {
+        if (!hasComponents<T>(entity_id)) return false;
+
+        auto& storage = storage_<T>();
+        vector<T>& the_vec = storage.data;
+        Entity& ent = entities[entity_id];
+        const int comp_index = storage.find(ent, entity_id);
+        const int last_index = (int)the_vec.size() - 1;
+
+        componentRemoved_<T>(comp_index);
+        if (comp_index != last_index) {
+            the_vec[comp_index] = std::move(the_vec[last_index]);
+            const int moved_owner = the_vec[comp_index].owner;
+            if (moved_owner >= 0) storage.relocate(entities[moved_owner], moved_owner, comp_index);
+            componentMoved_<T>(last_index, comp_index);
+        }
+        the_vec.pop_back();
+        storage.detach(ent, entity_id);
+        ent.signature &= ~signatureOf<T>();
+        return true;
+    }
+
+    template<typename T>
+    bool removeComponent(EntityHandle handle) {
+        if (!isValid(handle)) return false;
+        return removeComponent<T>(handle.id);
+    }
+    
     //return reference to component at id in array
     template<typename T>
     T& getComponentInArray(int an_id) {
-        return get<vector<T>>(components)[an_id] ;
+        return storage_<T>().data[an_id] ;
     }
     
     //return reference to component stored in entity
     template<typename T>
     T& getComponentFromEntity(int entity_id) {
-        //get index for type
-        const int type_index = type2int<T>::result;
+        //get storage for type
+        auto& storage = storage_<T>();
         //get index for component
-        const int comp_index = entities[entity_id].components[type_index];
+        const int comp_index = storage.find(entities[entity_id], entity_id);
         //return component from vector in tuple
-        return get<vector<T>>(components)[comp_index];
+        return storage.data[comp_index];
     }
 
 	//return reference to component stored in entity, accessed by name
@@ -86,30 +196,314 @@ struct EntityComponentStore {
 	T& getComponentFromEntity(std::string entity_name) {
 		//get entity id
 		const int entity_id = getEntity(entity_name);
-		//get index for type
-		const int type_index = type2int<T>::result;
-		//get index for component
-		const int comp_index = entities[entity_id].components[type_index];
-		//return component from vector in tuple
-		return get<vector<T>>(components)[comp_index];
+		return getComponentFromEntity<T>(entity_id);
 	}
     
-    //return id of component in relevant array
+    //return id of component in relevant array, -1 if entity doesn't have one
     template<typename T>
     int getComponentID(int entity_id) {
-        //get identifier of type
-        const int type_index = type2int<T>::result;
+        if (!hasComponents<T>(entity_id)) return -1;
         //return id of this component type for this
-        return entities[entity_id].components[type_index];
+        return storage_<T>().find(entities[entity_id], entity_id);
+    }
+
+    //updates id of component owned by entity, for systems which reorder
+    //a component array (e.g. sorting meshes by material)
+    template<typename T>
+    void setComponentID(int entity_id, int comp_index) {
+        storage_<T>().relocate(entities[entity_id], entity_id, comp_index);
+    }
+
+    //returns handle to component of type T owned by entity
+    //unlike component ids or references, handle survives removal of other
+    //components and reallocation of component arrays
+    template<typename T>
+    ComponentHandle<T> getComponentHandle(int entity_id) {
+        ComponentHandle<T> handle;
+        handle.entity = getEntityHandle(entity_id);
+        return handle;
+    }
+
+    //true if owner entity is still alive and still has component of type T
+    template<typename T>
+    bool isValid(ComponentHandle<T> handle) {
+        return isValid(handle.entity) && hasComponents<T>(handle.entity.id);
+    }
+
+    //return reference to component pointed to by handle
+    //check isValid() first if handle may be stale
+    template<typename T>
+    T& getComponent(ComponentHandle<T> handle) {
+        return getComponentFromEntity<T>(handle.entity.id);
+    }
+    
+    //true if entity has all component types Ts
+    template<typename... Ts>
+    bool hasComponents(int entity_id) {
+        return (entities[entity_id].signature & signatureOf<Ts...>()) == signatureOf<Ts...>();
+    }
+
+    //returns a view of all entities which have all component types Ts
+    //e.g. for (int ent : ECS.view<Transform, Mesh>()) {...}
+    template<typename... Ts>
+    View<Ts...> view();
+
+    //calls f(entity_id, Ts&...) for every entity which has all component types Ts
+    //e.g. ECS.each<Mesh, Transform>([&](int ent, Mesh& mesh, Transform& transform) {...});
+    //components must not be added or removed inside f
+    template<typename... Ts, typename F>
+    void each(F f);
+
+    //calls f(index, component) for every component of type T in array range [first, last),
+    //split into chunks of grain_size components which run in parallel as jobs
+    //f may run on several threads at once. reads/writes must declare every component
+    //type f uses (T itself is always read). Returns when all chunks have finished
+    //e.g. ECS.parallel_each<Camera>(JOBS, 0, signatureOf<Camera>(), 64, [](int i, Camera& cam) {...});
+    template<typename T, typename F>
+    void parallel_each(JobSystem& jobs, ComponentSignature reads, ComponentSignature writes,
+                       int grain_size, int first, int last, F f);
+
+    //same as above, over the whole array of T
+    template<typename T, typename F>
+    void parallel_each(JobSystem& jobs, ComponentSignature reads, ComponentSignature writes, int grain_size, F f) {
+        parallel_each<T>(jobs, reads, writes, grain_size, 0, (int)getAllComponents<T>().size(), f);
+    }
+
+    //tasks call these around any code which uses the ECS from a job. With ECS_CHECK_ACCESS
+    //the ECS counts readers and writers of each array, and prints an error if two
+    //accesses overlap while one of them is writing
+    void beginAccess(ComponentAccess& access) {
+#ifdef ECS_CHECK_ACCESS
+        const ComponentSignature reads_only = access.reads & ~access.writes;
+        for (int t = 0; t < NUM_TYPE_COMPONENTS; t++) {
+            if (access.writes & (1u << t)) access_writers_[t]++;
+            if (reads_only & (1u << t)) access_readers_[t]++;
+        }
+        for (int t = 0; t < NUM_TYPE_COMPONENTS; t++) {
+            if ((access.writes & (1u << t)) && (access_writers_[t] > 1 || access_readers_[t] > 0))
+                cerr << "ECS access conflict: " << access.name << " writes component type " << t << " while it is in use" << endl;
+            if ((reads_only & (1u << t)) && access_writers_[t] > 0)
+                cerr << "ECS access conflict: " << access.name << " reads component type " << t << " while it is being written" << endl;
+        }
+        ComponentAccess*& current = currentAccess_();
+        access.outer = current;
+        current = &access;
+#endif
+    }
+
+    void endAccess(ComponentAccess& access) {
+#ifdef ECS_CHECK_ACCESS
+        const ComponentSignature reads_only = access.reads & ~access.writes;
+        for (int t = 0; t < NUM_TYPE_COMPONENTS; t++) {
+            if (access.writes & (1u << t)) access_writers_[t]--;
+            if (reads_only & (1u << t)) access_readers_[t]--;
+        }
+        currentAccess_() = access.outer;
+#endif
     }
     
     //returns a const (i.e. non-editable) reference to vector of Type
     //i.e. array will not be editable
     template<typename T>
     std::vector<T>& getAllComponents() {
-        return get<vector<T>>(components);
+        return storage_<T>().data;
     }
     //stores main camera id
     int main_camera = -1;
+
+private:
+    //ids of destroyed entities, ready to be reused by createEntity
+    vector<int> free_entities_;
+
+    //returns storage object of component type T
+    template<typename T>
+    typename tuple_element<type2int<T>::result, ComponentArrays>::type& storage_() {
+        return get<type2int<T>::result>(components);
+    }
+
+    //true if this thread is running inside a task, which then already holds the access
+    //of any parallel loop it starts. Reports loops using components the task didn't declare
+    bool insideAccess_(const ComponentAccess& access) {
+#ifdef ECS_CHECK_ACCESS
+        const ComponentAccess* current = currentAccess_();
+        if (!current) return false;
+        if ((access.writes & ~current->writes) || (access.reads & ~(current->reads | current->writes)))
+            cerr << "ECS access: " << access.name << " uses components not declared by " << current->name << endl;
+#endif
+        return true;
+    }
+
+#ifdef ECS_CHECK_ACCESS
+    //number of accesses currently reading/writing each component array
+    atomic<int> access_readers_[NUM_TYPE_COMPONENTS] = {};
+    atomic<int> access_writers_[NUM_TYPE_COMPONENTS] = {};
+
+    //innermost access held by this thread
+    static ComponentAccess*& currentAccess_() {
+        static thread_local ComponentAccess* current = nullptr;
+        return current;
+    }
+#endif
+
+    //calls removeComponent for every type in ComponentArrays
+    template<size_t... I>
+    void removeAllComponents_(int entity_id, index_sequence<I...>) {
+        int dummy[] = { 0, (removeComponent<typename tuple_element<I, ComponentArrays>::type::component_type>(entity_id), 0)... };
+        (void)dummy;
+    }
+
+    //hooks to fix up any array indices stored inside other components, called
+    //by removeComponent. Specialised below for types which are referenced by index
+    template<typename T>
+    void componentRemoved_(int removed_index) {}
+    template<typename T>
+    void componentMoved_(int old_index, int new_index) {}
     
 };
+
+//children of a removed transform become roots, keeping their current world matrix
+template<>
+inline void EntityComponentStore::componentRemoved_<Transform>(int removed_index) {
+    for (auto& t : storage_<Transform>().data) {
+        if (t.parent == removed_index) {
+            t.set(t.world);
+            t.setParent(-1);
+        }
+    }
+}
+
+template<>
+inline void EntityComponentStore::componentMoved_<Transform>(int old_index, int new_index) {
+    for (auto& t : storage_<Transform>().data)
+        if (t.parent == old_index) t.setParent(new_index);
+}
+
+template<>
+inline void EntityComponentStore::componentRemoved_<Camera>(int removed_index) {
+    if (main_camera == removed_index) main_camera = -1;
+}
+
+template<>
+inline void EntityComponentStore::componentMoved_<Camera>(int old_index, int new_index) {
+    if (main_camera == old_index) main_camera = new_index;
+}
+
+template<>
+inline void EntityComponentStore::componentRemoved_<Collider>(int removed_index) {
+    for (auto& c : storage_<Collider>().data)
+        if (c.other == removed_index) c.other = -1;
+}
+
+template<>
+inline void EntityComponentStore::componentMoved_<Collider>(int old_index, int new_index) {
+    for (auto& c : storage_<Collider>().data)
+        if (c.other == old_index) c.other = new_index;
+}
+
+/**** VIEWS ****/
+
+//View over all entities which have every component type in Ts
+//Iteration walks the smallest of the Ts arrays in memory order (reading only the
+//owner field of each component) and tests the owner signature against the view
+//signature, so no lookups are done for entities which don't match
+//Adding or removing components invalidates the view
+template<typename... Ts>
+class View {
+public:
+    View(EntityComponentStore& store) : store_(store) {
+        int dummy[] = { 0, (considerDriver_(store.getAllComponents<Ts>()), 0)... };
+        (void)dummy;
+    }
+
+    //iterates ids of matching entities
+    class iterator {
+    public:
+        iterator(const View* view, size_t i) : view_(view), i_(i) { skip_(); }
+        int operator*() const { return view_->ownerAt_(i_); }
+        iterator& operator++() { i_++; skip_(); return *this; }
+        bool operator!=(const iterator& other) const { return i_ != other.i_; }
+    private:
+        void skip_() { while (i_ < view_->count_ && !view_->matches_(view_->ownerAt_(i_))) i_++; }
+        const View* view_;
+        size_t i_;
+    };
+
+    iterator begin() const { return iterator(this, 0); }
+    iterator end() const { return iterator(this, count_); }
+
+    //calls f(entity_id, Ts&...) for each matching entity
+    template<typename F>
+    void each(F f) {
+        for (size_t i = 0; i < count_; i++) {
+            int entity_id = ownerAt_(i);
+            if (matches_(entity_id))
+                f(entity_id, store_.getComponentFromEntity<Ts>(entity_id)...);
+        }
+    }
+
+private:
+    EntityComponentStore& store_;
+    static constexpr ComponentSignature signature_ = signatureOf<Ts...>();
+
+    //owner field of first component in driving array, and distance between components
+    const char* owners_ = nullptr;
+    size_t stride_ = 0;
+    size_t count_ = 0;
+    bool has_driver_ = false;
+
+    //picks the smallest array to drive iteration
+    template<typename T>
+    void considerDriver_(vector<T>& the_vec) {
+        if (has_driver_ && the_vec.size() >= count_) return;
+        has_driver_ = true;
+        count_ = the_vec.size();
+        stride_ = sizeof(T);
+        owners_ = count_ ? reinterpret_cast<const char*>(&static_cast<const Component&>(the_vec[0]).owner) : nullptr;
+    }
+
+    int ownerAt_(size_t i) const { return *reinterpret_cast<const int*>(owners_ + i * stride_); }
+    bool matches_(int entity_id) const {
+        return entity_id >= 0 && (store_.entities[entity_id].signature & signature_) == signature_;
+    }
+};
+
+template<typename... Ts>
+constexpr ComponentSignature View<Ts...>::signature_;
+
+template<typename... Ts>
+inline View<Ts...> EntityComponentStore::view() {
+    return View<Ts...>(*this);
+}
+
+template<typename... Ts, typename F>
+inline void EntityComponentStore::each(F f) {
+    view<Ts...>().each(f);
+}
+
+template<typename T, typename F>
+inline void EntityComponentStore::parallel_each(JobSystem& jobs, ComponentSignature reads, ComponentSignature writes,
+                                                int grain_size, int first, int last, F f) {
+    ComponentAccess access;
+    access.name = "parallel_each";
+    access.reads = reads | signatureOf<T>();
+    access.writes = writes;
+    const bool inside_task = insideAccess_(access);
+    if (!inside_task) beginAccess(access);
+
+    vector<T>& the_vec = getAllComponents<T>();
+    if (grain_size < 1) grain_size = 1;
+
+    //queue all chunks except first, which runs on this thread while others are picked up
+    JobCounter counter;
+    for (int start = first + grain_size; start < last; start += grain_size) {
+        const int end = std::min(start + grain_size, last);
+        jobs.run([&the_vec, &f, start, end]() {
+            for (int i = start; i < end; i++) f(i, the_vec[i]);
+        }, &counter);
+    }
+    const int first_end = std::min(first + grain_size, last);
+    for (int i = first; i < first_end; i++) f(i, the_vec[i]);
+    jobs.wait(counter);
+
+    if (!inside_task) endAccess(access);
+}
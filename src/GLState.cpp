@@ -0,0 +1,133 @@
+#include "GLState.h"
+#include <cstring>
+
+void GLState::beginFrame() {
+	memcpy(last_issued_, issued_, sizeof(issued_));
+	memcpy(last_elided_, elided_, sizeof(elided_));
+	memset(issued_, 0, sizeof(issued_));
+	memset(elided_, 0, sizeof(elided_));
+	invalidate();
+}
+
+void GLState::invalidate() {
+	program_ = vao_ = draw_framebuffer_ = read_framebuffer_ = UNKNOWN;
+	active_unit_ = UNKNOWN;
+	for (int u = 0; u < MAX_TEXTURE_UNITS; u++)
+		for (int t = 0; t < NUM_TEXTURE_TARGETS; t++)
+			textures_[u][t] = UNKNOWN;
+	depth_test_ = cull_face_ = blend_ = stencil_test_ = depth_clamp_ = UNKNOWN;
+	cull_mode_ = depth_func_ = depth_mask_ = blend_src_ = blend_dst_ = color_mask_ = UNKNOWN;
+	stencil_func_[0] = stencil_func_[1] = stencil_func_[2] = UNKNOWN;
+	for (int f = 0; f < 2; f++)
+		stencil_op_[f][0] = stencil_op_[f][1] = stencil_op_[f][2] = UNKNOWN;
+	stencil_mask_ = UNKNOWN;
+	viewport_known_ = false;
+}
+
+void GLState::useProgram(GLuint program) {
+	if (changed_(GLCallProgram, program_, program))
+		glUseProgram(program);
+}
+
+void GLState::bindVertexArray(GLuint vao) {
+	if (changed_(GLCallVertexArray, vao_, vao))
+		glBindVertexArray(vao);
+}
+
+void GLState::bindFramebuffer(GLenum target, GLuint framebuffer) {
+	if (target == GL_FRAMEBUFFER) {
+		bool issue = draw_framebuffer_ != framebuffer || read_framebuffer_ != framebuffer;
+		draw_framebuffer_ = read_framebuffer_ = framebuffer;
+		count(GLCallFramebuffer, issue);
+		if (issue) glBindFramebuffer(target, framebuffer);
+	}
+	else if (changed_(GLCallFramebuffer, target == GL_DRAW_FRAMEBUFFER ? draw_framebuffer_ : read_framebuffer_, framebuffer)) {
+		glBindFramebuffer(target, framebuffer);
+	}
+}
+
+//only the unit whose binding changes is made active
+void GLState::bindTexture(GLuint unit, GLenum target, GLuint texture) {
+	int t = target == GL_TEXTURE_2D ? 0 : target == GL_TEXTURE_CUBE_MAP ? 1 : target == GL_TEXTURE_2D_ARRAY ? 2 :
+		target == GL_TEXTURE_BUFFER ? 3 : -1;
+	if (unit < (GLuint)MAX_TEXTURE_UNITS && t != -1) {
+		if (!changed_(GLCallTexture, textures_[unit][t], texture)) return;
+	}
+	else {
+		count(GLCallTexture, true);
+	}
+	if (changed_(GLCallTexture, active_unit_, unit))
+		glActiveTexture(GL_TEXTURE0 + unit);
+	glBindTexture(target, texture);
+}
+
+void GLState::setEnabled(GLenum cap, bool enabled) {
+	GLuint* current = cap == GL_DEPTH_TEST ? &depth_test_ : cap == GL_CULL_FACE ? &cull_face_ : cap == GL_BLEND ? &blend_ :
+		cap == GL_STENCIL_TEST ? &stencil_test_ : cap == GL_DEPTH_CLAMP ? &depth_clamp_ : nullptr;
+	if (current && !changed_(GLCallFixedFunction, *current, enabled ? 1 : 0)) return;
+	if (!current) count(GLCallFixedFunction, true);
+	if (enabled) glEnable(cap);
+	else glDisable(cap);
+}
+
+void GLState::cullFace(GLenum mode) {
+	if (changed_(GLCallFixedFunction, cull_mode_, mode))
+		glCullFace(mode);
+}
+
+void GLState::depthFunc(GLenum func) {
+	if (changed_(GLCallFixedFunction, depth_func_, func))
+		glDepthFunc(func);
+}
+
+void GLState::depthMask(bool write) {
+	if (changed_(GLCallFixedFunction, depth_mask_, write ? 1 : 0))
+		glDepthMask(write ? GL_TRUE : GL_FALSE);
+}
+
+void GLState::blendFunc(GLenum src, GLenum dst) {
+	bool issue = blend_src_ != src || blend_dst_ != dst;
+	blend_src_ = src; blend_dst_ = dst;
+	count(GLCallFixedFunction, issue);
+	if (issue) glBlendFunc(src, dst);
+}
+
+void GLState::colorMask(bool write) {
+	if (changed_(GLCallFixedFunction, color_mask_, write ? 1 : 0)) {
+		GLboolean w = write ? GL_TRUE : GL_FALSE;
+		glColorMask(w, w, w, w);
+	}
+}
+
+void GLState::stencilFunc(GLenum func, GLint ref, GLuint mask) {
+	bool issue = stencil_func_[0] != func || stencil_func_[1] != (GLuint)ref || stencil_func_[2] != mask;
+	stencil_func_[0] = func; stencil_func_[1] = (GLuint)ref; stencil_func_[2] = mask;
+	count(GLCallFixedFunction, issue);
+	if (issue) glStencilFunc(func, ref, mask);
+}
+
+//faces are shadowed separately, so setting both after one only issues the call if needed
+void GLState::stencilOp(GLenum face, GLenum stencil_fail, GLenum depth_fail, GLenum pass) {
+	bool issue = false;
+	for (int f = 0; f < 2; f++) {
+		if ((f == 0 && face == GL_BACK) || (f == 1 && face == GL_FRONT)) continue;
+		GLuint* op = stencil_op_[f];
+		issue = issue || op[0] != stencil_fail || op[1] != depth_fail || op[2] != pass;
+		op[0] = stencil_fail; op[1] = depth_fail; op[2] = pass;
+	}
+	count(GLCallFixedFunction, issue);
+	if (issue) glStencilOpSeparate(face, stencil_fail, depth_fail, pass);
+}
+
+void GLState::stencilMask(GLuint write_mask) {
+	if (changed_(GLCallFixedFunction, stencil_mask_, write_mask))
+		glStencilMask(write_mask);
+}
+
+void GLState::viewport(GLint x, GLint y, GLsizei width, GLsizei height) {
+	bool issue = !viewport_known_ || viewport_[0] != x || viewport_[1] != y || viewport_[2] != width || viewport_[3] != height;
+	viewport_[0] = x; viewport_[1] = y; viewport_[2] = width; viewport_[3] = height;
+	viewport_known_ = true;
+	count(GLCallFixedFunction, issue);
+	if (issue) glViewport(x, y, width, height);
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include "includes.h"
+
+//kinds of GL call shadowed by GLState, for per frame counters
+enum GLStateCall {
+	GLCallProgram,
+	GLCallVertexArray,
+	GLCallFramebuffer,
+	GLCallTexture,
+	GLCallFixedFunction, //enable/disable, cull face, depth and blend state, viewport
+	GLCallUniform,
+	GLCallCount
+};
+
+//Shadows the GL state which changes during a frame, so that setting a value which is
+//already current never reaches the driver. Rendering code sets this state through here
+//rather than calling GL. Code which does call GL directly (resource creation, imGUI) must
+//restore what it changes, and all shadowed state is forgotten at the start of each frame
+class GLState {
+public:
+	GLState() { invalidate(); }
+	void beginFrame();
+	//forget everything: next call of each kind is always issued
+	void invalidate();
+
+	void useProgram(GLuint program);
+	void bindVertexArray(GLuint vao);
+	void bindFramebuffer(GLenum target, GLuint framebuffer); //GL_FRAMEBUFFER sets both read and draw
+	void bindTexture(GLuint unit, GLenum target, GLuint texture);
+	void setEnabled(GLenum cap, bool enabled); //GL_DEPTH_TEST, GL_CULL_FACE, GL_BLEND, GL_STENCIL_TEST or GL_DEPTH_CLAMP
+	void cullFace(GLenum mode);
+	void depthFunc(GLenum func);
+	void depthMask(bool write);
+	void blendFunc(GLenum src, GLenum dst);
+	void colorMask(bool write); //all channels of all draw buffers
+	void stencilFunc(GLenum func, GLint ref, GLuint mask); //both faces
+	void stencilOp(GLenum face, GLenum stencil_fail, GLenum depth_fail, GLenum pass); //GL_FRONT, GL_BACK or GL_FRONT_AND_BACK
+	void stencilMask(GLuint write_mask);
+	void viewport(GLint x, GLint y, GLsizei width, GLsizei height);
+
+	//for state shadowed elsewhere (uniform values are kept by each Shader)
+	void count(GLStateCall call, bool issued) { (issued ? issued_ : elided_)[call]++; }
+
+	//counters of last complete frame
+	int getIssued(GLStateCall call) const { return last_issued_[call]; }
+	int getElided(GLStateCall call) const { return last_elided_[call]; }
+
+private:
+	static const GLuint UNKNOWN = 0xFFFFFFFF;
+	static const int MAX_TEXTURE_UNITS = 32;
+	static const int NUM_TEXTURE_TARGETS = 4; //2D, cube map, 2D array, buffer
+
+	GLuint program_, vao_, draw_framebuffer_, read_framebuffer_;
+	GLuint active_unit_;
+	GLuint textures_[MAX_TEXTURE_UNITS][NUM_TEXTURE_TARGETS];
+	GLuint depth_test_, cull_face_, blend_, stencil_test_, depth_clamp_; //1, 0 or UNKNOWN
+	GLuint cull_mode_, depth_func_, depth_mask_, blend_src_, blend_dst_, color_mask_;
+	GLuint stencil_func_[3]; //func, ref, mask
+	GLuint stencil_op_[2][3]; //front and back: stencil fail, depth fail, pass
+	GLuint stencil_mask_;
+	GLint viewport_[4];
+	bool viewport_known_ = false;
+
+	int issued_[GLCallCount] = {};
+	int elided_[GLCallCount] = {};
+	int last_issued_[GLCallCount] = {};
+	int last_elided_[GLCallCount] = {};
+
+	//counts call, and returns whether it must be issued
+	bool changed_(GLStateCall call, GLuint& current, GLuint value) {
+		bool issue = current != value;
+		current = value;
+		count(call, issue);
+		return issue;
+	}
+};
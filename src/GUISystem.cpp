@@ -63,12 +63,12 @@ void GUISystem::lateInit() {
 void GUISystem::update(float dt) {
 
 	//we draw GUI last, want it to be on top of everything
-	glDisable(GL_DEPTH_TEST);
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	GLSTATE.setEnabled(GL_DEPTH_TEST, false);
+	GLSTATE.setEnabled(GL_BLEND, true);
+	GLSTATE.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
 	//draw GUI images first
-	glUseProgram(icon_shader_->program);
+	GLSTATE.useProgram(icon_shader_->program);
 
 	//for all images
 	auto& elements = ECS.getAllComponents<GUIElement>();
@@ -85,22 +85,16 @@ void GUISystem::update(float dt) {
 		model.translate(el.offset.x, el.offset.y, 0);
 
 		//set uniforms
-		GLint u_mvp = glGetUniformLocation(icon_shader_->program, "u_mvp");
-		glUniformMatrix4fv(u_mvp, 1, GL_FALSE, (view_projection * model).m);
-
-		GLint u_icon = glGetUniformLocation(icon_shader_->program, "u_icon");
-		glUniform1i(u_icon, 10);
-
-		glActiveTexture(GL_TEXTURE0 + 10);
-		glBindTexture(GL_TEXTURE_2D, el.texture);
+		icon_shader_->setUniform(U_MVP, view_projection * model);
+		icon_shader_->setTexture(U_ICON, el.texture);
 
 		//draw
-		glBindVertexArray(vao_);
+		GLSTATE.bindVertexArray(vao_);
 		glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
 	}
 
 	//use a different shader for text
-	glUseProgram(text_shader_->program);
+	GLSTATE.useProgram(text_shader_->program);
 
 	//for all texts
 	auto& text_elements = ECS.getAllComponents<GUIText>();
@@ -117,25 +111,17 @@ void GUISystem::update(float dt) {
 		model.translate(el.offset.x, el.offset.y, 0);
 
 		//set uniforms
-		GLint u_mvp = glGetUniformLocation(text_shader_->program, "u_mvp");
-		glUniformMatrix4fv(u_mvp, 1, GL_FALSE, (view_projection * model).m);
-
-		GLint u_color = glGetUniformLocation(text_shader_->program, "u_color");
-		glUniform3fv(u_color, 1, el.color.value_);
-
-		GLint u_icon = glGetUniformLocation(text_shader_->program, "u_icon");
-		glUniform1i(u_icon, 10);
-
-		glActiveTexture(GL_TEXTURE0 + 10);
-		glBindTexture(GL_TEXTURE_2D, el.texture);
+		text_shader_->setUniform(U_MVP, view_projection * model);
+		text_shader_->setUniform(U_COLOR, el.color);
+		text_shader_->setTexture(U_ICON, el.texture);
 
 		//draw
-		glBindVertexArray(vao_);
+		GLSTATE.bindVertexArray(vao_);
 		glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
 	}
 
-	glEnable(GL_DEPTH_TEST);
-	glDisable(GL_BLEND);
+	GLSTATE.setEnabled(GL_DEPTH_TEST, true);
+	GLSTATE.setEnabled(GL_BLEND, false);
 
 }
 
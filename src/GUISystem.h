@@ -12,6 +12,10 @@ public:
 	void lateInit();
 	void update(float dt);
 
+	//component access of update, used to schedule it in Game task graph
+	static constexpr ComponentSignature reads = signatureOf<GUIElement, GUIText>();
+	static constexpr ComponentSignature writes = signatureOf<GUIElement, GUIText>();
+
 	void updateViewport(int new_width, int new_height);
 
 	GLuint createTextTexture(std::string text, std::string font_path, int font_size, int tex_width, int tex_height);
@@ -9,6 +9,18 @@
 #include "extern.h"
 #include "Parsers.h"
 
+//number of cubes in generated instancing test scene, e.g. -DINSTANCE_TEST_COUNT=50000
+//(0 disables it)
+#ifndef INSTANCE_TEST_COUNT
+#define INSTANCE_TEST_COUNT 0
+#endif
+
+//number of small point and spot lights in generated light clustering test scene,
+//e.g. -DLIGHT_TEST_COUNT=500 (0 disables it)
+#ifndef LIGHT_TEST_COUNT
+#define LIGHT_TEST_COUNT 0
+#endif
+
 Game::Game() {
 
 }
@@ -19,8 +31,12 @@ void Game::init(int w, int h) {
 	window_width_ = w; window_height_ = h;
 	//******* INIT SYSTEMS *******
 
+	//start worker threads
+	JOBS.init();
+
 	//init systems except debug, which needs info about scene
 	control_system_.init();
+	transform_system_.init();
 	graphics_system_.init(window_width_, window_height_, "data/assets/");
     script_system_.init(&control_system_);
 	gui_system_.init(window_width_, window_height_);
@@ -62,6 +78,7 @@ void Game::init(int w, int h) {
 	Mesh& floor_mesh = ECS.createComponentForEntity<Mesh>(floor_entity);
 	floor_mesh.geometry = geom_floor;
 	floor_mesh.material = mat_blue_check_index;
+	floor_mesh.cast_shadows = false;
 	
 	//phong sphere
 	int sphere_entity = ECS.createEntity("phong_sphere");
@@ -87,43 +104,114 @@ void Game::init(int w, int h) {
 	light_comp_sphere.forward = light_comp_sphere.direction.normalize();
 	light_comp_sphere.setOrthographic(-10, 10, -10, 10, 8, 30);
 	light_comp_sphere.cast_shadow = 1;
+	light_comp_sphere.resolution = 2048;
 	light_comp_sphere.update();
 
+	//instancing test scene
+	if (INSTANCE_TEST_COUNT > 0)
+		createInstanceField_(INSTANCE_TEST_COUNT, cubemap_geometry, mat_blue_check_index);
+
+	//light clustering test scene
+	if (LIGHT_TEST_COUNT > 0)
+		createLightField_(LIGHT_TEST_COUNT);
+
 	//create camera
 	createFreeCamera_();
     
     //******* LATE INIT AFTER LOADING RESOURCES *******//
     graphics_system_.lateInit();
     script_system_.lateInit();
-    debug_system_.lateInit();
+    debug_system_.lateInit(&transform_system_, &graphics_system_);
+
+	createFrameGraph_();
 
 	debug_system_.setActive(false);
 
 }
 
-//update each system in turn
+//update all systems
 void Game::update(float dt) {
 
 	if (ECS.getAllComponents<Camera>().size() == 0) {print("There is no camera set!"); return;}
 
+	//run all systems. See createFrameGraph_ for order and threads
+	frame_dt_ = dt;
+	GLSTATE.beginFrame();
+	frame_graph_.run(JOBS);
+
+	JOBS.endFrame();
+}
+
+//Adds each system update to the frame graph, in the order they would run in sequence.
+//The graph keeps this order between systems which touch the same components, and runs
+//the rest in parallel. Systems which use GL (or imGUI) run on the main thread
+void Game::createFrameGraph_() {
 	//update input
-	control_system_.update(dt);
+	frame_graph_.addTask("control", ControlSystem::reads, ControlSystem::writes, false,
+		[this]() { control_system_.update(frame_dt_); });
+
+	//world matrices
+	frame_graph_.addTask("transform", TransformSystem::reads, TransformSystem::writes, false,
+		[this]() { transform_system_.update(frame_dt_); });
 
 	//collision
-	collision_system_.update(dt);
+	frame_graph_.addTask("collision", CollisionSystem::reads, CollisionSystem::writes, false,
+		[this]() { collision_system_.update(frame_dt_); });
+
+	//scripts - only conflict with the systems using the components they declare
+	frame_graph_.addTask("scripts", script_system_.getReads(), script_system_.getWrites(), false,
+		[this]() { script_system_.update(frame_dt_); });
 
-	//scripts
-	script_system_.update(dt);
+	//world matrices again, in case scripts have moved anything
+	frame_graph_.addTask("transform late", TransformSystem::reads, TransformSystem::writes, false,
+		[this]() { transform_system_.update(frame_dt_); });
+
+	//camera matrices - runs in parallel with collision and transform updates above
+	frame_graph_.addTask("cameras", 0, GraphicsSystem::camera_writes, false,
+		[this]() { graphics_system_.updateCameras(); });
+
+	//frustum culling - on a worker, once cameras and world matrices are final
+	int culling = frame_graph_.addTask("culling", GraphicsSystem::cull_reads, 0, false,
+		[this]() { graphics_system_.cullMeshes(); });
 
 	//render
-	graphics_system_.update(dt);
-    
+	int graphics = frame_graph_.addTask("graphics", GraphicsSystem::reads, GraphicsSystem::writes, true,
+		[this]() { graphics_system_.update(frame_dt_); });
+	frame_graph_.addDependency(culling, graphics); //uses visible lists
+
 	//gui
-	gui_system_.update(dt);
+	frame_graph_.addTask("gui", GUISystem::reads, GUISystem::writes, true,
+		[this]() { gui_system_.update(frame_dt_); });
 
 	//debug
-	debug_system_.update(dt);
-   
+	frame_graph_.addTask("debug", DebugSystem::reads, DebugSystem::writes, true,
+		[this]() { debug_system_.update(frame_dt_); });
+}
+
+//square grid of count short range lights just above the floor, with colors cycling
+//through the hue circle. One in four is a spot light pointing down. No shadows
+void Game::createLightField_(int count) {
+	int side = (int)ceilf(sqrtf((float)count));
+	float spacing = 38.0f / side;
+	float start = -0.5f * spacing * (side - 1);
+	for (int i = 0; i < count; i++) {
+		int ent = ECS.createEntity("light_" + std::to_string(i));
+		lm::vec3 position(start + spacing * (i % side), 0.3f, start + spacing * (i / side));
+		ECS.getComponentFromEntity<Transform>(ent).translate(position);
+		Light& light = ECS.createComponentForEntity<Light>(ent);
+		float hue = 6.0f * (float)i / count;
+		light.color = lm::vec3(
+			std::max(0.0f, std::min(1.0f, fabsf(hue - 3.0f) - 1.0f)),
+			std::max(0.0f, std::min(1.0f, 2.0f - fabsf(hue - 2.0f))),
+			std::max(0.0f, std::min(1.0f, 2.0f - fabsf(hue - 4.0f))));
+		light.type = i % 4 == 3 ? 2 : 1;
+		light.direction = lm::vec3(0.0f, -1.0f, 0.0f);
+		light.linear_att = 2.0f;
+		light.quadratic_att = 16.0f; //range of about 4 units, see Light::getRange
+		light.position = position;
+		light.forward = light.direction;
+		light.update();
+	}
 }
 
 //update game viewports
@@ -140,6 +228,22 @@ void Game::update_viewports(int window_width, int window_height) {
 }
 
 
+//square grid of count small copies of the same mesh, centered on origin
+void Game::createInstanceField_(int count, int geometry, int material) {
+	int side = (int)ceilf(sqrtf((float)count));
+	float spacing = 1.5f;
+	float start = -0.5f * spacing * (side - 1);
+	for (int i = 0; i < count; i++) {
+		int ent = ECS.createEntity("instance_" + std::to_string(i));
+		Transform& t = ECS.getComponentFromEntity<Transform>(ent);
+		t.translate(start + spacing * (i % side), 0.5f, start + spacing * (i / side));
+		t.scale(0.5f, 0.5f, 0.5f);
+		Mesh& mesh = ECS.createComponentForEntity<Mesh>(ent);
+		mesh.geometry = geometry;
+		mesh.material = material;
+	}
+}
+
 int Game::createFreeCamera_() {
 	int ent_player = ECS.createEntity("PlayerFree");
 	Camera& player_cam = ECS.createComponentForEntity<Camera>(ent_player);
@@ -169,7 +273,7 @@ int Game::createPlayer_(float aspect, ControlSystem& sys) {
 	//each collider ray entity is parented to the playerFPS entity
 	int ent_down_ray = ECS.createEntity("Down Ray");
 	Transform& down_ray_trans = ECS.getComponentFromEntity<Transform>(ent_down_ray);
-	down_ray_trans.parent = ECS.getComponentID<Transform>(ent_player); //set parent as player entity *transform*!
+	down_ray_trans.setParent(ECS.getComponentID<Transform>(ent_player)); //set parent as player entity *transform*!
 	Collider& down_ray_collider = ECS.createComponentForEntity<Collider>(ent_down_ray);
 	down_ray_collider.collider_type = ColliderTypeRay;
 	down_ray_collider.direction = lm::vec3(0.0, -1.0, 0.0);
@@ -177,7 +281,7 @@ int Game::createPlayer_(float aspect, ControlSystem& sys) {
 
 	int ent_left_ray = ECS.createEntity("Left Ray");
 	Transform& left_ray_trans = ECS.getComponentFromEntity<Transform>(ent_left_ray);
-	left_ray_trans.parent = ECS.getComponentID<Transform>(ent_player); //set parent as player entity *transform*!
+	left_ray_trans.setParent(ECS.getComponentID<Transform>(ent_player)); //set parent as player entity *transform*!
 	Collider& left_ray_collider = ECS.createComponentForEntity<Collider>(ent_left_ray);
 	left_ray_collider.collider_type = ColliderTypeRay;
 	left_ray_collider.direction = lm::vec3(-1.0, 0.0, 0.0);
@@ -185,7 +289,7 @@ int Game::createPlayer_(float aspect, ControlSystem& sys) {
 
 	int ent_right_ray = ECS.createEntity("Right Ray");
 	Transform& right_ray_trans = ECS.getComponentFromEntity<Transform>(ent_right_ray);
-	right_ray_trans.parent = ECS.getComponentID<Transform>(ent_player); //set parent as player entity *transform*!
+	right_ray_trans.setParent(ECS.getComponentID<Transform>(ent_player)); //set parent as player entity *transform*!
 	Collider& right_ray_collider = ECS.createComponentForEntity<Collider>(ent_right_ray);
 	right_ray_collider.collider_type = ColliderTypeRay;
 	right_ray_collider.direction = lm::vec3(1.0, 0.0, 0.0);
@@ -193,7 +297,7 @@ int Game::createPlayer_(float aspect, ControlSystem& sys) {
 
 	int ent_forward_ray = ECS.createEntity("Forward Ray");
 	Transform& forward_ray_trans = ECS.getComponentFromEntity<Transform>(ent_forward_ray);
-	forward_ray_trans.parent = ECS.getComponentID<Transform>(ent_player); //set parent as player entity *transform*!
+	forward_ray_trans.setParent(ECS.getComponentID<Transform>(ent_player)); //set parent as player entity *transform*!
 	Collider& forward_ray_collider = ECS.createComponentForEntity<Collider>(ent_forward_ray);
 	forward_ray_collider.collider_type = ColliderTypeRay;
 	forward_ray_collider.direction = lm::vec3(0.0, 0.0, -1.0);
@@ -201,18 +305,18 @@ int Game::createPlayer_(float aspect, ControlSystem& sys) {
 
 	int ent_back_ray = ECS.createEntity("Back Ray");
 	Transform& back_ray_trans = ECS.getComponentFromEntity<Transform>(ent_back_ray);
-	back_ray_trans.parent = ECS.getComponentID<Transform>(ent_player); //set parent as player entity *transform*!
+	back_ray_trans.setParent(ECS.getComponentID<Transform>(ent_player)); //set parent as player entity *transform*!
 	Collider& back_ray_collider = ECS.createComponentForEntity<Collider>(ent_back_ray);
 	back_ray_collider.collider_type = ColliderTypeRay;
 	back_ray_collider.direction = lm::vec3(0.0, 0.0, 1.0);
 	back_ray_collider.max_distance = 1.0f;
 
 	//the control system stores the FPS colliders 
-	sys.FPS_collider_down = ECS.getComponentID<Collider>(ent_down_ray);
-	sys.FPS_collider_left = ECS.getComponentID<Collider>(ent_left_ray);
-	sys.FPS_collider_right = ECS.getComponentID<Collider>(ent_right_ray);
-	sys.FPS_collider_forward = ECS.getComponentID<Collider>(ent_forward_ray);
-	sys.FPS_collider_back = ECS.getComponentID<Collider>(ent_back_ray);
+	sys.FPS_collider_down = ECS.getComponentHandle<Collider>(ent_down_ray);
+	sys.FPS_collider_left = ECS.getComponentHandle<Collider>(ent_left_ray);
+	sys.FPS_collider_right = ECS.getComponentHandle<Collider>(ent_right_ray);
+	sys.FPS_collider_forward = ECS.getComponentHandle<Collider>(ent_forward_ray);
+	sys.FPS_collider_back = ECS.getComponentHandle<Collider>(ent_back_ray);
 
 	ECS.main_camera = ECS.getComponentID<Camera>(ent_player);
 
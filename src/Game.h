@@ -11,7 +11,9 @@
 #include "DebugSystem.h"
 #include "CollisionSystem.h"
 #include "ScriptSystem.h"
+#include "TransformSystem.h"
 #include "GUISystem.h"
+#include "TaskGraph.h"
 
 
 
@@ -54,8 +56,16 @@ private:
     DebugSystem debug_system_;
     CollisionSystem collision_system_;
     ScriptSystem script_system_;
+	TransformSystem transform_system_;
 	GUISystem gui_system_;
 
+	//system updates and their dependencies, run each frame on JOBS
+	TaskGraph frame_graph_;
+	void createFrameGraph_();
+	float frame_dt_ = 0.0f; //dt of current frame, read by graph tasks
+
+	void createInstanceField_(int count, int geometry, int material);
+	void createLightField_(int count);
 	int createFreeCamera_();
 	int createPlayer_(float aspect, ControlSystem& sys);
 
@@ -5,6 +5,10 @@
 #include "Parsers.h"
 #include "extern.h"
 #include <algorithm>
+#include <fstream>
+#include <chrono>
+#include <iterator>
+#include <cfloat>
 
 //destructor
 GraphicsSystem::~GraphicsSystem() {
@@ -33,9 +37,29 @@ void GraphicsSystem::init(int window_width, int window_height, std::string asset
 	//set assets folder
     assets_folder_ = assets_folder;
 
-	//generate light ubo
+	//generate light, shadow tile and material ubos
 	glGenBuffers(1, &light_ubo_);
+	glGenBuffers(1, &shadow_tiles_ubo_);
+	glGenBuffers(1, &material_ubo_);
 
+	//buffers of deferred lighting: all lights, and their clusters
+	light_buffer_.init(GL_RGBA32UI);
+	cluster_grid_buffer_.init(GL_RG32UI);
+	cluster_lights_buffer_.init(GL_R32UI);
+
+	//instance buffer, filled every frame
+	glGenBuffers(1, &instance_vbo_);
+
+	//multi draw indirect needs GL 4.3, context may be older (e.g. 4.1 on macOS)
+	GLint gl_major = 0, gl_minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &gl_major);
+	glGetIntegerv(GL_MINOR_VERSION, &gl_minor);
+	multi_draw_indirect_supported_ = (gl_major > 4 || (gl_major == 4 && gl_minor >= 3)) && glMultiDrawElementsIndirect;
+	if (multi_draw_indirect_supported_)
+		glGenBuffers(1, &indirect_buffer_);
+
+	//per view and per draw uniform blocks, rewritten every frame
+	uniform_ring_.init(64 * 1024);
 
 	//screen space geometry
 	Geometry ss_geom;
@@ -43,6 +67,16 @@ void GraphicsSystem::init(int window_width, int window_height, std::string asset
 	geometries_.push_back(ss_geom);
 	screen_space_geom_ = (int)(geometries_.size() - 1);
 
+	//light volumes
+	Geometry sphere_geom;
+	sphere_geom.createSphereGeometry(16, 8);
+	geometries_.push_back(sphere_geom);
+	light_sphere_geom_ = (int)(geometries_.size() - 1);
+	Geometry cone_geom;
+	cone_geom.createConeGeometry(16);
+	geometries_.push_back(cone_geom);
+	light_cone_geom_ = (int)(geometries_.size() - 1);
+
     //screen space texture shader
     screen_space_shader_ = new Shader("data/shaders/screen.vert", "data/shaders/screen.frag");
     
@@ -51,152 +85,506 @@ void GraphicsSystem::init(int window_width, int window_height, std::string asset
 
 	//shadow map shader
 	depth_shader_ = new Shader("data/shaders/depth.vert", "data/shaders/depth.frag");  
+	depth_instanced_shader_ = new Shader("data/shaders/depth_instanced.vert", "data/shaders/depth.frag");
+	depth_layered_shader_ = new Shader("data/shaders/depth_layered.vert", "data/shaders/depth.frag");
+	depth_layered_shader_->setUniformBlock(U_SHADOW_LAYERS_UBO, SHADOW_LAYERS_BINDING_POINT);
 	
 	gbuffer_shader_ = new Shader("data/shaders/gbuffer.vert", "data/shaders/gbuffer.frag");
+	gbuffer_instanced_shader_ = new Shader("data/shaders/gbuffer_instanced.vert", "data/shaders/gbuffer.frag");
+	for (Shader* s : { depth_shader_, depth_instanced_shader_, gbuffer_shader_, gbuffer_instanced_shader_ }) {
+		s->setUniformBlock(U_VIEW_UBO, VIEW_BINDING_POINT);
+		s->setUniformBlock(U_DRAW_UBO, DRAW_BINDING_POINT);
+	}
+	gbuffer_shader_->setUniformBlock(U_MATERIALS_UBO, MATERIALS_BINDING_POINT);
+	gbuffer_instanced_shader_->setUniformBlock(U_MATERIALS_UBO, MATERIALS_BINDING_POINT);
 
 	join_shader_ = new Shader("data/shaders/join_shader.vert", "data/shaders/join_shader.frag");
+	bloom_prefilter_shader_ = new Shader("data/shaders/screen.vert", "data/shaders/bloom_prefilter.frag");
+	bloom_downsample_shader_ = new Shader("data/shaders/screen.vert", "data/shaders/bloom_downsample.frag");
+	bloom_upsample_shader_ = new Shader("data/shaders/screen.vert", "data/shaders/bloom_upsample.frag");
 	deferred_shader_ = new Shader("data/shaders/bloom.vert", "data/shaders/bloom.frag");
+	light_volume_shader_ = new Shader("data/shaders/light_volume.vert", "data/shaders/bloom.frag");
+	for (Shader* s : { deferred_shader_, light_volume_shader_ }) {
+		s->setUniformBlock(U_MATERIALS_UBO, MATERIALS_BINDING_POINT);
+		s->setUniformBlock(U_SHADOW_TILES_UBO, SHADOW_TILES_BINDING_POINT);
+	}
+	stencil_volume_shader_ = new Shader("data/shaders/light_volume.vert", "data/shaders/depth.frag");
+
+	checkUniformBlocks_();
 
-	gbuffer_.initGBuffer2(window_width, window_height);
-	gbuffer2_.initGBuffer3(window_width, window_height);
+	for (int l = 0; l < BLOOM_LEVELS; l++) {
+		bloom_down_timers_[l].init();
+		bloom_up_timers_[l].init();
+	}
+	shadow_timer_.init();
 }
 
 //called after loading everything
 void GraphicsSystem::lateInit() {
-	// sort meshes initially
-    sortMeshes_();
-
-	//create shadow buffers depending on number of lights
-	for (size_t i = 0; i < ECS.getAllComponents<Light>().size(); i++) {
-		shadow_frame_[i].initDepth(2048, 2048);
-	}
-
+	//all geometry is loaded by now
+	if (multi_draw_indirect_supported_)
+		geometry_store_.build(geometries_);
 }
 
 void GraphicsSystem::update(float dt) {
-    
-	updateAllCameras_();
 
 	if (needUpdateLights)
 		updateLights_();
+	if (needUpdateMaterials)
+		updateMaterials_();
+	if (!use_light_volumes)
+		uploadLightClusters_();
+	//atlas is created once a light casts shadows, which may be after lateInit
+	if (num_shadow_maps_ > 0 && shadow_atlas_.color_textures[0] == 0) {
+		shadow_atlas_.initDepth(SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE);
+		shadow_static_.initDepth(SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE);
+	}
     
-	/* SHADOW PASS FOR ALL LIGHTS */
-	glCullFace(GL_FRONT);
-	useShader(depth_shader_);
-	const auto& lights = ECS.getAllComponents<Light>();
-	for (size_t i = 0; i < lights.size(); i++) {
-		shadow_frame_[i].bindAndClear();
-		auto& mesh_components = ECS.getAllComponents<Mesh>();
-		for (auto &curr_comp : mesh_components) {
-			renderDepth_(curr_comp, lights[i]);
-		}
+	//geometry added after lateInit: views culled this frame have no commands, so they fall back
+	if (multi_draw_indirect_supported_ && geometry_store_.ranges.size() != geometries_.size())
+		geometry_store_.build(geometries_);
+
+	draw_calls_ = 0;
+	if (use_instancing)
+		uploadInstances_();
+	uploadUniformBlocks_();
+
+	//passes of this frame, and their targets
+	buildRenderGraph_();
+	render_graph_.compile();
+	render_graph_.execute();
+	if (dump_render_graph) {
+		std::ofstream dot("render_graph.dot");
+		dot << render_graph_.toDot();
+		std::cout << "Render graph written to render_graph.dot" << std::endl;
+		dump_render_graph = false;
+	}
+    
+	/* RENDER FRAMES */   
+	GLSTATE.setEnabled(GL_DEPTH_TEST, true);
+	GLSTATE.viewport(0, 0, GLsizei(viewport_width_), GLsizei(viewport_height_));
+}
+
+//declares passes of the frame in order, and the targets each reads and writes. Targets
+//are sized to the viewport (bloom levels to a fraction of it), and G-buffer depth is shared
+//by lighting and environment passes, only copied for light volumes
+void GraphicsSystem::buildRenderGraph_() {
+	RenderGraph& graph = render_graph_;
+	graph.reset();
+	GLsizei width = std::max(viewport_width_, 1), height = std::max(viewport_height_, 1);
+
+	targets_.screen = graph.importTexture("screen", 0, width, height);
+	if (num_shadow_maps_ > 0) {
+		targets_.shadow_atlas = graph.importTexture("shadow atlas", shadow_atlas_.color_textures[0], SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE);
+		targets_.shadow_static = graph.importTexture("static shadows", shadow_static_.color_textures[0], SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE);
+
+		/* SHADOW PASS FOR REFRESHED LIGHTS */
+		int shadows = graph.addPass("shadows", [this]() { renderShadowMaps_(); });
+		graph.write(shadows, targets_.shadow_static);
+		graph.write(shadows, targets_.shadow_atlas);
 	}
-	glCullFace(GL_BACK);
 
 	/* GBUFFER PASS*/
 
-	gbuffer_.bindAndClear();
-	useShader(gbuffer_shader_);
-	for (auto mesh : ECS.getAllComponents<Mesh>()) {
-		checkMaterial_(mesh);
-		renderMeshComponent_(mesh);
-	}
-    
+	//compact layout, 14 bytes per pixel (was 32: RGB16F position, normal, bloom, ambient and
+	//RGBA8 albedo). Position is rebuilt from depth, bloom color is albedo of bloom materials, and
+	//ambient is read from the material
+	RenderTargetDesc desc;
+	desc.width = width; desc.height = height;
+	desc.internal_format = GL_RGBA8; //diffuse + specular (in A channel)
+	targets_.albedo = graph.createTarget("albedo", desc);
+	desc.internal_format = GL_RG16; //normal, octahedron encoded
+	targets_.normal = graph.createTarget("normal", desc);
+	desc.internal_format = GL_R16UI; //material index, and bloom flag in top bit
+	targets_.material = graph.createTarget("material", desc);
+	desc.internal_format = GL_DEPTH24_STENCIL8; //read by lighting, stencil marks geometry for light volumes
+	targets_.depth = graph.createTarget("depth", desc);
+	gbuffer_bytes_per_pixel_ = 0;
+	for (int t : { targets_.albedo, targets_.normal, targets_.material, targets_.depth })
+		gbuffer_bytes_per_pixel_ += RenderGraph::bytesPerPixel(graph.getDesc(t).internal_format);
+
+	int gbuffer = graph.addPass("gbuffer", [this]() { renderGeometry_(); });
+	graph.color(gbuffer, targets_.albedo, true);
+	graph.color(gbuffer, targets_.normal, true);
+	graph.color(gbuffer, targets_.material, true);
+	graph.depth(gbuffer, targets_.depth, true, true);
+
 	/* SCREEN PASS */
-	bindAndClearScreen_();
-	gbuffer2_.bindAndClear();
-	renderGbuffer(gbuffer2_.framebuffer);
-	renderEnvironment_();
 
-	bindAndClearScreen_();
-	useShader(join_shader_);
-	join_shader_->setUniform(U_NUM_LIGHTS, (int)lights.size());
-	join_shader_->setTexture(U_TEX_PHONG, gbuffer2_.color_textures[0], 0);
-	join_shader_->setTexture(U_TEX_BLOOM, gbuffer2_.color_textures[1], 1);
-	join_shader_->setTexture(U_TEX_BACKGROUND, gbuffer2_.color_textures[2], 2);
+	//light volumes test depth and count in stencil while the shader samples depth, so they
+	//get a copy of gbuffer depth and stencil. Clustered lighting only samples it
+	if (use_light_volumes) {
+		targets_.lighting_depth = graph.createTarget("lighting depth", graph.getDesc(targets_.depth));
+		int copy = graph.addPass("copy depth", [this]() { render_graph_.blit(targets_.depth, targets_.lighting_depth); });
+		graph.read(copy, targets_.depth);
+		graph.write(copy, targets_.lighting_depth);
+	}
 
-	geometries_[screen_space_geom_].render();
-	glBindFramebuffer(GL_READ_FRAMEBUFFER, gbuffer2_.framebuffer);
-	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
-	glBlitFramebuffer(
-		0, 0, viewport_width_, viewport_height_, 0, 0, viewport_width_, viewport_height_,
-		GL_DEPTH_BUFFER_BIT, GL_NEAREST
-	);
-    
-	/* RENDER FRAMES */   
-	glEnable(GL_DEPTH_TEST);
-	glViewport(0, 0, GLsizei(viewport_width_), GLsizei(viewport_height_));
+	//lighting
+	desc.internal_format = GL_RGB16F;
+	desc.filter = GL_LINEAR;
+	targets_.lit = graph.createTarget("lit", desc);
+	int lighting = graph.addPass("lighting", [this]() { renderGbuffer(); });
+	graph.color(lighting, targets_.lit, true);
+	if (use_light_volumes)
+		graph.depth(lighting, targets_.lighting_depth, true);
+	for (int t : { targets_.albedo, targets_.normal, targets_.material, targets_.depth })
+		graph.read(lighting, t);
+	if (num_shadow_maps_ > 0)
+		graph.read(lighting, targets_.shadow_atlas);
+
+	//skybox where depth test finds no geometry
+	int environment = graph.addPass("environment", [this]() { renderEnvironment_(); });
+	graph.color(environment, targets_.lit);
+	graph.depth(environment, targets_.depth, false);
+
+	//bloom chain. First level is half the viewport, or narrower if that is wider than BLOOM_MAX_WIDTH
+	GLsizei level_width = std::max(width / 2, 1), level_height = std::max(height / 2, 1);
+	if (level_width > BLOOM_MAX_WIDTH) {
+		level_height = std::max(level_height * BLOOM_MAX_WIDTH / level_width, 1);
+		level_width = BLOOM_MAX_WIDTH;
+	}
+	for (int l = 0; l < BLOOM_LEVELS; l++) {
+		desc.width = bloom_sizes_[l][0] = level_width;
+		desc.height = bloom_sizes_[l][1] = level_height;
+		targets_.bloom[l] = graph.createTarget("bloom " + std::to_string(l), desc);
+		level_width = std::max(level_width / 2, 1);
+		level_height = std::max(level_height / 2, 1);
+	}
+	//every bloom pass draws a full screen quad into a whole level, so levels are not cleared
+	for (int l = 0; l < BLOOM_LEVELS; l++) {
+		int down = graph.addPass("bloom down " + std::to_string(l), [this, l]() { renderBloomLevel_(l, false); });
+		graph.color(down, targets_.bloom[l]);
+		if (l == 0) {
+			graph.read(down, targets_.albedo);
+			graph.read(down, targets_.material);
+		}
+		else graph.read(down, targets_.bloom[l - 1]);
+	}
+	for (int l = BLOOM_LEVELS - 2; l >= 0; l--) {
+		int up = graph.addPass("bloom up " + std::to_string(l), [this, l]() { renderBloomLevel_(l, true); });
+		graph.color(up, targets_.bloom[l]);
+		graph.read(up, targets_.bloom[l + 1]);
+	}
+
+	//to screen, with depth for anything drawn after
+	int join = graph.addPass("join", [this]() { renderJoin_(); });
+	graph.read(join, targets_.lit);
+	graph.read(join, targets_.bloom[0]);
+	graph.read(join, targets_.depth);
+	graph.write(join, targets_.screen);
 }
 
-void GraphicsSystem::renderGbuffer(GLuint framebuffer) {
-	useShader(deferred_shader_);
+//tiles of lights refreshed this frame (see scheduleShadows_): static casters into the static
+//cache when they changed, then the cached tile is copied into the atlas and dynamic casters
+//drawn on top. Only meshes inside each light frustum, sorted (see cullMeshes)
+void GraphicsSystem::renderShadowMaps_() {
+	auto start = std::chrono::high_resolution_clock::now();
+	shadow_timer_.begin();
+	GLSTATE.cullFace(GL_FRONT);
+	GLSTATE.setEnabled(GL_DEPTH_TEST, true);
+	GLSTATE.depthMask(true);
+	if (useLayeredShadows_()) {
+		renderShadowsLayered_();
+	}
+	else {
+		useShader(use_instancing ? depth_instanced_shader_ : depth_shader_);
+		for (int s = 0; s < num_shadow_maps_; s++) {
+			const ShadowTile& tile = shadow_tiles_[s];
+			if (!tile.refresh) continue;
+
+			if (tile.redraw_static) {
+				clearStaticTile_(tile);
+				const CullView& static_view = staticCasterView_(s);
+				bindViewBlock_(static_view);
+				renderView_(static_view, static_view.queue.getItems());
+			}
+			copyStaticTile_(tile);
+
+			const CullView& view = tileView_(s);
+			if (view.queue.getItems().empty()) continue;
+			GLSTATE.bindFramebuffer(GL_FRAMEBUFFER, shadow_atlas_.framebuffer);
+			GLSTATE.viewport(tile.x, tile.y, tile.size, tile.size);
+			bindViewBlock_(view);
+			renderView_(view, view.queue.getItems());
+		}
+	}
+	GLSTATE.cullFace(GL_BACK);
+	shadow_timer_.end();
+	shadow_cpu_ms_ = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
 
-	deferred_shader_->setUniformBlock(U_LIGHTS_UBO, LIGHTS_BINDING_POINT);
-	deferred_shader_->setUniform(U_NUM_LIGHTS, (int)ECS.getAllComponents<Light>().size());
+//binds static cache with viewport on tile, and clears only the tile
+void GraphicsSystem::clearStaticTile_(const ShadowTile& tile) {
+	GLSTATE.bindFramebuffer(GL_FRAMEBUFFER, shadow_static_.framebuffer);
+	GLSTATE.viewport(tile.x, tile.y, tile.size, tile.size);
+	GLSTATE.setEnabled(GL_SCISSOR_TEST, true);
+	glScissor(tile.x, tile.y, tile.size, tile.size);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	GLSTATE.setEnabled(GL_SCISSOR_TEST, false);
+}
 
-	deferred_shader_->setTexture(U_TEX_POSITION, gbuffer_.color_textures[0], 0);
-	deferred_shader_->setTexture(U_TEX_NORMAL, gbuffer_.color_textures[1], 1);
-	deferred_shader_->setTexture(U_TEX_ALBEDO, gbuffer_.color_textures[2], 2);
-	deferred_shader_->setTexture(U_TEX_BLOOM, gbuffer_.color_textures[3], 3);
-	deferred_shader_->setTexture(U_TEX_AMBIENT, gbuffer_.color_textures[5], 4);
+void GraphicsSystem::copyStaticTile_(const ShadowTile& tile) {
+	GLSTATE.bindFramebuffer(GL_READ_FRAMEBUFFER, shadow_static_.framebuffer);
+	GLSTATE.bindFramebuffer(GL_DRAW_FRAMEBUFFER, shadow_atlas_.framebuffer);
+	glBlitFramebuffer(tile.x, tile.y, tile.x + tile.size, tile.y + tile.size,
+		tile.x, tile.y, tile.x + tile.size, tile.y + tile.size, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+}
 
-	deferred_shader_->setUniform(U_CAM_POS, ECS.getComponentInArray<Camera>(ECS.main_camera).position);
+//all refreshed tiles at once: static casters of every tile whose cache is redrawn in one
+//pass, then tiles are copied, then dynamic casters of every refreshed tile in one pass.
+//Submission no longer grows with the number of lights, only clears and copies of tiles do
+void GraphicsSystem::renderShadowsLayered_() {
+	useShader(depth_layered_shader_);
+	for (int s = 0; s < num_shadow_maps_; s++) {
+		if (shadow_tiles_[s].refresh && shadow_tiles_[s].redraw_static)
+			clearStaticTile_(shadow_tiles_[s]);
+	}
+	GLSTATE.bindFramebuffer(GL_FRAMEBUFFER, shadow_static_.framebuffer);
+	renderLayers_(layeredView_(true));
 
-	geometries_[screen_space_geom_].render();
+	for (int s = 0; s < num_shadow_maps_; s++) {
+		if (shadow_tiles_[s].refresh)
+			copyStaticTile_(shadow_tiles_[s]);
+	}
+	GLSTATE.bindFramebuffer(GL_FRAMEBUFFER, shadow_atlas_.framebuffer);
+	renderLayers_(layeredView_(false));
+}
 
-	glBindFramebuffer(GL_READ_FRAMEBUFFER, gbuffer_.framebuffer);
-	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer);
-	glBlitFramebuffer(
-		0, 0, viewport_width_, viewport_height_, 0, 0, viewport_width_, viewport_height_,
-		GL_DEPTH_BUFFER_BIT, GL_NEAREST
-	);
+//draws a layered view into the bound atlas: every caster instance is repeated once per layer,
+//and depth_layered.vert moves the copy of layer k into the tile of layer k, clipping it to
+//the tile, so that tiles of any size are drawn with one viewport (GL 3.3 has no viewport
+//arrays, and an atlas cannot be selected with gl_Layer)
+void GraphicsSystem::renderLayers_(const CullView& view) {
+	if (!view.active || view.queue.getItems().empty()) return;
+	GLSTATE.viewport(0, 0, SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE);
+	for (int c = 0; c < 4; c++)
+		GLSTATE.setEnabled(GL_CLIP_DISTANCE0 + c, true);
+	shader_->setUniform(U_NUM_LAYERS, view.instanceRepeat());
+	glBindBufferRange(GL_UNIFORM_BUFFER, SHADOW_LAYERS_BINDING_POINT, uniform_ring_.ubo, view.view_block_offset, sizeof(ShadowLayersBlock));
+	renderView_(view, view.queue.getItems());
+	for (int c = 0; c < 4; c++)
+		GLSTATE.setEnabled(GL_CLIP_DISTANCE0 + c, false);
 }
 
-//renders a mesh from a Light/Camera, only setting its MVP
-//i.e. only usable with a depth shader
-void GraphicsSystem::renderDepth_(Mesh& comp, const Light& light) {
-	//get transform and matrices
-	Transform& transform = ECS.getComponentFromEntity<Transform>(comp.owner);
-	lm::mat4 model_matrix = transform.getGlobalMatrix(ECS.getAllComponents<Transform>());
-	lm::mat4 mvp_matrix = light.view_projection * model_matrix;
-	//set sole uniform
-	depth_shader_->setUniform(U_MVP, mvp_matrix);
-	//render
-	geometries_[comp.geometry].render();
+//only meshes inside camera frustum, sorted by state then front to back
+//each draw reads its material from material ubo, so state is only set once
+void GraphicsSystem::renderGeometry_() {
+	if (use_light_volumes) {
+		//mark pixels with geometry, which light volume passes shade
+		GLSTATE.setEnabled(GL_STENCIL_TEST, true);
+		GLSTATE.stencilFunc(GL_ALWAYS, GEOMETRY_STENCIL_BIT, 0xFF);
+		GLSTATE.stencilOp(GL_FRONT_AND_BACK, GL_KEEP, GL_KEEP, GL_REPLACE);
+	}
+	bindViewBlock_(cull_views_[0]);
+	useShader(use_instancing ? gbuffer_instanced_shader_ : gbuffer_shader_);
+	for (int a = 0; a < num_diffuse_arrays_; a++)
+		shader_->setTextureArray((UniformID)(U_DIFFUSE_ARRAY0 + a), diffuse_arrays_[a]);
+	renderView_(cull_views_[0], cameraQueue_().getItems());
+	GLSTATE.setEnabled(GL_STENCIL_TEST, false);
+	//no later pass reads this frame's uniform blocks
+	uniform_ring_.fence();
+}
 
+void GraphicsSystem::renderJoin_() {
+	bindAndClearScreen_();
+	useShader(join_shader_);
+	join_shader_->setTexture(U_TEX_PHONG, render_graph_.getTexture(targets_.lit));
+	join_shader_->setTexture(U_TEX_BLOOM, render_graph_.getTexture(targets_.bloom[0]));
+	join_shader_->setUniform(U_BLOOM_INTENSITY, bloom_intensity);
+	geometries_[screen_space_geom_].render();
+	render_graph_.blitTo(targets_.depth, 0);
 }
 
-//renders a given mesh component
-void GraphicsSystem::renderMeshComponent_(Mesh& comp) {
+//lighting of all pixels, into lit target. Light volumes have a copy of G-buffer depth attached
+void GraphicsSystem::renderGbuffer() {
+	useDeferredShader_(deferred_shader_);
 
-	//get components and geom
-	Transform& transform = ECS.getComponentFromEntity<Transform>(comp.owner);
-	Camera& cam = ECS.getComponentInArray<Camera>(ECS.main_camera);
-	Geometry& geom = geometries_[comp.geometry];
+	if (use_light_volumes) {
+		renderLightVolumes_();
+		return;
+	}
 
-	//create mvp
-	lm::mat4 model_matrix = transform.getGlobalMatrix(ECS.getAllComponents<Transform>());
-	lm::mat4 mvp_matrix = cam.view_projection * model_matrix;
+	//depth is only sampled
+	GLSTATE.setEnabled(GL_DEPTH_TEST, false);
+	deferred_shader_->setUniform(U_LIGHT_INDEX, (int)LIGHTS_CLUSTERED);
+	deferred_shader_->setUniform(U_LIGHT_HEATMAP, show_light_heatmap ? 1 : 0);
+	geometries_[screen_space_geom_].render();
+	GLSTATE.setEnabled(GL_DEPTH_TEST, true);
+}
 
-	//view frustum culling
-	if (!BBInFrustum_(geom.aabb, mvp_matrix)) {
-		return;
+//uses a shader with bloom.frag, and sets its gbuffer textures, lights and clusters
+void GraphicsSystem::useDeferredShader_(Shader* s) {
+	useShader(s);
+
+	s->setTexture(U_TEX_ALBEDO, render_graph_.getTexture(targets_.albedo));
+	s->setTexture(U_TEX_NORMAL, render_graph_.getTexture(targets_.normal));
+	s->setTexture(U_TEX_MATERIAL, render_graph_.getTexture(targets_.material));
+	s->setTexture(U_TEX_DEPTH, render_graph_.getTexture(targets_.depth));
+	if (num_shadow_maps_ > 0)
+		s->setTexture(U_SHADOW_ATLAS, shadow_atlas_.color_textures[0]);
+
+	//lights and clusters. Slice of a view depth d is log(d / near) * DIM_Z / log(far / near)
+	const Camera& cam = ECS.getComponentInArray<Camera>(ECS.main_camera);
+	s->setTextureBuffer(U_LIGHTS, light_buffer_.texture);
+	s->setTextureBuffer(U_CLUSTER_GRID, cluster_grid_buffer_.texture);
+	s->setTextureBuffer(U_CLUSTER_LIGHTS, cluster_lights_buffer_.texture);
+	s->setUniform(U_VIEW, cam.view_matrix);
+	s->setUniform(U_CLUSTER_DIMS, lm::vec3((float)LightClusters::DIM_X, (float)LightClusters::DIM_Y, (float)LightClusters::DIM_Z));
+	s->setUniform(U_CLUSTER_DEPTH, lm::vec3(light_clusters_.getNear(),
+		LightClusters::DIM_Z / logf(light_clusters_.getFar() / light_clusters_.getNear()), 0.0f));
+	s->setUniform(U_LIGHT_HEATMAP, 0);
+
+	s->setUniform(U_CAM_POS, cam.position);
+	lm::mat4 inv_vp = cam.view_projection;
+	inv_vp.inverse();
+	s->setUniform(U_INV_VP, inv_vp);
+}
+
+//model matrix of light's volume: a sphere of its range, or for a narrow spot, a cone of its
+//outer angle with apex at the light. False if light reaches everywhere (directional, no range)
+bool GraphicsSystem::lightVolume_(const Light& light, lm::mat4& model, int& geometry) const {
+	float range = light.getRange();
+	if (light.type == 0 || range < 0.0f) return false;
+
+	lm::vec3 position = ECS.getComponentFromEntity<Transform>(light.owner).getGlobalMatrix().position();
+	float half_angle = light.spot_outer * 0.5f * DEG2RAD;
+	model = lm::mat4();
+	if (light.type == 2 && half_angle < 60.0f * DEG2RAD && light.direction.length() > 0.0f) {
+		//cone axis is light direction, base radius covers the outer angle at full range
+		lm::vec3 z = light.direction;
+		z.normalize();
+		lm::vec3 up = fabsf(z.y) < 0.99f ? lm::vec3(0.0f, 1.0f, 0.0f) : lm::vec3(1.0f, 0.0f, 0.0f);
+		lm::vec3 x = up.cross(z);
+		x.normalize();
+		lm::vec3 y = z.cross(x);
+		float radius = range * tanf(half_angle);
+		x *= radius; y *= radius; z *= range;
+		model.m[0] = x.x; model.m[1] = x.y; model.m[2] = x.z;
+		model.m[4] = y.x; model.m[5] = y.y; model.m[6] = y.z;
+		model.m[8] = z.x; model.m[9] = z.y; model.m[10] = z.z;
+		geometry = light_cone_geom_;
+	}
+	else {
+		model.m[0] = model.m[5] = model.m[10] = range;
+		geometry = light_sphere_geom_;
 	}
+	model.m[12] = position.x; model.m[13] = position.y; model.m[14] = position.z;
+	return true;
+}
+
+//lighting with one pass per light, added to a full screen pass of ambient. Volumes are tested
+//against G-buffer depth, and lights against its geometry stencil bit.
+//For each volume, a stencil pass counts its faces which are behind the surface: back faces
+//add one, front faces subtract one, so pixels whose surface is inside the volume end with a
+//count above zero. Then its back faces are drawn with lighting on those pixels only, which
+//also resets the count. Depth is clamped, so volumes crossing the far plane are not clipped
+void GraphicsSystem::renderLightVolumes_() {
+	light_volume_stats_ = LightVolumeStats();
+
+	//ambient, on pixels with geometry
+	GLSTATE.setEnabled(GL_DEPTH_TEST, false);
+	GLSTATE.depthMask(false);
+	GLSTATE.setEnabled(GL_STENCIL_TEST, true);
+	GLSTATE.stencilFunc(GL_EQUAL, GEOMETRY_STENCIL_BIT, GEOMETRY_STENCIL_BIT);
+	GLSTATE.stencilOp(GL_FRONT_AND_BACK, GL_KEEP, GL_KEEP, GL_KEEP);
+	deferred_shader_->setUniform(U_LIGHT_INDEX, (int)LIGHTS_NONE);
+	geometries_[screen_space_geom_].render();
 
-	//normal matrix
-	lm::mat4 normal_matrix = model_matrix;
-	normal_matrix.inverse();
-	normal_matrix.transpose();
+	useDeferredShader_(light_volume_shader_);
+	const Camera& cam = ECS.getComponentInArray<Camera>(ECS.main_camera);
 
-	//transform uniforms
-	shader_->setUniform(U_MVP, mvp_matrix);
-	shader_->setUniform(U_MODEL, model_matrix);
-	shader_->setUniform(U_NORMAL_MATRIX, normal_matrix);
-	shader_->setUniform(U_CAM_POS, cam.position);
+	GLSTATE.setEnabled(GL_BLEND, true);
+	GLSTATE.blendFunc(GL_ONE, GL_ONE);
+	GLSTATE.setEnabled(GL_DEPTH_CLAMP, true);
+	GLSTATE.stencilMask(GEOMETRY_STENCIL_BIT - 1); //only the count is written
+	const auto& lights = ECS.getAllComponents<Light>();
+	for (size_t i = 0; i < lights.size(); i++) {
+		lm::mat4 model;
+		int geometry;
+		if (!lightVolume_(lights[i], model, geometry)) {
+			//full screen, on pixels with geometry
+			useShader(deferred_shader_);
+			deferred_shader_->setUniform(U_LIGHT_INDEX, (int)i);
+			GLSTATE.setEnabled(GL_DEPTH_TEST, false);
+			GLSTATE.setEnabled(GL_CULL_FACE, true);
+			GLSTATE.cullFace(GL_BACK);
+			GLSTATE.colorMask(true);
+			GLSTATE.stencilFunc(GL_EQUAL, GEOMETRY_STENCIL_BIT, GEOMETRY_STENCIL_BIT);
+			GLSTATE.stencilOp(GL_FRONT_AND_BACK, GL_KEEP, GL_KEEP, GL_KEEP);
+			geometries_[screen_space_geom_].render();
+			light_volume_stats_.full_screen++;
+			continue;
+		}
+		if (!cull_views_[0].frustum.testSphere(lm::vec3(model.m[12], model.m[13], model.m[14]), lights[i].getRange())) {
+			light_volume_stats_.culled++;
+			continue;
+		}
+		lm::mat4 mvp = cam.view_projection * model;
+
+		//stencil: count faces behind surface, on pixels with geometry
+		useShader(stencil_volume_shader_);
+		stencil_volume_shader_->setUniform(U_MVP, mvp);
+		GLSTATE.setEnabled(GL_DEPTH_TEST, true);
+		GLSTATE.setEnabled(GL_CULL_FACE, false);
+		GLSTATE.colorMask(false);
+		GLSTATE.stencilFunc(GL_EQUAL, GEOMETRY_STENCIL_BIT, GEOMETRY_STENCIL_BIT);
+		GLSTATE.stencilOp(GL_BACK, GL_KEEP, GL_INCR_WRAP, GL_KEEP);
+		GLSTATE.stencilOp(GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP);
+		geometries_[geometry].render();
+
+		//lighting: back faces, so volume is drawn when camera is inside it. Passes where
+		//stencil is above the geometry bit alone, and replacing with it clears the count
+		useShader(light_volume_shader_);
+		light_volume_shader_->setUniform(U_MVP, mvp);
+		light_volume_shader_->setUniform(U_LIGHT_INDEX, (int)i);
+		GLSTATE.setEnabled(GL_DEPTH_TEST, false);
+		GLSTATE.setEnabled(GL_CULL_FACE, true);
+		GLSTATE.cullFace(GL_FRONT);
+		GLSTATE.colorMask(true);
+		GLSTATE.stencilFunc(GL_LESS, GEOMETRY_STENCIL_BIT, 0xFF);
+		GLSTATE.stencilOp(GL_FRONT_AND_BACK, GL_KEEP, GL_KEEP, GL_REPLACE);
+		geometries_[geometry].render();
+		light_volume_stats_.volumes++;
+	}
 
-	//draw
-	geom.render();
+	GLSTATE.stencilMask(0xFF);
+	GLSTATE.setEnabled(GL_DEPTH_CLAMP, false);
+	GLSTATE.setEnabled(GL_STENCIL_TEST, false);
+	GLSTATE.setEnabled(GL_BLEND, false);
+	GLSTATE.setEnabled(GL_CULL_FACE, true);
+	GLSTATE.cullFace(GL_BACK);
+	GLSTATE.colorMask(true);
+	GLSTATE.setEnabled(GL_DEPTH_TEST, true);
+	GLSTATE.depthMask(true);
+}
 
+//pass of one bloom level. Going down, a blurred downsample of the level before (for first
+//level, bright pass of G-buffer albedo). Going up, blended with a blurred upsample of the level
+//after, by radius
+void GraphicsSystem::renderBloomLevel_(int level, bool up) {
+	GpuTimer& timer = (up ? bloom_up_timers_ : bloom_down_timers_)[level];
+	timer.begin();
+	if (!up && level == 0) {
+		useShader(bloom_prefilter_shader_);
+		shader_->setTexture(U_TEX_ALBEDO, render_graph_.getTexture(targets_.albedo));
+		shader_->setTexture(U_TEX_MATERIAL, render_graph_.getTexture(targets_.material));
+	}
+	else {
+		int source = targets_.bloom[up ? level + 1 : level - 1];
+		const RenderTargetDesc& source_desc = render_graph_.getDesc(source);
+		useShader(up ? bloom_upsample_shader_ : bloom_downsample_shader_);
+		shader_->setTexture(U_TEX_BLOOM, render_graph_.getTexture(source));
+		shader_->setUniform(U_TEXEL_SIZE, lm::vec2(1.0f / source_desc.width, 1.0f / source_desc.height));
+		if (up) shader_->setUniform(U_BLOOM_RADIUS, bloom_radius);
+	}
+	if (up) {
+		GLSTATE.setEnabled(GL_BLEND, true);
+		GLSTATE.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	}
+	geometries_[screen_space_geom_].render();
+	GLSTATE.setEnabled(GL_BLEND, false);
+	timer.end();
 }
 
 //render the skybox as a cubemap
@@ -220,21 +608,20 @@ void GraphicsSystem::renderEnvironment_() {
     shader_->setUniform(U_VP, vp_matrix);
     
     //bind texture
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, environment_tex_);
+    GLSTATE.bindTexture(0, GL_TEXTURE_CUBE_MAP, environment_tex_);
 
 	//no need to set sampler id, as it will default to 0
     
     // disable depth test, cull front faces (to draw inside of mesh)
-    glDepthMask(false);
-    glCullFace(GL_FRONT);
+    GLSTATE.depthMask(false);
+    GLSTATE.cullFace(GL_FRONT);
     
 
 	geometries_[cube_map_geom_].render();
     
     // reset depth test and culling
-    glDepthMask(true);
-    glCullFace(GL_BACK);
+    GLSTATE.depthMask(true);
+    GLSTATE.cullFace(GL_BACK);
     
 }
 
@@ -253,14 +640,6 @@ void GraphicsSystem::checkShaderAndMaterial_(Mesh& mesh) {
     }
 }
 
-void GraphicsSystem::checkMaterial_(Mesh& mesh) {
-    //set material uniforms if required
-    if (current_material_ != mesh.material) {
-        current_material_ = mesh.material;
-        setMaterialUniforms();
-    }
-}
-
 //sets uniforms for current material and current shader
 void GraphicsSystem::setMaterialUniforms() {
     Material& mat = materials_[current_material_];
@@ -280,47 +659,41 @@ void GraphicsSystem::setMaterialUniforms() {
     //texture uniforms
     if (mat.diffuse_map != -1){
         shader_->setUniform(U_USE_DIFFUSE_MAP, 1);
-        shader_->setTexture(U_DIFFUSE_MAP, mat.diffuse_map, 8);
+        shader_->setTexture(U_DIFFUSE_MAP, mat.diffuse_map);
+    }
+    else {
+        shader_->setUniform(U_USE_DIFFUSE_MAP, 0);
     }
 
     //reflection
-    if (mat.cube_map) {
+    if (mat.cube_map != -1) {
         shader_->setUniform(U_USE_REFLECTION_MAP, 1);
-        shader_->setTextureCube(U_SKYBOX, mat.cube_map, 9);
+        shader_->setTextureCube(U_SKYBOX, mat.cube_map);
         
     }
 
-	auto lights = ECS.getAllComponents<Light>();
-	for (size_t i = 0; i < lights.size(); i++) {
-
-		glActiveTexture(GL_TEXTURE0 + (GLenum)i);
-		glBindTexture(GL_TEXTURE_2D, shadow_frame_[i].color_textures[0]);
-
-		std::string shadow_map_name = "u_shadow_map[" + std::to_string(i) + "]";
-		GLint u_shadow_map_pos = glGetUniformLocation(shader_->program, shadow_map_name.c_str());
-		if (u_shadow_map_pos != -1)
-			glUniform1i(u_shadow_map_pos, (GLint)i);
-	}
+	if (num_shadow_maps_ > 0)
+		shader_->setTexture(U_SHADOW_ATLAS, shadow_atlas_.color_textures[0]);
     
 	//light uniforms
     shader_->setUniformBlock(U_LIGHTS_UBO, LIGHTS_BINDING_POINT);
-	shader_->setUniform(U_NUM_LIGHTS, (int)lights.size());
+	shader_->setUniformBlock(U_SHADOW_TILES_UBO, SHADOW_TILES_BINDING_POINT);
+	shader_->setUniform(U_NUM_LIGHTS, std::min((int)ECS.getAllComponents<Light>().size(), MAX_FORWARD_LIGHTS));
 }
 
-//updates light ubo
+//updates light ubo (first MAX_FORWARD_LIGHTS, for forward shaders) and light buffer (all lights)
 void GraphicsSystem::updateLights_() {
-	const std::vector<Light>& lights = ECS.getAllComponents<Light>();
-
-	// 3 * vec4, 4 * float, 1 x matrix, 1 * int, which is blocked out to 16 bytes
-	GLsizeiptr size_lights_ubo = (16 + 16 + 16 + 16 + 16 + 64) * lights.size();
+	//deferred shader reads a light from light_buffer_ as 10 vec4 texels, see bloom.frag
+	static_assert(sizeof(LightBlock) == 10 * 4 * sizeof(GLfloat), "LightBlock must be 10 vec4");
 
-	glBindBuffer(GL_UNIFORM_BUFFER, light_ubo_);
-	glBufferData(GL_UNIFORM_BUFFER, size_lights_ubo, NULL, GL_STATIC_DRAW);
+	const std::vector<Light>& lights = ECS.getAllComponents<Light>();
 
-	GLsizeiptr offset = 0; //pointer to top of buffer
+	//pack all lights into staging buffer in parallel, then upload it in one call
+	lights_staging_.resize(lights.size());
+	LightBlock* staging = lights_staging_.data();
 
-	for (auto& l : lights) {
-		Transform& lt = ECS.getComponentFromEntity<Transform>(l.owner);
+	ECS.parallel_each<Light>(JOBS, signatureOf<Transform>(), 0, 16, [this, staging](int i, Light& l) {
+		const lm::mat4& lt = ECS.getComponentFromEntity<Transform>(l.owner).getGlobalMatrix();
 
 		float spot_inner_cosine = cos((l.spot_inner*DEG2RAD) / 2.0f);
 		float spot_outer_cosine = cos((l.spot_outer*DEG2RAD) / 2.0f);
@@ -331,78 +704,411 @@ void GraphicsSystem::updateLights_() {
 			l.color.x, l.color.y, l.color.z, 0.0,
 			l.linear_att,l.quadratic_att,spot_inner_cosine,spot_outer_cosine
 		};
+		LightBlock& block = staging[i];
 		//vec4s and floats data
-		glBufferSubData(GL_UNIFORM_BUFFER, offset, 64, light_data);
-		offset += 64;
-        //light matrix
-        glBufferSubData(GL_UNIFORM_BUFFER, offset, 64, l.view_projection.m);
-        offset += 64;
-		//type
-		glBufferSubData(GL_UNIFORM_BUFFER, offset, 4, &(l.type));
-		offset += 4;
-        //type
-        glBufferSubData(GL_UNIFORM_BUFFER, offset, 4, &(l.cast_shadow));
-        offset += 12;
+		memcpy(&block, light_data, sizeof(light_data));
+		block.type = l.type;
+		block.cast_shadow = l.cast_shadow;
+
+		//shadows are looked up with the matrix the tile was drawn with, which is older than
+		//the light's own when the tile was not refreshed this frame. Block has the first tile,
+		//further cascades (only used while fitted) are read from u_shadow_tiles_ubo
+		int s = shadowMap_(i);
+		if (s != -1 && shadow_tiles_[s].valid) {
+			const ShadowTile& tile = shadow_tiles_[s];
+			memcpy(block.view_projection, tile.view_projection.m, sizeof(block.view_projection));
+			block.shadow_map = s;
+			block.shadow_cascades = 1;
+			while (tile.fitted && s + block.shadow_cascades < num_shadow_maps_ &&
+				shadow_tiles_[s + block.shadow_cascades].light == i && shadow_tiles_[s + block.shadow_cascades].valid)
+				block.shadow_cascades++;
+			shadowTileRect_(tile, block.shadow_tile);
+		}
+		else {
+			memcpy(block.view_projection, l.view_projection.m, sizeof(block.view_projection));
+			block.shadow_map = -1;
+			block.shadow_cascades = 0;
+			memset(block.shadow_tile, 0, sizeof(block.shadow_tile));
+		}
+	});
+
+	ShadowTilesBlock tiles_block;
+	memset(&tiles_block, 0, sizeof(tiles_block));
+	for (int s = 0; s < num_shadow_maps_; s++) {
+		memcpy(tiles_block.view_projection[s], shadow_tiles_[s].view_projection.m, sizeof(tiles_block.view_projection[s]));
+		shadowTileRect_(shadow_tiles_[s], tiles_block.tile[s]);
 	}
+	glBindBuffer(GL_UNIFORM_BUFFER, shadow_tiles_ubo_);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(tiles_block), &tiles_block, GL_STATIC_DRAW);
+	glBindBufferBase(GL_UNIFORM_BUFFER, SHADOW_TILES_BINDING_POINT, shadow_tiles_ubo_);
+
+	//block always holds MAX_FORWARD_LIGHTS, so the bound range covers the whole std140 block
+	const GLsizeiptr size_lights_ubo = MAX_FORWARD_LIGHTS * sizeof(LightBlock);
+	glBindBuffer(GL_UNIFORM_BUFFER, light_ubo_);
+	glBufferData(GL_UNIFORM_BUFFER, size_lights_ubo, nullptr, GL_STATIC_DRAW);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, std::min(lights_staging_.size(), (size_t)MAX_FORWARD_LIGHTS) * sizeof(LightBlock), lights_staging_.data());
+	light_buffer_.upload(lights_staging_.data(), lights_staging_.size() * sizeof(LightBlock));
 
 	glBindBufferRange(GL_UNIFORM_BUFFER, LIGHTS_BINDING_POINT, light_ubo_, 0, size_lights_ubo);
 
 	needUpdateLights = false;
 }
 
-//This function executes two sorts:
-// i) sorts materials array by shader_id
-// ii) sorts Mesh components by material id
-//the result is that the mesh component array is
-//ordered by both shader and material
-void GraphicsSystem::sortMeshes_() {
+void GraphicsSystem::shadowTileRect_(const ShadowTile& tile, GLfloat* rect) const {
+	rect[0] = (GLfloat)tile.x / SHADOW_ATLAS_SIZE;
+	rect[1] = (GLfloat)tile.y / SHADOW_ATLAS_SIZE;
+	rect[2] = (GLfloat)tile.size / SHADOW_ATLAS_SIZE;
+	rect[3] = (GLfloat)tile.size;
+}
 
-	//sort materials by shader id
-	//first we store the old index of each material in materials_ array
-	for (size_t i = 0; i < materials_.size(); i++)
-		materials_[i].index = (int)i; // 'index' is a new property of Material
+//packs all materials into material ubo, and copies their diffuse maps into texture arrays:
+//maps are grouped by size, each group is an array and each map a layer of it. Arrays are
+//always RGBA8, whatever format the maps were loaded with
+//runs rarely (loading, editing), so it binds textures with plain GL calls
+void GraphicsSystem::updateMaterials_() {
+	if (materials_.size() > MAX_MATERIALS)
+		std::cerr << "ERROR: More than " << MAX_MATERIALS << " materials, the rest will not render correctly" << std::endl;
+	const size_t num_materials = std::min(materials_.size(), (size_t)MAX_MATERIALS);
+
+	//find array and layer of each diffuse map
+	struct DiffuseArray {
+		GLint width, height;
+		std::vector<GLuint> maps; //one per layer
+	};
+	std::vector<DiffuseArray> arrays;
+	std::vector<MaterialBlock> blocks(MAX_MATERIALS);
+	memset(blocks.data(), 0, blocks.size() * sizeof(MaterialBlock));
+	for (size_t i = 0; i < num_materials; i++) {
+		const Material& mat = materials_[i];
+		MaterialBlock& block = blocks[i];
+		memcpy(block.ambient, &mat.ambient, 3 * sizeof(GLfloat));
+		memcpy(block.diffuse, &mat.diffuse, 3 * sizeof(GLfloat));
+		memcpy(block.specular, &mat.specular, 3 * sizeof(GLfloat));
+		block.specular_gloss = mat.specular_gloss;
+		block.bloom = mat.bloom ? 1 : 0;
+		block.diffuse_array = -1;
+		block.diffuse_layer = 0;
+		if (mat.diffuse_map == -1) continue;
+
+		GLint width, height;
+		glBindTexture(GL_TEXTURE_2D, mat.diffuse_map);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+		int a = 0;
+		while (a < (int)arrays.size() && (arrays[a].width != width || arrays[a].height != height)) a++;
+		if (a == (int)arrays.size()) {
+			if (a == MAX_DIFFUSE_ARRAYS) {
+				std::cerr << "ERROR: More than " << MAX_DIFFUSE_ARRAYS << " diffuse map sizes, material " << mat.name << " has no diffuse map" << std::endl;
+				continue;
+			}
+			arrays.push_back({ width, height, {} });
+		}
+		//materials may share a map
+		std::vector<GLuint>& maps = arrays[a].maps;
+		size_t layer = std::find(maps.begin(), maps.end(), (GLuint)mat.diffuse_map) - maps.begin();
+		if (layer == maps.size()) maps.push_back(mat.diffuse_map);
+		block.diffuse_array = a;
+		block.diffuse_layer = (GLint)layer;
+	}
 
-	//second, we sort materials by shader_id
-	std::sort(materials_.begin(), materials_.end(), [](const Material& a, const Material& b) {
-		return a.shader_id < b.shader_id;
-	});
+	//copy maps into arrays (once, when materials change)
+	glActiveTexture(GL_TEXTURE0);
+	if (num_diffuse_arrays_) glDeleteTextures(num_diffuse_arrays_, diffuse_arrays_);
+	num_diffuse_arrays_ = (int)arrays.size();
+	std::vector<GLubyte> pixels;
+	for (int a = 0; a < num_diffuse_arrays_; a++) {
+		const DiffuseArray& array = arrays[a];
+		glGenTextures(1, &diffuse_arrays_[a]);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, diffuse_arrays_[a]);
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, array.width, array.height, (GLsizei)array.maps.size(), 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		pixels.resize(array.width * array.height * 4);
+		for (size_t layer = 0; layer < array.maps.size(); layer++) {
+			glBindTexture(GL_TEXTURE_2D, array.maps[layer]);
+			glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, (GLint)layer, array.width, array.height, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+		}
+		//same sampling as maps loaded by Parsers::parseTexture
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameterf(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4);
+		glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+	}
+
+	//block always holds MAX_MATERIALS, so the bound range covers the whole std140 block
+	const GLsizeiptr size_materials_ubo = MAX_MATERIALS * sizeof(MaterialBlock);
+	glBindBuffer(GL_UNIFORM_BUFFER, material_ubo_);
+	glBufferData(GL_UNIFORM_BUFFER, size_materials_ubo, blocks.data(), GL_STATIC_DRAW);
+	glBindBufferRange(GL_UNIFORM_BUFFER, MATERIALS_BINDING_POINT, material_ubo_, 0, size_materials_ubo);
+
+	//textures were bound directly, behind GLState's back
+	GLSTATE.invalidate();
+	needUpdateMaterials = false;
+}
 
-	//now we map old indices to new indices
-	std::map<int, int> old_new;
-	for (size_t i = 0; i < materials_.size(); i++) {
-		old_new[materials_[i].index] = (int)i;
+//C++ structs (and instance data, for draw blocks) must match the std140 layout of every
+//shader using the block. Mismatches are printed at load, see Shader::checkUniformBlock
+void GraphicsSystem::checkUniformBlocks_() {
+	for (Shader* s : { depth_shader_, depth_instanced_shader_, gbuffer_shader_, gbuffer_instanced_shader_ }) {
+		s->checkUniformBlock(U_VIEW_UBO, (GLint)sizeof(ViewBlock), {
+			{ "u_vp", (GLint)offsetof(ViewBlock, vp) },
+			{ "u_cam_pos", (GLint)offsetof(ViewBlock, cam_pos) } });
 	}
+	depth_shader_->checkUniformBlock(U_DRAW_UBO, 16 * sizeof(GLfloat), { { "u_model", 0 } });
+	depth_layered_shader_->checkUniformBlock(U_SHADOW_LAYERS_UBO, (GLint)sizeof(ShadowLayersBlock), {
+		{ "u_layer_vp", (GLint)offsetof(ShadowLayersBlock, view_projection) },
+		{ "u_layer_tile", (GLint)offsetof(ShadowLayersBlock, tile) } });
+	for (Shader* s : { deferred_shader_, light_volume_shader_ }) {
+		s->checkUniformBlock(U_SHADOW_TILES_UBO, (GLint)sizeof(ShadowTilesBlock), {
+			{ "u_tile_vp", (GLint)offsetof(ShadowTilesBlock, view_projection) },
+			{ "u_tile_rect", (GLint)offsetof(ShadowTilesBlock, tile) } });
+	}
+	gbuffer_shader_->checkUniformBlock(U_DRAW_UBO, 36 * sizeof(GLfloat), {
+		{ "u_model", 0 },
+		{ "u_normal_matrix", 16 * sizeof(GLfloat) },
+		{ "u_material", 32 * sizeof(GLfloat) } });
+	for (Shader* s : { gbuffer_shader_, gbuffer_instanced_shader_, deferred_shader_, light_volume_shader_ }) {
+		s->checkUniformBlock(U_MATERIALS_UBO, (GLint)(MAX_MATERIALS * sizeof(MaterialBlock)), {
+			{ "materials[0].diffuse", (GLint)offsetof(MaterialBlock, diffuse) },
+			{ "materials[0].specular_gloss", (GLint)offsetof(MaterialBlock, specular_gloss) },
+			{ "materials[0].bloom", (GLint)offsetof(MaterialBlock, bloom) },
+			{ "materials[0].diffuse_layer", (GLint)offsetof(MaterialBlock, diffuse_layer) },
+			{ "materials[1].ambient", (GLint)sizeof(MaterialBlock) } });
+	}
+}
 
-	//now we swap index of materials in all meshes
+//fills render queue of a view with its visible meshes, and sorts it. Then splits queue into
+//batches of same geometry and material, and writes the per instance data of each item
+//(in gbuffer: model and normal matrices, then material index as an int in a vec4 slot)
+//shadow pass only uses depth shader, so its keys and batches ignore shader and material
+void GraphicsSystem::buildQueue_(CullView& view, RenderPassType pass) {
 	auto& meshes = ECS.getAllComponents<Mesh>();
-	for (auto& mesh : meshes) {
-		int old_index = mesh.material;
-		int new_index = old_new[old_index];
-		mesh.material = new_index;
+	//view space z of a point is dot of 3rd row of view matrix with it, and is negative in front of view
+	const lm::mat4& vm = view.view_matrix;
+	view.queue.clear();
+	for (int m : view.visible) {
+		const Mesh& mesh = meshes[m];
+		float depth = -(vm.M[0][2] * mesh_bounds_.center_x[m] + vm.M[1][2] * mesh_bounds_.center_y[m] +
+						vm.M[2][2] * mesh_bounds_.center_z[m] + vm.M[3][2]);
+		uint64_t key = pass == RenderPassShadow ?
+			RenderQueue::makeKey(pass, 0, 0, mesh.geometry, depth) :
+			RenderQueue::makeKey(pass, materials_[mesh.material].shader_id, mesh.material, mesh.geometry, depth);
+		view.queue.add(key, m);
+	}
+	view.queue.sort();
+
+	const auto& items = view.queue.getItems();
+	const bool with_normals = pass != RenderPassShadow;
+	view.floats_per_instance = with_normals ? 36 : 16;
+	view.instances.resize(items.size() * view.floats_per_instance);
+	view.batches.clear();
+	view.commands.clear();
+	for (size_t i = 0; i < items.size(); i++) {
+		const Mesh& mesh = meshes[items[i].mesh];
+		const int material = with_normals ? mesh.material : -1;
+		if (view.batches.empty() || view.batches.back().geometry != mesh.geometry || view.batches.back().material != material)
+			view.batches.push_back({ mesh.geometry, material, (int)i, 0 });
+		view.batches.back().count++;
+
+		const Transform& transform = ECS.getComponentFromEntity<Transform>(mesh.owner);
+		GLfloat* dst = view.instances.data() + i * view.floats_per_instance;
+		memcpy(dst, transform.getGlobalMatrix().m, 16 * sizeof(GLfloat));
+		if (with_normals) {
+			memcpy(dst + 16, transform.getNormalMatrix().m, 16 * sizeof(GLfloat));
+			GLint material_slot[4] = { mesh.material, 0, 0, 0 };
+			memcpy(dst + 32, material_slot, sizeof(material_slot));
+		}
 	}
 
-	//store old mesh indices
-	for (size_t i = 0; i < meshes.size(); i++)
-		meshes[i].index = (int)i;
+	//one command per batch, drawing its instances from geometry store. Store is only
+	//rebuilt on main thread, between frames
+	if (!useMultiDrawIndirect_()) return;
+	const auto& ranges = geometry_store_.ranges;
+	for (const DrawBatch& batch : view.batches) {
+		if (batch.geometry >= (int)ranges.size()) {
+			view.commands.clear();
+			return;
+		}
+		const GeometryStore::Range& range = ranges[batch.geometry];
+		view.commands.push_back({ geometries_[batch.geometry].num_tris * 3, (GLuint)(batch.count * view.instanceRepeat()),
+			range.first_index, range.base_vertex, (GLuint)batch.first_instance });
+	}
+}
 
-	//short meshes by material id
-	std::sort(meshes.begin(), meshes.end(), [](const Mesh& a, const Mesh& b) {
-		return a.material < b.material;
-	});
+//uploads instance data of all active views into one buffer, orphaning last frame's data
+void GraphicsSystem::uploadInstances_() {
+	GLsizeiptr total_size = 0;
+	for (auto& view : cull_views_) {
+		view.instance_offset = total_size;
+		if (view.active) total_size += view.instances.size() * sizeof(GLfloat);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, instance_vbo_);
+	glBufferData(GL_ARRAY_BUFFER, total_size, nullptr, GL_STREAM_DRAW);
+	for (auto& view : cull_views_) {
+		if (view.active && !view.instances.empty())
+			glBufferSubData(GL_ARRAY_BUFFER, view.instance_offset, view.instances.size() * sizeof(GLfloat), view.instances.data());
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	//draw commands, in the same way
+	if (!useMultiDrawIndirect_()) return;
+	total_size = 0;
+	for (auto& view : cull_views_) {
+		view.command_offset = total_size;
+		if (view.active) total_size += view.commands.size() * sizeof(DrawCommand);
+	}
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer_);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, total_size, nullptr, GL_STREAM_DRAW);
+	for (auto& view : cull_views_) {
+		if (view.active && !view.commands.empty())
+			glBufferSubData(GL_DRAW_INDIRECT_BUFFER, view.command_offset, view.commands.size() * sizeof(DrawCommand), view.commands.data());
+	}
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+//points per instance attributes of bound vao at view's instance data in instance_vbo_, starting
+//at byte offset first. Matrices (and material) are vertex attributes with divisor 1, or the
+//number of layers of a layered shadow view
+void GraphicsSystem::bindInstanceAttributes_(const CullView& view, GLintptr first) {
+	const GLsizei stride = view.floats_per_instance * sizeof(GLfloat);
+	const int num_columns = std::min(view.floats_per_instance / 4, 8);
+
+	glBindBuffer(GL_ARRAY_BUFFER, instance_vbo_);
+	for (int c = 0; c < 8; c++) {
+		GLuint location = INSTANCE_ATTRIB_LOCATION + c;
+		//disable columns this pass does not use, so they never read past end of buffer
+		if (c >= num_columns) {
+			glDisableVertexAttribArray(location);
+			continue;
+		}
+		glEnableVertexAttribArray(location);
+		glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, stride, (void*)(first + c * 4 * sizeof(GLfloat)));
+		glVertexAttribDivisor(location, view.instanceRepeat());
+	}
+	if (view.floats_per_instance > 32) {
+		glEnableVertexAttribArray(MATERIAL_ATTRIB_LOCATION);
+		glVertexAttribIPointer(MATERIAL_ATTRIB_LOCATION, 1, GL_INT, stride, (void*)(first + 32 * sizeof(GLfloat)));
+		glVertexAttribDivisor(MATERIAL_ATTRIB_LOCATION, 1);
+	}
+	else {
+		glDisableVertexAttribArray(MATERIAL_ATTRIB_LOCATION);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+//draws all instances of a batch, pointing instance attributes at the batch's data
+//(GL 3.3 has no base instance)
+void GraphicsSystem::renderBatch_(const CullView& view, const DrawBatch& batch) {
+	Geometry& geom = geometries_[batch.geometry];
+	const GLsizei stride = view.floats_per_instance * sizeof(GLfloat);
+	GLSTATE.bindVertexArray(geom.vao);
+	bindInstanceAttributes_(view, view.instance_offset + (GLintptr)batch.first_instance * stride);
+	glDrawElementsInstanced(GL_TRIANGLES, geom.num_tris * 3, GL_UNSIGNED_INT, 0, batch.count * view.instanceRepeat());
+	draw_calls_++;
+}
+
+//draws all batches of a view in one call. Instance attributes point at the start of the
+//view's data, and each command's base instance selects its batch
+void GraphicsSystem::renderViewIndirect_(const CullView& view) {
+	GLSTATE.bindVertexArray(geometry_store_.vao);
+	bindInstanceAttributes_(view, view.instance_offset);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer_);
+	glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)view.command_offset, (GLsizei)view.commands.size(), 0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	draw_calls_++;
+}
+
+//draws a view's queue with the fastest path available: one multi draw indirect, one
+//instanced draw per batch, or one draw per item
+void GraphicsSystem::renderView_(const CullView& view, const std::vector<DrawItem>& items) {
+	if (useMultiDrawIndirect_() && view.commands.size() == view.batches.size()) {
+		if (!view.commands.empty())
+			renderViewIndirect_(view);
+	}
+	else if (use_instancing) {
+		for (const DrawBatch& batch : view.batches)
+			renderBatch_(view, batch);
+	}
+	else {
+		auto& meshes = ECS.getAllComponents<Mesh>();
+		for (size_t k = 0; k < items.size(); k++)
+			renderQueueItem_(view, k, meshes[items[k].mesh].geometry);
+	}
+}
 
-	//clear map and refill with mesh index map
-	old_new.clear();
-	for (size_t i = 0; i < meshes.size(); i++) {
-		old_new[meshes[i].index] = (int)i;
+//writes this frame's uniform blocks into the ring, in one mapping: first one view block per active view
+//(a layers block for layered shadow views),
+//then (when not instancing) one draw block per queue item of each active view, copied from the
+//instance data buildQueue_ packed for it. Offsets are kept in the view for binding when drawing
+void GraphicsSystem::uploadUniformBlocks_() {
+	const GLsizeiptr view_block_size = sizeof(ViewBlock);
+	GLsizeiptr total_size = 0;
+	for (auto& view : cull_views_) {
+		if (!view.active) continue;
+		total_size += uniform_ring_.align(view.layer_tiles.empty() ? view_block_size : sizeof(ShadowLayersBlock));
+		view.draw_block_stride = uniform_ring_.align(view.floats_per_instance * sizeof(GLfloat));
+		if (!use_instancing)
+			total_size += view.draw_block_stride * view.queue.getItems().size();
 	}
 
-	//update all entities with new mesh id
-	auto& all_entities = ECS.entities;
-	for (auto& ent : ECS.entities) {
-		int old_index = ent.components[type2int<Mesh>::result];
-		int new_index = old_new[old_index];
-		ent.components[type2int<Mesh>::result] = new_index;
+	uniform_ring_.begin(total_size);
+	for (size_t v = 0; v < cull_views_.size(); v++) {
+		if (!cull_views_[v].active) continue;
+		if (!cull_views_[v].layer_tiles.empty()) {
+			ShadowLayersBlock layers_block;
+			memset(&layers_block, 0, sizeof(layers_block));
+			const std::vector<int>& layer_tiles = cull_views_[v].layer_tiles;
+			for (size_t k = 0; k < layer_tiles.size(); k++) {
+				const ShadowTile& tile = shadow_tiles_[layer_tiles[k]];
+				memcpy(layers_block.view_projection[k], tile.view_projection.m, sizeof(layers_block.view_projection[k]));
+				layers_block.tile[k][0] = 2.0f * tile.x / SHADOW_ATLAS_SIZE - 1.0f;
+				layers_block.tile[k][1] = 2.0f * tile.y / SHADOW_ATLAS_SIZE - 1.0f;
+				layers_block.tile[k][2] = 2.0f * tile.size / SHADOW_ATLAS_SIZE;
+			}
+			cull_views_[v].view_block_offset = uniform_ring_.push(&layers_block, sizeof(layers_block));
+			continue;
+		}
+		//tile views and static caster views of the same tile share its matrices
+		ViewBlock view_block;
+		lm::vec3 position;
+		if (v == 0) {
+			const Camera& cam = ECS.getComponentInArray<Camera>(ECS.main_camera);
+			memcpy(view_block.vp, cam.view_projection.m, sizeof(view_block.vp));
+			position = cam.position;
+		}
+		else {
+			const ShadowTile& tile = shadow_tiles_[(v - 1) % num_tile_views_];
+			memcpy(view_block.vp, tile.current_view_projection.m, sizeof(view_block.vp));
+			lm::mat4 inv_view = tile.current_view;
+			inv_view.inverseAffine();
+			position = inv_view.position();
+		}
+		view_block.cam_pos[0] = position.x; view_block.cam_pos[1] = position.y; view_block.cam_pos[2] = position.z; view_block.cam_pos[3] = 1.0f;
+		cull_views_[v].view_block_offset = uniform_ring_.push(&view_block, view_block_size);
 	}
+	if (!use_instancing) {
+		for (auto& view : cull_views_) {
+			if (!view.active) continue;
+			const GLsizeiptr block_size = view.floats_per_instance * sizeof(GLfloat);
+			const size_t num_items = view.queue.getItems().size();
+			for (size_t k = 0; k < num_items; k++) {
+				GLintptr offset = uniform_ring_.push(view.instances.data() + k * view.floats_per_instance, block_size);
+				if (k == 0) view.first_draw_block_offset = offset;
+			}
+		}
+	}
+	uniform_ring_.end();
+}
+
+void GraphicsSystem::bindViewBlock_(const CullView& view) {
+	glBindBufferRange(GL_UNIFORM_BUFFER, VIEW_BINDING_POINT, uniform_ring_.ubo, view.view_block_offset, sizeof(ViewBlock));
+}
+
+//draws one item of a view's queue, pointing u_draw_ubo at its block (see uploadUniformBlocks_)
+void GraphicsSystem::renderQueueItem_(const CullView& view, size_t item, int geometry) {
+	glBindBufferRange(GL_UNIFORM_BUFFER, DRAW_BINDING_POINT, uniform_ring_.ubo,
+		view.first_draw_block_offset + (GLintptr)item * view.draw_block_stride, view.floats_per_instance * sizeof(GLfloat));
+	geometries_[geometry].render();
+	draw_calls_++;
 }
 
 //reset shader and material
@@ -413,43 +1119,580 @@ void GraphicsSystem::resetShaderAndMaterial_() {
 }
 
 //update cameras
-void GraphicsSystem::updateAllCameras_() {
+void GraphicsSystem::updateCameras() {
+
+	ECS.parallel_each<Camera>(JOBS, 0, signatureOf<Camera>(), 16, [](int i, Camera& cam) {
+		cam.update();
+	});
+}
+
+//Frustum culling for every view, before any rendering:
+// 1) world space bounds of all meshes are rebuilt in parallel into SoA arrays
+//    Meshes which stayed still for SHADOW_STATIC_FRAMES become static shadow casters
+// 2) views of main camera and shadow tiles are set up. Tiles of lights which cast no shadow,
+//    or whose range is outside the camera frustum, are skipped entirely. Tiles are sized to
+//    the lights' screen coverage, see sizeShadowTiles_
+// 3) bounds are tested in chunks, one job per view and chunk, with SIMD (see cullBounds).
+//    Camera goes first, as directional lights' tiles are fitted to what it sees (see
+//    fitShadowTiles_), then frustum planes of tiles are extracted and tiles are culled
+// 4) visible indices of each chunk are compacted into one list per view. Tile views
+//    also drop meshes which do not cast shadows, and move static casters to their static
+//    caster view. Then tiles to refresh this frame are picked, see scheduleShadows_
+// 5) render queue of each active view is built from its list and sorted, one job per view
+// 6) lights are assigned to clusters of main camera, see buildLightClusters_
+void GraphicsSystem::cullMeshes() {
+	auto& meshes = ECS.getAllComponents<Mesh>();
+	const int num_meshes = (int)meshes.size();
+
+	//1) bounds
+	mesh_bounds_.resize(num_meshes);
+	mesh_casts_shadow_.resize(num_meshes);
+	mesh_world_.resize(num_meshes);
+	mesh_still_frames_.resize(num_meshes, 0);
+	mesh_static_.resize(num_meshes, 0);
+	ECS.parallel_each<Mesh>(JOBS, signatureOf<Transform>(), 0, 256, [this](int i, Mesh& mesh) {
+		mesh_casts_shadow_[i] = mesh.cast_shadows;
+		const lm::mat4& world = ECS.getComponentFromEntity<Transform>(mesh.owner).getGlobalMatrix();
+		//world matrix is compared rather than Transform::world_changed, which only covers
+		//the last of the frame's transform updates
+		bool moved = memcmp(mesh_world_[i].m, world.m, sizeof(world.m)) != 0;
+		if (moved) mesh_world_[i] = world;
+		mesh_still_frames_[i] = moved ? 0 : std::min(mesh_still_frames_[i] + 1, SHADOW_STATIC_FRAMES);
+		mesh_static_[i] = mesh.cast_shadows && mesh_still_frames_[i] == SHADOW_STATIC_FRAMES;
+		const AABB& local = geometries_[mesh.geometry].aabb;
+		//sphere around local box, scaled by largest axis scale of transform
+		float scale_sq = std::max(std::max(world.right().dot(world.right()), world.top().dot(world.top())), world.front().dot(world.front()));
+		mesh_bounds_.set(i, transformAABB_(local, world), local.half_width.length() * sqrtf(scale_sq));
+	});
+
+	//2) views
+	assignShadowTiles_();
+	const auto& lights = ECS.getAllComponents<Light>();
+	cull_views_.resize(1 + 2 * num_shadow_maps_ + 2);
+	num_tile_views_ = num_shadow_maps_;
+	const Camera& main_camera = ECS.getComponentInArray<Camera>(ECS.main_camera);
+	cull_views_[0].frustum.extract(main_camera.view_projection);
+	cull_views_[0].view_matrix = main_camera.view_matrix;
+	for (int s = 0; s < num_shadow_maps_; s++) {
+		ShadowTile& tile = shadow_tiles_[s];
+		const Light& light = lights[tile.light];
+		float range = light.getRange();
+		lm::vec3 light_position = ECS.getComponentFromEntity<Transform>(light.owner).getGlobalMatrix().position();
+		//further cascades are only used while fitted
+		tileView_(s).active = light.cast_shadow && (tile.cascade == 0 || fit_directional_shadows) &&
+			(range < 0.0f || cull_views_[0].frustum.testSphere(light_position, range));
+		//light's own matrices, unless fitted below
+		tile.fitted = false;
+		tile.current_view = light.view_matrix;
+		tile.current_view_projection = light.view_projection;
+		//filled from tile view's results
+		staticCasterView_(s).active = false;
+	}
+	layeredView_(true).active = layeredView_(false).active = false;
+	sizeShadowTiles_();
+
+	//3) cull, each chunk writing at its own offset (chunk size is a multiple of SIMD width)
+	const int chunk_size = 1024;
+	JobCounter counter;
+	cullView_(cull_views_[0], chunk_size, counter);
+	JOBS.wait(counter);
+	compactView_(cull_views_[0], chunk_size, nullptr);
+	fitShadowTiles_();
+	for (int s = 0; s < num_shadow_maps_; s++) {
+		CullView& view = tileView_(s);
+		view.frustum.extract(shadow_tiles_[s].current_view_projection);
+		view.view_matrix = staticCasterView_(s).view_matrix = shadow_tiles_[s].current_view;
+	}
+	for (size_t v = 1; v < cull_views_.size(); v++)
+		cullView_(cull_views_[v], chunk_size, counter);
+	JOBS.wait(counter);
+
+	//4) compact, in ascending mesh order
+	for (int s = 0; s < num_shadow_maps_; s++)
+		compactView_(tileView_(s), chunk_size, &staticCasterView_(s).visible);
+	scheduleShadows_();
+
+	//5) sort
+	for (size_t v = 0; v < cull_views_.size(); v++) {
+		CullView* view = &cull_views_[v];
+		if (!view->active) continue;
+		RenderPassType pass = v == 0 ? RenderPassGBuffer : RenderPassShadow;
+		JOBS.run([this, view, pass]() { buildQueue_(*view, pass); }, &counter);
+	}
+	JOBS.wait(counter);
+
+	//6) light clusters, not used when lighting with volumes
+	if (!use_light_volumes)
+		buildLightClusters_();
+
+	//stats, for debug GUI
+	const float pixel_size = 2.0f / (main_camera.projection_matrix.M[1][1] * viewport_height_); //world size of a pixel at view depth 1
+	shadow_stats_.resize(num_shadow_maps_);
+	for (int s = 0; s < num_shadow_maps_; s++) {
+		ShadowStats& stats = shadow_stats_[s];
+		const ShadowTile& tile = shadow_tiles_[s];
+		stats = ShadowStats();
+		stats.light = tile.light;
+		stats.cascade = tile.cascade;
+		stats.skipped = !tile.in_range;
+		if (stats.skipped) continue;
+		stats.tile_x = tile.x; stats.tile_y = tile.y; stats.tile_size = tile.size;
+		stats.coverage = tile.coverage;
+		//an orthographic view projection has no w row, and its x row has length 2 / width
+		const lm::mat4& vp = tile.current_view_projection;
+		if (vp.M[0][3] == 0.0f && vp.M[1][3] == 0.0f && vp.M[2][3] == 0.0f)
+			stats.texels_per_unit = 0.5f * tile.size * lm::vec3(vp.M[0][0], vp.M[1][0], vp.M[2][0]).length();
+		if (tile.fitted) {
+			stats.split_near = tile.split_near;
+			stats.split_far = tile.split_far;
+			stats.texels_per_pixel = stats.texels_per_unit * pixel_size * tile.split_far;
+		}
+		stats.refreshed = tile.refresh;
+		stats.static_redrawn = tile.refresh && tile.redraw_static;
+		stats.frames_since_refresh = shadow_frame_count_ - tile.last_refresh;
+		stats.static_casters = (int)staticCasterView_(s).visible.size();
+		stats.dynamic_casters = (int)tileView_(s).visible.size();
+		stats.casters_skipped = num_meshes - stats.static_casters - stats.dynamic_casters;
+	}
+}
+
+//starts one culling job per chunk of meshes, unless view is inactive
+void GraphicsSystem::cullView_(CullView& view, int chunk_size, JobCounter& counter) {
+	const int num_meshes = mesh_bounds_.count;
+	const int num_chunks = (num_meshes + chunk_size - 1) / chunk_size;
+	view.visible.resize(num_meshes);
+	view.chunk_counts.assign(num_chunks, 0);
+	if (!view.active) return;
+	for (int c = 0; c < num_chunks; c++) {
+		CullView* v = &view;
+		JOBS.run([this, v, c, chunk_size, num_meshes]() {
+			int first = c * chunk_size;
+			int last = std::min(first + chunk_size, num_meshes);
+			v->chunk_counts[c] = cullBounds(mesh_bounds_, v->frustum, first, last, v->visible.data() + first);
+		}, &counter);
+	}
+}
+
+//moves visible indices of all chunks to the front of the list. For a tile view, static casters
+//go to static_visible, and meshes which do not cast shadows are dropped
+void GraphicsSystem::compactView_(CullView& view, int chunk_size, std::vector<int>* static_visible) {
+	if (static_visible) static_visible->clear();
+	int num_visible = 0;
+	for (size_t c = 0; c < view.chunk_counts.size(); c++) {
+		const int* chunk = view.visible.data() + c * chunk_size;
+		for (int k = 0; k < view.chunk_counts[c]; k++) {
+			int m = chunk[k];
+			if (!static_visible)
+				view.visible[num_visible++] = m;
+			else if (mesh_static_[m])
+				static_visible->push_back(m);
+			else if (mesh_casts_shadow_[m])
+				view.visible[num_visible++] = m;
+		}
+	}
+	view.visible.resize(num_visible);
+}
+
+//a shadow tile for each light which casts shadows, or one per cascade of a directional
+//light, up to MAX_SHADOW_MAPS. Tiles are matched to last frame's by entity of their light
+//and cascade, so when lights are created or destroyed (which moves others in the Light
+//array), tiles of lights still there keep their place and content. New tiles start empty,
+//and are sized and packed into the atlas by sizeShadowTiles_
+void GraphicsSystem::assignShadowTiles_() {
+	const auto& lights = ECS.getAllComponents<Light>();
+	bool changed = lights.size() != light_shadow_map_.size();
+	light_shadow_map_.assign(lights.size(), -1);
+	ShadowTile tiles[MAX_SHADOW_MAPS];
+	int num_tiles = 0, needed = 0;
+	for (size_t i = 0; i < lights.size(); i++) {
+		if (!lights[i].cast_shadow) continue;
+		int cascades = lights[i].type == 0 ? std::max(1, std::min(lights[i].shadow_cascades, MAX_SHADOW_CASCADES)) : 1;
+		needed += cascades;
+		if (num_tiles + cascades > MAX_SHADOW_MAPS) continue;
+		EntityHandle owner = ECS.getEntityHandle(lights[i].owner);
+		light_shadow_map_[i] = num_tiles;
+		for (int c = 0; c < cascades; c++, num_tiles++) {
+			ShadowTile& tile = tiles[num_tiles];
+			int found = -1;
+			for (int s = 0; s < num_shadow_maps_ && found == -1; s++) {
+				const ShadowTile& old_tile = shadow_tiles_[s];
+				if (old_tile.owner.id == owner.id && old_tile.owner.generation == owner.generation && old_tile.cascade == c)
+					found = s;
+			}
+			if (found != -1) tile = std::move(shadow_tiles_[found]);
+			changed |= found != num_tiles || tile.light != (int)i;
+			tile.owner = owner;
+			tile.light = (int)i;
+			tile.cascade = c;
+		}
+	}
+	changed |= num_tiles != num_shadow_maps_;
+	if (!changed) {
+		//same tiles in same places, put them back
+		for (int s = 0; s < num_tiles; s++)
+			shadow_tiles_[s] = std::move(tiles[s]);
+		return;
+	}
+
+	if (needed > MAX_SHADOW_MAPS)
+		std::cerr << "ERROR: lights casting shadows need " << needed << " shadow tiles, only " << MAX_SHADOW_MAPS << " fit, lights past them have no shadows" << std::endl;
+	for (int s = 0; s < MAX_SHADOW_MAPS; s++)
+		shadow_tiles_[s] = s < num_tiles ? std::move(tiles[s]) : ShadowTile();
+	num_shadow_maps_ = num_tiles;
+	//space of removed tiles is given to the others
+	packShadowAtlas_();
+	needUpdateLights = true;
+}
+
+//target size of each in range tile: its light's resolution times the fraction of screen
+//height the light's range sphere covers, as a power of two of at least SHADOW_MIN_TILE. Tiles
+//grow at once but only shrink when a quarter of their size would do, so they do not flip
+//between two sizes as the camera moves. Atlas is repacked when any target size changes
+void GraphicsSystem::sizeShadowTiles_() {
+	const auto& lights = ECS.getAllComponents<Light>();
+	const Camera& cam = ECS.getComponentInArray<Camera>(ECS.main_camera);
+	bool resized = false;
+	for (int s = 0; s < num_shadow_maps_; s++) {
+		ShadowTile& tile = shadow_tiles_[s];
+		tile.in_range = tileView_(s).active;
+		if (!tile.in_range) continue;
+
+		//projected radius of sphere in half screen heights is range / distance * M[1][1]
+		const Light& light = lights[tile.light];
+		float range = light.getRange();
+		tile.coverage = 1.0f;
+		if (range >= 0.0f) {
+			lm::vec3 position = ECS.getComponentFromEntity<Transform>(light.owner).getGlobalMatrix().position();
+			float distance = (position - cam.position).length();
+			if (distance > range)
+				tile.coverage = std::min(range / distance * cam.projection_matrix.M[1][1], 1.0f);
+		}
+
+		int size = SHADOW_MIN_TILE;
+		while (size < SHADOW_ATLAS_SIZE && size < light.resolution * tile.coverage)
+			size *= 2;
+		if (size > tile.target_size || size * 4 <= tile.target_size) {
+			tile.target_size = size > tile.target_size ? size : size * 2;
+			resized = true;
+		}
+	}
+	if (resized)
+		packShadowAtlas_();
+}
+
+//places tiles in Morton order of SHADOW_MIN_TILE cells, largest first. As sizes are powers of
+//two, each tile then starts at a multiple of its size and no two overlap. While tiles do not
+//fit, the largest is halved. Tiles which move or change size lose their content
+void GraphicsSystem::packShadowAtlas_() {
+	int sizes[MAX_SHADOW_MAPS];
+	int order[MAX_SHADOW_MAPS];
+	int count = 0, area = 0;
+	for (int s = 0; s < num_shadow_maps_; s++) {
+		sizes[s] = shadow_tiles_[s].target_size;
+		if (sizes[s] == 0) continue;
+		order[count++] = s;
+		area += sizes[s] * sizes[s];
+	}
+	while (area > SHADOW_ATLAS_SIZE * SHADOW_ATLAS_SIZE) {
+		int largest = order[0];
+		for (int k = 1; k < count; k++)
+			if (sizes[order[k]] > sizes[largest]) largest = order[k];
+		area -= sizes[largest] * sizes[largest] / 4 * 3;
+		sizes[largest] /= 2;
+	}
+	std::stable_sort(order, order + count, [&sizes](int a, int b) { return sizes[a] > sizes[b]; });
+
+	int cell = 0;
+	for (int k = 0; k < count; k++) {
+		//even bits of Morton index are x, odd bits y
+		int x = 0, y = 0;
+		for (int b = 0; b < 16; b++) {
+			x |= ((cell >> (2 * b)) & 1) << b;
+			y |= ((cell >> (2 * b + 1)) & 1) << b;
+		}
+		const int size = sizes[order[k]];
+		cell += (size / SHADOW_MIN_TILE) * (size / SHADOW_MIN_TILE);
+
+		ShadowTile& tile = shadow_tiles_[order[k]];
+		x *= SHADOW_MIN_TILE;
+		y *= SHADOW_MIN_TILE;
+		if (tile.x != x || tile.y != y || tile.size != size) {
+			tile.x = x; tile.y = y; tile.size = size;
+			tile.valid = false;
+			needUpdateLights = true;
+		}
+	}
+}
+
+//directional lights' tiles, fitted to what the camera sees (see fit_directional_shadows).
+//The view depth range of the meshes visible to the camera is split into the light's cascades.
+//In a light space oriented by the light's direction only, each cascade's tile bounds the
+//corners of its slice of the camera frustum, cut to the visible meshes in the slice, and
+//reaches back to the casters nearest the light. Bounds grow to a square whose size changes in
+//steps of an eighth of an octave, placed on whole texels, and depth range changes in similar
+//steps, so that as the camera moves, texels stay put and shadow edges do not shimmer.
+//A cascade with no visible mesh in its slice is skipped, like a light out of range
+void GraphicsSystem::fitShadowTiles_() {
+	if (!fit_directional_shadows) return;
+	const auto& lights = ECS.getAllComponents<Light>();
+	const Camera& cam = ECS.getComponentInArray<Camera>(ECS.main_camera);
+	const WorldBounds& b = mesh_bounds_;
+	const std::vector<int>& visible = cull_views_[0].visible;
+
+	//center and half extent of mesh bounds along a row of an affine matrix
+	auto project = [&b](const lm::mat4& mat, int row, int m, float& half) {
+		half = fabsf(mat.M[0][row]) * b.half_x[m] + fabsf(mat.M[1][row]) * b.half_y[m] + fabsf(mat.M[2][row]) * b.half_z[m];
+		return mat.M[0][row] * b.center_x[m] + mat.M[1][row] * b.center_y[m] + mat.M[2][row] * b.center_z[m] + mat.M[3][row];
+	};
+
+	//view depth range of visible meshes, within near and far planes (see LightClusters::buildBounds_)
+	const lm::mat4& p = cam.projection_matrix;
+	const float near_plane = p.M[3][2] / (p.M[2][2] - 1.0f), far_plane = p.M[3][2] / (p.M[2][2] + 1.0f);
+	float min_depth = far_plane, max_depth = near_plane;
+	std::vector<float> depths(visible.size()), depth_halves(visible.size());
+	for (size_t k = 0; k < visible.size(); k++) {
+		depths[k] = -project(cam.view_matrix, 2, visible[k], depth_halves[k]);
+		min_depth = std::min(min_depth, depths[k] - depth_halves[k]);
+		max_depth = std::max(max_depth, depths[k] + depth_halves[k]);
+	}
+	min_depth = std::max(min_depth, near_plane);
+	max_depth = std::min(max_depth, far_plane);
+	lm::mat4 inv_view = cam.view_matrix;
+	inv_view.inverseAffine();
+
+	//world bounds of all casters
+	lm::vec3 casters_min(FLT_MAX, FLT_MAX, FLT_MAX), casters_max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	for (int m = 0; m < b.count; m++) {
+		if (!mesh_casts_shadow_[m]) continue;
+		casters_min = lm::vec3(std::min(casters_min.x, b.center_x[m] - b.half_x[m]), std::min(casters_min.y, b.center_y[m] - b.half_y[m]), std::min(casters_min.z, b.center_z[m] - b.half_z[m]));
+		casters_max = lm::vec3(std::max(casters_max.x, b.center_x[m] + b.half_x[m]), std::max(casters_max.y, b.center_y[m] + b.half_y[m]), std::max(casters_max.z, b.center_z[m] + b.half_z[m]));
+	}
+
+	for (int first = 0, cascades = 1; first < num_shadow_maps_; first += cascades) {
+		const int light_index = shadow_tiles_[first].light;
+		const Light& light = lights[light_index];
+		cascades = 1;
+		while (first + cascades < num_shadow_maps_ && shadow_tiles_[first + cascades].light == light_index)
+			cascades++;
+		if (light.type != 0 || !shadow_tiles_[first].in_range || light.direction.length() == 0.0f) continue;
+
+		//light space: looking along light direction from the origin, up picked away from it
+		lm::vec3 direction = light.direction;
+		direction.normalize();
+		lm::mat4 light_view;
+		light_view.lookAt(lm::vec3(0.0f, 0.0f, 0.0f), direction, fabsf(direction.y) > 0.99f ? lm::vec3(0.0f, 0.0f, 1.0f) : lm::vec3(0.0f, 1.0f, 0.0f));
+
+		//nearest to light is largest z
+		float casters_top = -FLT_MAX;
+		if (casters_min.x <= casters_max.x) {
+			for (int k = 0; k < 8; k++) {
+				lm::vec3 corner(k & 1 ? casters_max.x : casters_min.x, k & 2 ? casters_max.y : casters_min.y, k & 4 ? casters_max.z : casters_min.z);
+				casters_top = std::max(casters_top, (light_view * corner).z);
+			}
+		}
+
+		//splits between uniform and logarithmic
+		float splits[MAX_SHADOW_CASCADES + 1];
+		for (int c = 0; c <= cascades; c++) {
+			float t = (float)c / cascades;
+			splits[c] = cascade_split_lambda * min_depth * powf(max_depth / min_depth, t) +
+				(1.0f - cascade_split_lambda) * (min_depth + (max_depth - min_depth) * t);
+		}
+
+		//light space bounds of visible meshes in each slice
+		lm::vec3 receivers_min[MAX_SHADOW_CASCADES], receivers_max[MAX_SHADOW_CASCADES];
+		for (int c = 0; c < cascades; c++) {
+			receivers_min[c] = lm::vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+			receivers_max[c] = lm::vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		}
+		for (size_t k = 0; k < visible.size() && min_depth < max_depth; k++) {
+			lm::vec3 center, half;
+			center.x = project(light_view, 0, visible[k], half.x);
+			center.y = project(light_view, 1, visible[k], half.y);
+			center.z = project(light_view, 2, visible[k], half.z);
+			for (int c = 0; c < cascades; c++) {
+				if (depths[k] + depth_halves[k] < splits[c] || depths[k] - depth_halves[k] > splits[c + 1]) continue;
+				lm::vec3 lo = center - half, hi = center + half;
+				receivers_min[c] = lm::vec3(std::min(receivers_min[c].x, lo.x), std::min(receivers_min[c].y, lo.y), std::min(receivers_min[c].z, lo.z));
+				receivers_max[c] = lm::vec3(std::max(receivers_max[c].x, hi.x), std::max(receivers_max[c].y, hi.y), std::max(receivers_max[c].z, hi.z));
+			}
+		}
+
+		for (int c = 0; c < cascades; c++) {
+			ShadowTile& tile = shadow_tiles_[first + c];
+
+			//corners of slice of camera frustum: a point at view depth d with ndc x has view
+			//x = d * (ndc + M[2][0]) / M[0][0]
+			lm::vec3 slice_min(FLT_MAX, FLT_MAX, FLT_MAX), slice_max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+			for (int k = 0; k < 8; k++) {
+				float d = splits[c + (k >> 2)];
+				lm::vec3 corner(d * ((k & 1 ? 1.0f : -1.0f) + p.M[2][0]) / p.M[0][0], d * ((k & 2 ? 1.0f : -1.0f) + p.M[2][1]) / p.M[1][1], -d);
+				lm::vec3 light_corner = light_view * (inv_view * corner);
+				slice_min = lm::vec3(std::min(slice_min.x, light_corner.x), std::min(slice_min.y, light_corner.y), std::min(slice_min.z, light_corner.z));
+				slice_max = lm::vec3(std::max(slice_max.x, light_corner.x), std::max(slice_max.y, light_corner.y), std::max(slice_max.z, light_corner.z));
+			}
+			float min_x = std::max(slice_min.x, receivers_min[c].x), max_x = std::min(slice_max.x, receivers_max[c].x);
+			float min_y = std::max(slice_min.y, receivers_min[c].y), max_y = std::min(slice_max.y, receivers_max[c].y);
+			if (!(min_x < max_x && min_y < max_y) || tile.size == 0) {
+				tile.in_range = false;
+				tileView_(first + c).active = false;
+				continue;
+			}
+
+			//square, grown by two texels so that snapping its corner keeps bounds inside
+			float size = std::max(max_x - min_x, max_y - min_y) * (1.0f + 2.0f / tile.size);
+			float step = exp2f(floorf(log2f(size))) / 8.0f;
+			size = ceilf(size / step) * step;
+			float texel = size / tile.size;
+			float left = floorf(0.5f * (min_x + max_x - size) / texel) * texel;
+			float bottom = floorf(0.5f * (min_y + max_y - size) / texel) * texel;
+
+			//from nearest caster back to farthest receiver in slice
+			float top = std::max(casters_top, receivers_max[c].z);
+			float far_z = std::max(slice_min.z, receivers_min[c].z);
+			float depth_step = exp2f(floorf(log2f(std::max(top - far_z, 0.001f)))) / 8.0f;
+			top = ceilf(top / depth_step) * depth_step;
+			far_z = floorf(far_z / depth_step) * depth_step;
+
+			//view is moved to the near plane, so depths of sort keys are positive
+			tile.current_view = light_view;
+			tile.current_view.M[3][2] -= top;
+			lm::mat4 projection;
+			projection.orthographic(left, left + size, bottom, bottom + size, 0.0f, top - far_z);
+			tile.current_view_projection = projection * tile.current_view;
+			tile.fitted = true;
+			tile.split_near = splits[c];
+			tile.split_far = splits[c + 1];
+		}
+	}
+}
+
+//picks the tiles redrawn this frame, and deactivates the views of the rest. A tile in range
+//needs a refresh if it has no content, its static casters must be redrawn (light's matrix
+//changed, or the static casters in its frustum changed), or it has dynamic casters now or
+//had some at its last refresh. Tiles with no content are always refreshed, then tiles of
+//lights covering shadow_near_coverage of the screen, largest first, then the others, least
+//recently refreshed first, as long as their texels fit shadow_budget_texels (a static redraw
+//counts twice)
+void GraphicsSystem::scheduleShadows_() {
+	shadow_frame_count_++;
+	shadow_frame_stats_ = ShadowFrameStats();
+
+	std::vector<int> candidates;
+	for (int s = 0; s < num_shadow_maps_; s++) {
+		ShadowTile& tile = shadow_tiles_[s];
+		tile.refresh = false;
+		if (!tile.in_range) continue;
+		bool light_moved = memcmp(tile.view_projection.m, tile.current_view_projection.m, sizeof(tile.view_projection.m)) != 0;
+		tile.redraw_static = !tile.valid || light_moved || staticCasterView_(s).visible != tile.static_casters;
+		if (tile.redraw_static || !tileView_(s).visible.empty() || tile.dynamic_casters > 0)
+			candidates.push_back(s);
+	}
+	std::sort(candidates.begin(), candidates.end(), [this](int a, int b) {
+		const ShadowTile& ta = shadow_tiles_[a];
+		const ShadowTile& tb = shadow_tiles_[b];
+		if (ta.valid != tb.valid) return !ta.valid;
+		bool near_a = ta.coverage >= shadow_near_coverage, near_b = tb.coverage >= shadow_near_coverage;
+		if (near_a != near_b) return near_a;
+		if (near_a) return ta.coverage > tb.coverage;
+		return ta.last_refresh < tb.last_refresh;
+	});
+
+	for (int s : candidates) {
+		ShadowTile& tile = shadow_tiles_[s];
+		int texels = tile.size * tile.size * (tile.redraw_static ? 2 : 1);
+		if (tile.valid && shadow_frame_stats_.texels + texels > shadow_budget_texels) continue;
+
+		//lighting reads the matrix and rect of the tile from the light buffer
+		if (!tile.valid || memcmp(tile.view_projection.m, tile.current_view_projection.m, sizeof(tile.view_projection.m)) != 0)
+			needUpdateLights = true;
+		tile.refresh = true;
+		tile.valid = true;
+		tile.view_projection = tile.current_view_projection;
+		tile.last_refresh = shadow_frame_count_;
+		tile.dynamic_casters = (int)tileView_(s).visible.size();
+		if (tile.redraw_static) {
+			tile.static_casters = staticCasterView_(s).visible;
+			shadow_frame_stats_.static_redrawn++;
+		}
+		shadow_frame_stats_.refreshed++;
+		shadow_frame_stats_.texels += texels;
+	}
+
+	//per tile views, or layered views of the casters of all tiles together, each tile being
+	//a layer of the pass if it has casters in it
+	const bool layered = useLayeredShadows_();
+	CullView& layered_static = layeredView_(true);
+	CullView& layered_dynamic = layeredView_(false);
+	for (CullView* view : { &layered_static, &layered_dynamic }) {
+		view->layer_tiles.clear();
+		view->visible.clear();
+	}
+	std::vector<int> merged;
+	for (int s = 0; s < num_shadow_maps_; s++) {
+		bool refresh = shadow_tiles_[s].refresh;
+		bool redraw_static = refresh && shadow_tiles_[s].redraw_static;
+		tileView_(s).active = refresh && !layered;
+		staticCasterView_(s).active = redraw_static && !layered;
+		if (!layered) continue;
+		for (CullView* view : { &layered_static, &layered_dynamic }) {
+			const std::vector<int>& casters = view == &layered_static ? staticCasterView_(s).visible : tileView_(s).visible;
+			if (!refresh || (view == &layered_static && !redraw_static) || casters.empty()) continue;
+			view->layer_tiles.push_back(s);
+			merged.clear();
+			std::set_union(view->visible.begin(), view->visible.end(), casters.begin(), casters.end(), std::back_inserter(merged));
+			view->visible.swap(merged);
+		}
+	}
+	for (CullView* view : { &layered_static, &layered_dynamic }) {
+		view->active = !view->layer_tiles.empty();
+		if (view->active)
+			view->view_matrix = shadow_tiles_[view->layer_tiles[0]].current_view;
+	}
+}
 
-	auto& cameras = ECS.getAllComponents<Camera>();
-	for (auto &cam : cameras) cam.update();
+//bounding sphere of each light in main camera's view space, then one job per cluster slice
+void GraphicsSystem::buildLightClusters_() {
+	const auto& lights = ECS.getAllComponents<Light>();
+	const Camera& cam = ECS.getComponentInArray<Camera>(ECS.main_camera);
+	cluster_lights_.resize(lights.size());
+	for (size_t i = 0; i < lights.size(); i++) {
+		lm::vec3 position = ECS.getComponentFromEntity<Transform>(lights[i].owner).getGlobalMatrix().position();
+		cluster_lights_[i].view_center = cam.view_matrix * position;
+		cluster_lights_[i].range = lights[i].getRange();
+	}
+	light_clusters_.build(cam.projection_matrix, cluster_lights_, JOBS);
+}
+
+void GraphicsSystem::uploadLightClusters_() {
+	const std::vector<GLuint>& grid = light_clusters_.getGrid();
+	const std::vector<GLuint>& indices = light_clusters_.getLightIndices();
+	cluster_grid_buffer_.upload(grid.data(), grid.size() * sizeof(GLuint));
+	cluster_lights_buffer_.upload(indices.data(), indices.size() * sizeof(GLuint));
 }
 
 void GraphicsSystem::bindAndClearScreen_() {
-	glViewport(0, 0, viewport_width_, viewport_height_);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	GLSTATE.viewport(0, 0, viewport_width_, viewport_height_);
+	GLSTATE.bindFramebuffer(GL_FRAMEBUFFER, 0);
 	glClearColor(screen_background_color.x, screen_background_color.y, screen_background_color.z, screen_background_color.w);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 }
 
-//change shader only if need to - note shader object must be in shaders_ map
+//change shader (GLState skips the call if it is already in use)
 //s - pointer to a shader object
 void GraphicsSystem::useShader(Shader* s) {
-	if (!s) {
-		glUseProgram(0);
-		shader_ = nullptr;
-	}
-	else if (!shader_ || shader_ != s) {
-		glUseProgram(s->program);
-		shader_ = s;
-	}
+	GLSTATE.useProgram(s ? s->program : 0);
+	shader_ = s;
 }
 
-//change shader only if need to - note shader object must be in shaders_ map
+//change shader - note shader object must be in shaders_ map
 //p - GL id of shader
 void GraphicsSystem::useShader(GLuint p) {
-	if (!p) {
-		glUseProgram(0);
+	GLSTATE.useProgram(p);
+	if (!p)
 		shader_ = nullptr;
-	}
-	else if (!shader_ || shader_->program != p) {
-		glUseProgram(p);
+	else if (!shader_ || shader_->program != p)
 		shader_ = shaders_[p];
-	}
 }
 
 //sets internal variables
@@ -490,6 +1733,7 @@ Shader* GraphicsSystem::loadShader(std::string vs, std::string fs, bool compile_
 //create a new material and return pointer to it
 int GraphicsSystem::createMaterial() {
     materials_.emplace_back();
+    needUpdateMaterials = true;
     return (int)materials_.size() - 1;
 }
 
@@ -559,208 +1803,21 @@ void GraphicsSystem::setGeometryAABB_(Geometry& geom, std::vector<GLfloat>& vert
 		max.z - geom.aabb.center.z);
 }
 
-//relcalculates AABB from OOB
+//transforms an AABB and returns the AABB which encloses the transformed box
+//center is transformed as a point. Each axis of the new half width is the sum of the
+//absolute values of a row of the 3x3 part times the old half width, which covers all
+//8 transformed corners (Arvo's method), so it is also correct for rotated boxes
 AABB GraphicsSystem::transformAABB_(const AABB& aabb, const lm::mat4& transform) {
-	//get aabb min and max
-	lm::vec3 aabb_min(
-		aabb.center.x - aabb.half_width.x,
-		aabb.center.y - aabb.half_width.y,
-		aabb.center.z - aabb.half_width.z);
-	lm::vec3 aabb_max(
-		aabb.center.x + aabb.half_width.x,
-		aabb.center.y + aabb.half_width.y,
-		aabb.center.z + aabb.half_width.z);
-
-	//transform min and max
-	lm::vec3 min_t = transform * aabb_min;
-	lm::vec3 max_t = transform * aabb_max;
-
-	//create array of coords for easier parsing
-	float vertices[6] = { min_t.x, min_t.y, min_t.z, max_t.x, max_t.y, max_t.z };
-
-	//set very max and very min
-	float big = 1000000.0f;
-	float small = -1000000.0f;
-	lm::vec3 min(big, big, big);
-	lm::vec3 max(small, small, small);
-
-	//calculate new aabb based on transformed verts
-	for (int i = 0; i < 6; i += 3) {
-		float x = vertices[i];
-		float y = vertices[i + 1];
-		float z = vertices[i + 2];
-
-		if (x < min.x) min.x = x;
-		if (y < min.y) min.y = y;
-		if (z < min.z) min.z = z;
-
-		if (x > max.x) max.x = x;
-		if (y > max.y) max.y = y;
-		if (z > max.z) max.z = z;
-	}
-
 	AABB new_aabb;
-	//set new center and halfwidth based on max and min
-	new_aabb.center = lm::vec3(
-		(min.x + max.x) / 2,
-		(min.y + max.y) / 2,
-		(min.z + max.z) / 2);
+	new_aabb.center = transform * aabb.center;
+	const lm::vec3& h = aabb.half_width;
 	new_aabb.half_width = lm::vec3(
-		max.x - new_aabb.center.x,
-		max.y - new_aabb.center.y,
-		max.z - new_aabb.center.z);
-
+		fabsf(transform.M[0][0]) * h.x + fabsf(transform.M[1][0]) * h.y + fabsf(transform.M[2][0]) * h.z,
+		fabsf(transform.M[0][1]) * h.x + fabsf(transform.M[1][1]) * h.y + fabsf(transform.M[2][1]) * h.z,
+		fabsf(transform.M[0][2]) * h.x + fabsf(transform.M[1][2]) * h.y + fabsf(transform.M[2][2]) * h.z);
 	return new_aabb;
 }
 
-
-//tests whether AABB or OOB is inside frustum or not, based on view_projection matrix
-bool GraphicsSystem::AABBInFrustum_(const AABB& aabb, const lm::mat4& to_clip) {
-	lm::vec4 points[8];
-	points[0] = lm::vec4(aabb.center.x - aabb.half_width.x, aabb.center.y - aabb.half_width.y, aabb.center.z - aabb.half_width.z, 1.0);
-	points[1] = lm::vec4(aabb.center.x - aabb.half_width.x, aabb.center.y - aabb.half_width.y, aabb.center.z + aabb.half_width.z, 1.0);
-	points[2] = lm::vec4(aabb.center.x - aabb.half_width.x, aabb.center.y + aabb.half_width.y, aabb.center.z - aabb.half_width.z, 1.0);
-	points[3] = lm::vec4(aabb.center.x - aabb.half_width.x, aabb.center.y + aabb.half_width.y, aabb.center.z + aabb.half_width.z, 1.0);
-	points[4] = lm::vec4(aabb.center.x + aabb.half_width.x, aabb.center.y - aabb.half_width.y, aabb.center.z - aabb.half_width.z, 1.0);
-	points[5] = lm::vec4(aabb.center.x + aabb.half_width.x, aabb.center.y - aabb.half_width.y, aabb.center.z + aabb.half_width.z, 1.0);
-	points[6] = lm::vec4(aabb.center.x + aabb.half_width.x, aabb.center.y + aabb.half_width.y, aabb.center.z - aabb.half_width.z, 1.0);
-	points[7] = lm::vec4(aabb.center.x + aabb.half_width.x, aabb.center.y + aabb.half_width.y, aabb.center.z + aabb.half_width.z, 1.0);
-
-	//transform to clip space
-	lm::vec4 clip_points[8];
-	for (int i = 0; i < 8; i++) {
-		clip_points[i] = to_clip * points[i];
-	}
-
-	//now test clip points against each plane. If all clip points are outside plane we return false
-	//left plane
-	int in = 0;
-	for (int i = 0; i < 8; i++) {
-		if (-clip_points[i].w < clip_points[i].x) in++;
-	}
-	if (!in) return false;
-
-	//right plane
-	in = 0;
-	for (int i = 0; i < 8; i++) {
-		if (clip_points[i].x < clip_points[i].w) in++;
-	}
-	if (!in) return false;
-
-	//bottom plane
-	in = 0;
-	for (int i = 0; i < 8; i++) {
-		if (-clip_points[i].w < clip_points[i].y) in++;
-	}
-	if (!in) return false;
-
-	//top plane
-	in = 0;
-	for (int i = 0; i < 8; i++) {
-		if (clip_points[i].y < clip_points[i].w) in++;
-	}
-	if (!in) return false;
-
-	//near plane
-	in = 0;
-	for (int i = 0; i < 8; i++) {
-		if (-clip_points[i].z < clip_points[i].z) in++;
-	}
-	if (!in) return false;
-
-	//far plane
-	in = 0;
-	for (int i = 0; i < 8; i++) {
-		if (clip_points[i].z < clip_points[i].w) in++;
-	}
-	if (!in) return false;
-
-	return true;
-}
-
-//tests whether Bounding box is inside frustum or not, based on model_view_projection matrix
-bool GraphicsSystem::BBInFrustum_(const AABB& aabb, const lm::mat4& mvp) {
-    //each corner point of box gets transformed into clip space, to give point PC, in HOMOGENOUS coords
-    //point is inside clip space iff
-    //-PC.w < PC.xyz < PC.w
-    //so we first take each corner of AABB (note, using vec4 because of homogenous coords) and multiply
-    //by matrix to clip space. Then we test each point against the 6 planes e.g. PC is on the 'right' side
-    //of the left plane iff -PC.w < PC.x; and is on 'left' side of right plane is PC.x < PC.w etc.
-    //For more info see:
-    //http://www.lighthouse3d.com/tutorials/view-frustum-culling/clip-space-approach-extracting-the-planes/
-    
-    
-    //the eight points of the box corners are calculated using center and +/- halfwith:
-    //- - -
-    //- - +
-    //- + -
-    //- + +
-    //+ - -
-    //+ - +
-    //+ + -
-    //+ + +
-	lm::vec4 points[8];
-	points[0] = lm::vec4(aabb.center.x - aabb.half_width.x, aabb.center.y - aabb.half_width.y, aabb.center.z - aabb.half_width.z, 1.0);
-	points[1] = lm::vec4(aabb.center.x - aabb.half_width.x, aabb.center.y - aabb.half_width.y, aabb.center.z + aabb.half_width.z, 1.0);
-	points[2] = lm::vec4(aabb.center.x - aabb.half_width.x, aabb.center.y + aabb.half_width.y, aabb.center.z - aabb.half_width.z, 1.0);
-	points[3] = lm::vec4(aabb.center.x - aabb.half_width.x, aabb.center.y + aabb.half_width.y, aabb.center.z + aabb.half_width.z, 1.0);
-	points[4] = lm::vec4(aabb.center.x + aabb.half_width.x, aabb.center.y - aabb.half_width.y, aabb.center.z - aabb.half_width.z, 1.0);
-	points[5] = lm::vec4(aabb.center.x + aabb.half_width.x, aabb.center.y - aabb.half_width.y, aabb.center.z + aabb.half_width.z, 1.0);
-	points[6] = lm::vec4(aabb.center.x + aabb.half_width.x, aabb.center.y + aabb.half_width.y, aabb.center.z - aabb.half_width.z, 1.0);
-	points[7] = lm::vec4(aabb.center.x + aabb.half_width.x, aabb.center.y + aabb.half_width.y, aabb.center.z + aabb.half_width.z, 1.0);
-
-	//transform to clip space
-	lm::vec4 clip_points[8];
-	for (int i = 0; i < 8; i++) {
-		clip_points[i] = mvp * points[i];
-	}
-
-	//now test clip points against each plane. If all clip points are outside plane we return false
-	//left plane
-	int in = 0;
-	for (int i = 0; i < 8; i++) {
-		if (-clip_points[i].w < clip_points[i].x) in++;
-	}
-	if (!in) return false;
-
-	//right plane
-	in = 0;
-	for (int i = 0; i < 8; i++) {
-		if (clip_points[i].x < clip_points[i].w) in++;
-	}
-	if (!in) return false;
-
-	//bottom plane
-	in = 0;
-	for (int i = 0; i < 8; i++) {
-		if (-clip_points[i].w < clip_points[i].y) in++;
-	}
-	if (!in) return false;
-
-	//top plane
-	in = 0;
-	for (int i = 0; i < 8; i++) {
-		if (clip_points[i].y < clip_points[i].w) in++;
-	}
-	if (!in) return false;
-
-	//near plane
-	in = 0;
-	for (int i = 0; i < 8; i++) {
-		if (-clip_points[i].z < clip_points[i].z) in++;
-	}
-	if (!in) return false;
-
-	//far plane
-	in = 0;
-	for (int i = 0; i < 8; i++) {
-		if (clip_points[i].z < clip_points[i].w) in++;
-	}
-	if (!in) return false;
-
-	return true;
-}
-
 //sets viewport of graphics system
 void GraphicsSystem::updateMainViewport(int window_width, int window_height) {
     glViewport(0, 0, window_width, window_height);
@@ -6,9 +6,25 @@
 #include "Shader.h"
 #include "Components.h"
 #include "GraphicsUtilities.h"
+#include "Culling.h"
+#include "RenderQueue.h"
+#include "LightClusters.h"
+#include "RenderGraph.h"
 #include <unordered_map>
 
-#define MAX_LIGHTS 8
+#define MAX_FORWARD_LIGHTS 8 //lights in u_lights_ubo of forward shaders, e.g. phong.frag
+#define MAX_SHADOW_MAPS 8 //tiles of shadow atlas: one per light which casts shadows, or per cascade
+#define MAX_SHADOW_CASCADES 4 //tiles of a directional light, see Light::shadow_cascades
+#define SHADOW_ATLAS_SIZE 4096 //shadow atlas and static shadow cache are squares of this size
+#define SHADOW_MIN_TILE 128 //smallest shadow tile, and cell size of atlas packing
+#define SHADOW_STATIC_FRAMES 30 //frames a mesh must stay still before its shadows are cached
+#define INSTANCE_ATTRIB_LOCATION 4 //first vertex attribute of per instance matrices, see *_instanced.vert
+#define MATERIAL_ATTRIB_LOCATION 12 //per instance material index, see gbuffer_instanced.vert
+#define MAX_MATERIALS 256 //size of u_materials_ubo, see gbuffer.frag
+#define MAX_DIFFUSE_ARRAYS 4 //one per diffuse map size
+#define BLOOM_LEVELS 6 //each half the size of the one before
+#define BLOOM_MAX_WIDTH 960 //first bloom level is half the window, but no wider, so bloom cost is bounded
+#define BLOOM_BUDGET_MS 0.5f //shown against measured bloom time in debug gui
 
 class GraphicsSystem {
 public:
@@ -16,6 +32,20 @@ public:
     void init(int window_width, int window_height, std::string assets);
     void lateInit();
     void update(float dt);
+
+	//cameras are updated separately from rendering, so that they can be
+	//updated on a worker thread
+	void updateCameras();
+
+	//builds sorted queue of visible meshes for main camera and each light. Runs on a
+	//worker thread after cameras are updated, and must finish before update
+	void cullMeshes();
+
+	//component access of update, updateCameras and cullMeshes, used to schedule them in Game task graph
+	static constexpr ComponentSignature reads = signatureOf<Transform, Mesh, Camera, Light>();
+	static constexpr ComponentSignature writes = 0;
+	static constexpr ComponentSignature camera_writes = signatureOf<Camera>();
+	static constexpr ComponentSignature cull_reads = signatureOf<Transform, Mesh, Camera, Light>();
     
 	//viewport
 	void updateMainViewport(int window_width, int window_height);
@@ -31,12 +61,104 @@ public:
 	//materials
     int createMaterial();
 	Material& getMaterial(int mat_id) { return materials_.at(mat_id); }
+	//set after changing a material, so that material ubo and texture arrays are rebuilt
+	bool needUpdateMaterials = true;
     
     //geometry
     int createGeometryFromFile(std::string filename);
 
 	//lights update
 	bool needUpdateLights = true;
+
+	//deferred lighting only evaluates the lights of each pixel's cluster (see LightClusters).
+	//The heatmap shows how many lights each cluster has
+	bool show_light_heatmap = false;
+	const LightClusters& getLightClusters() const { return light_clusters_; }
+
+	//light volumes instead of clusters: ambient is drawn on all geometry, then each light
+	//is added with blending. Point and spot lights only shade pixels inside their bounding
+	//sphere or cone, found with stencil. Directional lights shade all pixels with geometry
+	bool use_light_volumes = false;
+	struct LightVolumeStats {
+		int full_screen = 0; //directional, or no range
+		int volumes = 0;
+		int culled = 0; //volume outside camera frustum
+	};
+	const LightVolumeStats& getLightVolumeStats() const { return light_volume_stats_; }
+
+	//shadows: each light casting shadows has a square tile of one shadow atlas, sized from its
+	//resolution and how much of the screen its range covers. Meshes which have not moved for
+	//SHADOW_STATIC_FRAMES are static casters, drawn into the same tile of a static cache only
+	//when the light, its tile or its static casters change. A refresh copies the cached tile
+	//into the atlas and draws dynamic casters on top. Lights covering at least
+	//shadow_near_coverage of the screen height are refreshed first, then the others round
+	//robin (least recently refreshed first), while redrawn texels fit shadow_budget_texels.
+	//A light whose tile has no content yet is always refreshed
+	//Directional lights are instead fitted to what the camera sees, see fitShadowTiles_: the
+	//view depth of visible meshes is split into the light's cascades, and each cascade has a
+	//tile covering its slice of the camera frustum. Slices are spaced between uniform (0) and
+	//logarithmic (1) by cascade_split_lambda
+	bool fit_directional_shadows = true;
+	float cascade_split_lambda = 0.75f;
+	int shadow_budget_texels = 8 * 1024 * 1024;
+	float shadow_near_coverage = 0.5f;
+	//with instancing, draw the casters of all refreshed lights together: each caster once for
+	//its static and dynamic passes, instanced once per light (see renderShadowsLayered_),
+	//rather than once per light whose frustum it is in. Every caster is transformed once per
+	//layer, so it only pays off where submission costs more than the extra vertices (compare
+	//with benchmarks/render_benchmark -layered)
+	bool use_layered_shadows = false;
+	//CPU time of submitting last frame's shadow pass, and GPU time of last measured frame's
+	float getShadowTime(bool gpu) const { return gpu ? shadow_timer_.milliseconds : shadow_cpu_ms_; }
+
+	//each shadow tile and its casters last frame. Tile is skipped (kept as it is) if its light's
+	//range does not intersect the camera frustum, or a fitted tile has no visible mesh
+	struct ShadowStats {
+		int light = 0, cascade = 0;
+		bool skipped = false;
+		int tile_x = 0, tile_y = 0, tile_size = 0; //in atlas texels
+		float coverage = 0.0f; //of screen height, 1 if camera is in range
+		//shadow texels per world unit (0 if perspective), and for fitted tiles, per screen
+		//pixel at the far end of the tile's depth slice, where it is lowest (1 or more hides texels)
+		float texels_per_unit = 0.0f;
+		float texels_per_pixel = 0.0f;
+		float split_near = 0.0f, split_far = 0.0f; //view depth slice of fitted tiles
+		bool refreshed = false;
+		bool static_redrawn = false;
+		int frames_since_refresh = 0;
+		int static_casters = 0;
+		int dynamic_casters = 0;
+		int casters_skipped = 0; //outside light frustum, or mesh does not cast shadows
+	};
+	const std::vector<ShadowStats>& getShadowStats() const { return shadow_stats_; }
+	struct ShadowFrameStats {
+		int refreshed = 0;
+		int static_redrawn = 0;
+		int texels = 0; //redrawn, counting static cache and atlas
+	};
+	const ShadowFrameStats& getShadowFrameStats() const { return shadow_frame_stats_; }
+
+	//bloom of materials with bloom flag, added to image by join shader
+	float bloom_intensity = 3.0f;
+	float bloom_radius = 0.5f; //0: only sharpest (first) level, 1: only widest (last) level
+	//GPU time of last measured frame's pass into a bloom level, going down the chain, or
+	//going back up (none for last level)
+	float getBloomTime(int level, bool up) const { return (up ? bloom_up_timers_ : bloom_down_timers_)[level].milliseconds; }
+	void getBloomLevelSize(int level, int& width, int& height) const { width = bloom_sizes_[level][0]; height = bloom_sizes_[level][1]; }
+
+	//draw runs of meshes with same geometry and material with one instanced draw call
+	bool use_instancing = true;
+	//with instancing, draw all batches of a pass with one multi draw indirect call (needs GL 4.3)
+	bool use_multi_draw_indirect = true;
+	bool isMultiDrawIndirectSupported() const { return multi_draw_indirect_supported_; }
+	int getDrawCalls() const { return draw_calls_; }
+	//all G-buffer targets, see buildRenderGraph_
+	int getGBufferBytesPerPixel() const { return gbuffer_bytes_per_pixel_; }
+
+	//passes and targets of last frame. Set dump_render_graph to write them to
+	//render_graph.dot (graphviz) after next frame
+	const RenderGraph& getRenderGraph() const { return render_graph_; }
+	bool dump_render_graph = false;
     
 private:
     //resources
@@ -57,22 +179,56 @@ private:
     GLint current_material_ = -1;
     void setMaterialUniforms();
 
-	//sorting and checking and abstracting
-	void sortMeshes_();
+	//checking and abstracting
 	void resetShaderAndMaterial_();
-	void updateAllCameras_();
 	void checkShaderAndMaterial_(Mesh& mesh);
-    void checkMaterial_(Mesh& mesh);
 	
 	//binding and clearing
 	void bindAndClearScreen_();
 
 	//light uniform buffer object
 	GLuint LIGHTS_BINDING_POINT = 1;
+	GLuint VIEW_BINDING_POINT = 2;
+	GLuint DRAW_BINDING_POINT = 3;
+	GLuint MATERIALS_BINDING_POINT = 4;
 	GLuint light_ubo_;
+	//C++ side of Light struct in u_lights_ubo (std140)
+	struct LightBlock {
+		GLfloat position[4];
+		GLfloat direction[4];
+		GLfloat color[4];
+		GLfloat linear_att, quadratic_att, spot_inner_cosine, spot_outer_cosine;
+		GLfloat view_projection[16];
+		GLint type;
+		GLint cast_shadow;
+		GLint shadow_map; //index in shadow_tiles_, -1 if none or tile has no content
+		GLint shadow_cascades; //tiles from shadow_map on, in u_shadow_tiles_ubo
+		GLfloat shadow_tile[4]; //x, y and size of shadow tile in atlas uv, and its size in texels
+	};
+	std::vector<LightBlock> lights_staging_; //cpu copy of all lights, filled in parallel
+	//all lights for deferred shader, read as 10 RGBA32UI texels each (LightBlock is 10 vec4)
+	TextureBuffer light_buffer_;
 	void updateLights_();
     void setLightUniforms_();
 
+	//material ubo: parameters of all materials, indexed by material id, so gbuffer pass
+	//reads any material with no state change. Diffuse maps are copied into texture arrays,
+	//one per map size, with a layer per map
+	GLuint material_ubo_ = 0;
+	//C++ side of Material struct in u_materials_ubo (std140)
+	struct MaterialBlock {
+		GLfloat ambient[4];
+		GLfloat diffuse[4];
+		GLfloat specular[4];
+		GLfloat specular_gloss;
+		GLint bloom;
+		GLint diffuse_array; //-1 if no diffuse map
+		GLint diffuse_layer;
+	};
+	GLuint diffuse_arrays_[MAX_DIFFUSE_ARRAYS] = {};
+	int num_diffuse_arrays_ = 0;
+	void updateMaterials_();
+
 	//framebuffers
 	Shader* screen_space_shader_;
 	int screen_space_geom_;
@@ -80,19 +236,125 @@ private:
 
 	//shadowing
 	Shader* depth_shader_ = nullptr;
+	Shader* depth_instanced_shader_ = nullptr;
 	Shader* screen_depth_shader_ = nullptr;
-	Framebuffer shadow_frame_[MAX_LIGHTS];
-	void renderDepth_(Mesh& comp, const Light& light);
+	Framebuffer shadow_atlas_; //all tiles, sampled by lighting
+	Framebuffer shadow_static_; //static casters only, with the same tiles
+	struct ShadowTile {
+		int light = -1, cascade = 0; //cascades of a light are consecutive tiles
+		EntityHandle owner; //entity of light, as its index changes when other lights are removed
+		int x = 0, y = 0, size = 0; //in atlas texels, size 0 until packed
+		int target_size = 0; //from resolution and coverage, size is smaller if atlas is full
+		float coverage = 0.0f;
+		bool in_range = false; //this frame, else tile is kept as it is
+		bool valid = false; //atlas and static cache hold this tile's content
+		lm::mat4 view_projection; //of light when tile was drawn, used by lighting
+		//light's view and projection this frame, its own or fitted to the camera
+		lm::mat4 current_view, current_view_projection;
+		bool fitted = false;
+		float split_near = 0.0f, split_far = 0.0f; //slice of camera view depth, if fitted
+		std::vector<int> static_casters; //in static cache, ascending mesh indices
+		int dynamic_casters = 0; //drawn in atlas at last refresh
+		int last_refresh = 0; //frame
+		bool refresh = false, redraw_static = false; //this frame
+	};
+	ShadowTile shadow_tiles_[MAX_SHADOW_MAPS];
+	//matrix and tile of every shadow tile, for lighting of directional lights' cascades
+	GLuint SHADOW_TILES_BINDING_POINT = 6;
+	GLuint shadow_tiles_ubo_ = 0;
+	//C++ side of u_shadow_tiles_ubo (std140) of bloom.frag and phong.frag, with the tile as in
+	//LightBlock::shadow_tile
+	struct ShadowTilesBlock {
+		GLfloat view_projection[MAX_SHADOW_MAPS][16];
+		GLfloat tile[MAX_SHADOW_MAPS][4];
+	};
+	Shader* depth_layered_shader_ = nullptr;
+	GLuint SHADOW_LAYERS_BINDING_POINT = 5;
+	//C++ side of u_shadow_layers_ubo (std140) of depth_layered.vert: matrix and tile of the
+	//tile drawn by each layer, in atlas clip space (x, y of its lower corner, size)
+	struct ShadowLayersBlock {
+		GLfloat view_projection[MAX_SHADOW_MAPS][16];
+		GLfloat tile[MAX_SHADOW_MAPS][4];
+	};
+	//x, y and size of tile in atlas uv, and its size in texels
+	void shadowTileRect_(const ShadowTile& tile, GLfloat* rect) const;
+	GpuTimer shadow_timer_;
+	float shadow_cpu_ms_ = 0.0f;
+	int num_shadow_maps_ = 0;
+	int shadow_frame_count_ = 0;
+	ShadowFrameStats shadow_frame_stats_;
+	std::vector<int> light_shadow_map_; //first shadow tile of each light, -1 if none
+	int shadowMap_(size_t light) const { return light < light_shadow_map_.size() ? light_shadow_map_[light] : -1; }
+	void assignShadowTiles_();
+	void sizeShadowTiles_();
+	void fitShadowTiles_();
+	void packShadowAtlas_();
+	void scheduleShadows_();
+	bool useLayeredShadows_() const { return use_layered_shadows && use_instancing; }
+	void clearStaticTile_(const ShadowTile& tile);
+	void copyStaticTile_(const ShadowTile& tile);
+	void renderShadowsLayered_();
+
+	//light clusters of main camera, built on culling jobs after mesh culling, and uploaded
+	//as a grid of (offset, count) per cluster and a list of light indices
+	LightClusters light_clusters_;
+	std::vector<ClusterLight> cluster_lights_;
+	TextureBuffer cluster_grid_buffer_;
+	TextureBuffer cluster_lights_buffer_;
+	void buildLightClusters_();
+	void uploadLightClusters_();
+
+	//light volumes. G-buffer pass sets GEOMETRY_STENCIL_BIT where it draws, and the lower
+	//stencil bits count each volume's faces behind the surface (see renderLightVolumes_)
+	static const GLuint GEOMETRY_STENCIL_BIT = 0x80;
+	Shader* light_volume_shader_ = nullptr; //lighting of one light, on its volume
+	Shader* stencil_volume_shader_ = nullptr; //volume with no color
+	int light_sphere_geom_ = -1;
+	int light_cone_geom_ = -1;
+	LightVolumeStats light_volume_stats_;
+	bool lightVolume_(const Light& light, lm::mat4& model, int& geometry) const;
+	void renderLightVolumes_();
     
+	//render graph: passes of the frame and their targets, declared every frame, so targets
+	//follow the viewport size. Ids of this frame's resources in render_graph_
+	RenderGraph render_graph_;
+	struct FrameTargets {
+		int albedo = -1, normal = -1, material = -1, depth = -1; //gbuffer
+		int lit = -1; //lighting and environment
+		int lighting_depth = -1; //copy of gbuffer depth and stencil, for light volumes
+		int bloom[BLOOM_LEVELS];
+		int shadow_atlas = -1, shadow_static = -1;
+		int screen = -1;
+	};
+	FrameTargets targets_;
+	void buildRenderGraph_();
+	void renderShadowMaps_();
+	void renderJoin_();
+
     //gbuffer
     Shader* gbuffer_shader_ = nullptr;
+    Shader* gbuffer_instanced_shader_ = nullptr;
     Shader* deferred_shader_ = nullptr;
-    Framebuffer gbuffer_;
+    int gbuffer_bytes_per_pixel_ = 0;
+	void renderGeometry_();
+
+	//bloom: albedo of bloom materials (bright pass) into first level, then each level is a
+	//blurred downsample of the one before. Going back up, each level is blurred, upsampled and
+	//blended into the one above it, so first level ends with all of them
+	Shader* bloom_prefilter_shader_ = nullptr;
+	Shader* bloom_downsample_shader_ = nullptr;
+	Shader* bloom_upsample_shader_ = nullptr;
+	GLsizei bloom_sizes_[BLOOM_LEVELS][2] = {};
+	GpuTimer bloom_down_timers_[BLOOM_LEVELS];
+	GpuTimer bloom_up_timers_[BLOOM_LEVELS];
+	void renderBloomLevel_(int level, bool up);
 
-	//gbuffer2
+	//lighting, and join of lighting and bloom
 	Shader* join_shader_ = nullptr;
-	Framebuffer gbuffer2_;
-	void renderGbuffer(GLuint depthToBuffer);
+	void renderGbuffer();
+	//u_light_index values of deferred shader which are not a light, see bloom.frag
+	enum { LIGHTS_CLUSTERED = -1, LIGHTS_NONE = -2 };
+	void useDeferredShader_(Shader* s);
     
     //cubemap/environment
     int cube_map_geom_ = -1;
@@ -100,14 +362,100 @@ private:
     GLuint environment_tex_ = 0;
     
     //rendering
-    void renderMeshComponent_(Mesh& comp);
+    int draw_calls_ = 0;
     void renderEnvironment_();
     
 	//AABB
 	void setGeometryAABB_(Geometry& geom, std::vector<GLfloat>& vertices);
 	AABB transformAABB_(const AABB& aabb, const lm::mat4& transform);
-	bool BBInFrustum_(const AABB& aabb, const lm::mat4& model_view_projection);
-	bool AABBInFrustum_(const AABB& aabb, const lm::mat4& view_projection);
+
+	//culling: world bounds of each mesh (same index as Mesh array), and a list of
+	//visible mesh indices for each view. View 0 is main camera, view 1 + s is shadow tile s
+	//(dynamic casters), and view 1 + num tiles + s its static casters, culled with it.
+	//The last two views are the layered static and dynamic casters of all refreshed tiles
+	//Visible meshes of each view are then sorted into its render queue, which is split
+	//into batches of consecutive draws with the same geometry and material
+	struct DrawBatch {
+		int geometry;
+		int material;
+		int first_instance;
+		int count;
+	};
+	//DrawElementsIndirectCommand of GL 4.3, one per batch
+	struct DrawCommand {
+		GLuint count;
+		GLuint instance_count;
+		GLuint first_index;
+		GLint base_vertex;
+		GLuint base_instance;
+	};
+	struct CullView {
+		Frustum frustum;
+		lm::mat4 view_matrix; //for view depth of sort keys
+		bool active = true; //false if view is skipped this frame
+		std::vector<int> visible;
+		std::vector<int> chunk_counts; //visible meshes found by each culling job
+		RenderQueue queue;
+		std::vector<DrawBatch> batches;
+		std::vector<DrawCommand> commands; //empty if multi draw indirect is not used
+		std::vector<GLfloat> instances; //model matrix (and normal matrix and material in gbuffer) per queue item
+		int floats_per_instance;
+		GLintptr instance_offset; //of instances in instance_vbo_
+		GLintptr command_offset; //of commands in indirect_buffer_
+		GLintptr view_block_offset; //in uniform_ring_
+		GLintptr first_draw_block_offset; //in uniform_ring_, when not instancing
+		GLsizeiptr draw_block_stride;
+		std::vector<int> layer_tiles; //layered shadow view: shadow tile of each layer
+		//instances drawn per queue item, which share its instance data
+		int instanceRepeat() const { return layer_tiles.empty() ? 1 : (int)layer_tiles.size(); }
+	};
+	WorldBounds mesh_bounds_;
+	std::vector<char> mesh_casts_shadow_;
+	std::vector<lm::mat4> mesh_world_; //world matrix of each mesh when it last moved
+	std::vector<int> mesh_still_frames_; //frames since it moved, up to SHADOW_STATIC_FRAMES
+	std::vector<char> mesh_static_; //static shadow caster
+	std::vector<CullView> cull_views_;
+	size_t num_tile_views_ = 0;
+	std::vector<ShadowStats> shadow_stats_;
+	const RenderQueue& cameraQueue_() const { return cull_views_[0].queue; }
+	CullView& tileView_(int tile) { return cull_views_[1 + tile]; }
+	CullView& staticCasterView_(int tile) { return cull_views_[1 + num_tile_views_ + tile]; }
+	CullView& layeredView_(bool static_casters) { return cull_views_[1 + 2 * num_tile_views_ + (static_casters ? 0 : 1)]; }
+	void cullView_(CullView& view, int chunk_size, JobCounter& counter);
+	void compactView_(CullView& view, int chunk_size, std::vector<int>* static_visible);
+	void renderLayers_(const CullView& view);
+	void buildQueue_(CullView& view, RenderPassType pass);
+
+	//instancing: per instance data of all views, uploaded once per frame
+	GLuint instance_vbo_ = 0;
+	void uploadInstances_();
+	void bindInstanceAttributes_(const CullView& view, GLintptr first);
+	void renderBatch_(const CullView& view, const DrawBatch& batch);
+
+	//multi draw indirect (GL 4.3): all geometries live in geometry_store_, and each view's
+	//batches are written as draw commands when its queue is built (on culling jobs), then
+	//uploaded with instance data. Falls back to renderBatch_ on GL 3.3 or for a view whose
+	//commands are missing (e.g. geometry added after store was built)
+	bool multi_draw_indirect_supported_ = false;
+	GeometryStore geometry_store_;
+	GLuint indirect_buffer_ = 0;
+	bool useMultiDrawIndirect_() const { return multi_draw_indirect_supported_ && use_instancing && use_multi_draw_indirect; }
+	void renderViewIndirect_(const CullView& view);
+	void renderView_(const CullView& view, const std::vector<DrawItem>& items);
+
+	//uniform blocks, streamed through a ring buffer: a view block (u_view_ubo: vp matrix and
+	//position) per view, bound once per pass, and when not instancing, a draw block (u_draw_ubo:
+	//the item's instance data) per queue item, selected with an offset for each draw
+	UniformRing uniform_ring_;
+	struct ViewBlock {
+		GLfloat vp[16];
+		GLfloat cam_pos[4];
+	};
+	//compares C++ block layouts with the std140 layouts reflected from each shader
+	void checkUniformBlocks_();
+	void uploadUniformBlocks_();
+	void bindViewBlock_(const CullView& view);
+	void renderQueueItem_(const CullView& view, size_t item, int geometry);
 
 	//shader strings
 	const char* screen_vertex_shader_ =
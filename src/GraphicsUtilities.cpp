@@ -1,4 +1,5 @@
 #include "GraphicsUtilities.h"
+#include "extern.h"
 
 // ****** GEOMETRY ***** //
 
@@ -7,46 +8,43 @@ Geometry::Geometry(std::vector<float>& vertices, std::vector<float>& uvs, std::v
 	createVertexArrays(vertices, uvs, normals, indices);
 }
 
+//vao is left bound, so consecutive draws of the same geometry do not rebind it
 void Geometry::render() {
-	glBindVertexArray(vao);
+	GLSTATE.bindVertexArray(vao);
 	glDrawElements(GL_TRIANGLES, num_tris * 3, GL_UNSIGNED_INT, 0);
-	glBindVertexArray(0);
 }
 
 void Geometry::createVertexArrays(std::vector<float>& vertices, std::vector<float>& uvs, std::vector<float>& normals, std::vector<unsigned int>& indices) {
 	//generate and bind vao
 	glGenVertexArrays(1, &vao);
-	glBindVertexArray(vao);
-	GLuint vbo;
+	GLSTATE.bindVertexArray(vao);
 	//positions
-	glGenBuffers(1, &vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	glGenBuffers(3, vbos);
+	glBindBuffer(GL_ARRAY_BUFFER, vbos[0]);
 	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), &(vertices[0]), GL_STATIC_DRAW);
 	glEnableVertexAttribArray(0);
 	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
 	//texture coords
-	glGenBuffers(1, &vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, vbos[1]);
 	glBufferData(GL_ARRAY_BUFFER, uvs.size() * sizeof(float), &(uvs[0]), GL_STATIC_DRAW);
 	glEnableVertexAttribArray(1);
 	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, 0);
 	//normals
-	glGenBuffers(1, &vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, vbos[2]);
 	glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(float), &(normals[0]), GL_STATIC_DRAW);
 	glEnableVertexAttribArray(2);
 	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, 0);
 	//indices
-	GLuint ibo;
 	glGenBuffers(1, &ibo);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
 	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &(indices[0]), GL_STATIC_DRAW);
 	//unbind
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindVertexArray(0);
+	GLSTATE.bindVertexArray(0);
 
-	//set number of triangles
+	//set number of triangles and vertices
 	num_tris = (GLuint)indices.size() / 3;
+	num_vertices = (GLuint)vertices.size() / 3;
 
 	//set AABB
 	setAABB(vertices);
@@ -101,11 +99,64 @@ int Geometry::createPlaneGeometry() {
 	return 1;
 }
 
+//vertices lie on a sphere slightly larger than unit, so that flat faces do not cut into it
+int Geometry::createSphereGeometry(int slices, int stacks) {
+	const float pi = 3.14159265f;
+	const float radius = 1.0f / (cosf(pi / slices) * cosf(pi / (2 * stacks)));
+
+	std::vector<GLfloat> vertices, uvs, normals;
+	std::vector<GLuint> indices;
+	for (int i = 0; i <= stacks; i++) {
+		float theta = pi * i / stacks;
+		for (int j = 0; j <= slices; j++) {
+			float phi = 2.0f * pi * j / slices;
+			lm::vec3 n(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi));
+			vertices.insert(vertices.end(), { n.x * radius, n.y * radius, n.z * radius });
+			normals.insert(normals.end(), { n.x, n.y, n.z });
+			uvs.insert(uvs.end(), { (float)j / slices, (float)i / stacks });
+		}
+	}
+	for (int i = 0; i < stacks; i++) {
+		for (int j = 0; j < slices; j++) {
+			GLuint a = i * (slices + 1) + j, b = a + slices + 1;
+			indices.insert(indices.end(), { a, a + 1, b, a + 1, b + 1, b });
+		}
+	}
+
+	createVertexArrays(vertices, uvs, normals, indices);
+	return 1;
+}
+
+//base ring is widened so that the cone's flat sides enclose the round cone
+int Geometry::createConeGeometry(int slices) {
+	const float pi = 3.14159265f;
+	const float radius = 1.0f / cosf(pi / slices);
+
+	//apex, base center, then base ring
+	std::vector<GLfloat> vertices = { 0.0f, 0.0f, 0.0f,   0.0f, 0.0f, 1.0f };
+	std::vector<GLfloat> uvs = { 0.5f, 0.5f,   0.5f, 0.5f };
+	std::vector<GLfloat> normals = { 0.0f, 0.0f, -1.0f,   0.0f, 0.0f, 1.0f };
+	std::vector<GLuint> indices;
+	for (int j = 0; j < slices; j++) {
+		float phi = 2.0f * pi * j / slices;
+		vertices.insert(vertices.end(), { cosf(phi) * radius, sinf(phi) * radius, 1.0f });
+		normals.insert(normals.end(), { cosf(phi), sinf(phi), 0.0f });
+		uvs.insert(uvs.end(), { 0.5f + 0.5f * cosf(phi), 0.5f + 0.5f * sinf(phi) });
+	}
+	for (int j = 0; j < slices; j++) {
+		GLuint r0 = 2 + j, r1 = 2 + (j + 1) % slices;
+		indices.insert(indices.end(), { 0, r1, r0, 1, r0, r1 });
+	}
+
+	createVertexArrays(vertices, uvs, normals, indices);
+	return 1;
+}
+
 void Framebuffer::bindAndClear() {
-	glViewport(0, 0, width, height);
-	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	GLSTATE.viewport(0, 0, width, height);
+	GLSTATE.bindFramebuffer(GL_FRAMEBUFFER, framebuffer);
 	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
 }
 
 void Framebuffer::initColor(GLsizei w, GLsizei h) {
@@ -113,7 +164,7 @@ void Framebuffer::initColor(GLsizei w, GLsizei h) {
 	width = w; height = h;
 
 	glGenFramebuffers(1, &(framebuffer));
-	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	GLSTATE.bindFramebuffer(GL_FRAMEBUFFER, framebuffer);
 
 	glGenTextures(1, &(color_textures[0]));
 	glBindTexture(GL_TEXTURE_2D, color_textures[0]);
@@ -137,7 +188,7 @@ void Framebuffer::initColor(GLsizei w, GLsizei h) {
 
 	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
 		std::cout << "ERROR::FRAMEBUFFER:: Framebuffer is not complete!" << std::endl;
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	GLSTATE.bindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
 void Framebuffer::initDepth(GLsizei w, GLsizei h) {
@@ -145,7 +196,7 @@ void Framebuffer::initDepth(GLsizei w, GLsizei h) {
 
 	//bind framebuffer and texture as usual
 	glGenFramebuffers(1, &framebuffer);
-	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	GLSTATE.bindFramebuffer(GL_FRAMEBUFFER, framebuffer);
 
 	//bind texture, but format with be only storing depth component
 	glGenTextures(1, &(color_textures[0]));
@@ -176,14 +227,14 @@ void Framebuffer::initDepth(GLsizei w, GLsizei h) {
 
 	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
 		std::cout << "ERROR::FRAMEBUFFER:: Framebuffer is not complete!" << std::endl;
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	GLSTATE.bindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
 void Framebuffer::initGbuffer(GLsizei w, GLsizei h) {
 	width = w; height = h;
 	//create and bind
 	glGenFramebuffers(1, &(framebuffer));
-	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	GLSTATE.bindFramebuffer(GL_FRAMEBUFFER, framebuffer);
 	//position
 	glGenTextures(1, &(color_textures[0]));
 	glBindTexture(GL_TEXTURE_2D, color_textures[0]);
@@ -226,146 +277,173 @@ void Framebuffer::initGbuffer(GLsizei w, GLsizei h) {
 
 	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
 		std::cout << "ERROR::Framebuffer is not complete!" << std::endl;
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	GLSTATE.bindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
-void Framebuffer::initGBuffer2(GLsizei w, GLsizei h) {
-    width = w; height = h;
-	//create and bind
-	glGenFramebuffers(1, &(framebuffer));
-	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
-	//position
-	glGenTextures(1, &(color_textures[0]));
-	glBindTexture(GL_TEXTURE_2D, color_textures[0]);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, width, height, 0, GL_RGB, GL_FLOAT, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color_textures[0], 0);
-
-	//normal
-	glGenTextures(1, &(color_textures[1]));
-	glBindTexture(GL_TEXTURE_2D, color_textures[1]);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, width, height, 0, GL_RGB, GL_FLOAT, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, color_textures[1], 0);
-
-	//diffuse + specular (in A channel)
-	glGenTextures(1, &(color_textures[2]));
-	glBindTexture(GL_TEXTURE_2D, color_textures[2]);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, color_textures[2], 0);
-
-	//bloom
-	glGenTextures(1, &(color_textures[3]));
-	glBindTexture(GL_TEXTURE_2D, color_textures[3]);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, width, height, 0, GL_RGB, GL_FLOAT, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, GL_TEXTURE_2D, color_textures[3], 0);
+void Framebuffer::getDephtBuffer(Framebuffer buffer)
+{
+	GLSTATE.bindFramebuffer(GL_READ_FRAMEBUFFER, buffer.framebuffer);
+	GLSTATE.bindFramebuffer(GL_DRAW_FRAMEBUFFER, this->framebuffer);
+	glBlitFramebuffer(
+		0, 0, buffer.width, buffer.height, 0, 0, width, height,
+		GL_DEPTH_BUFFER_BIT, GL_NEAREST
+	);
+}
 
-	//depth
-	glGenTextures(1, &(color_textures[4]));
-	glBindTexture(GL_TEXTURE_2D, color_textures[4]);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, width, height, 0, GL_RGB, GL_FLOAT, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+// ****** UNIFORM RING ***** //
 
-	//ambient
-	glGenTextures(1, &(color_textures[5]));
-	glBindTexture(GL_TEXTURE_2D, color_textures[5]);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, width, height, 0, GL_RGB, GL_FLOAT, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT5, GL_TEXTURE_2D, color_textures[5], 0);
+void UniformRing::init(GLsizeiptr initial_segment_size) {
+	GLint gl_alignment = 0;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &gl_alignment);
+	if (gl_alignment > 0) alignment = gl_alignment;
 
-	// - tell OpenGL which color attachments we'll use
-	// (of this framebuffer) for rendering
-	unsigned int attachments[6] = { GL_COLOR_ATTACHMENT0,
-		GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3, GL_COLOR_ATTACHMENT4, GL_COLOR_ATTACHMENT5 };
-	glDrawBuffers(6, attachments);
+	glGenBuffers(1, &ubo);
+	segment_size = align(initial_segment_size);
+	glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+	glBufferData(GL_UNIFORM_BUFFER, segment_size * NUM_FRAMES, nullptr, GL_STREAM_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
 
-	unsigned int rbo;
-	glGenRenderbuffers(1, &rbo);
-	glBindRenderbuffer(GL_RENDERBUFFER, rbo);
-	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
-	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+void UniformRing::begin(GLsizeiptr size) {
+	glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+
+	//grow: new storage is orphaned, so old fences no longer matter
+	if (size > segment_size) {
+		for (int i = 0; i < NUM_FRAMES; i++) {
+			if (fences[i]) glDeleteSync(fences[i]);
+			fences[i] = 0;
+		}
+		segment_size = align(size + size / 2);
+		glBufferData(GL_UNIFORM_BUFFER, segment_size * NUM_FRAMES, nullptr, GL_STREAM_DRAW);
+	}
 
-	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
-		GL_RENDERBUFFER, rbo);
+	segment = (segment + 1) % NUM_FRAMES;
+	if (fences[segment]) {
+		GLenum result;
+		do {
+			result = glClientWaitSync(fences[segment], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+		} while (result == GL_TIMEOUT_EXPIRED);
+		glDeleteSync(fences[segment]);
+		fences[segment] = 0;
+	}
 
-	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
-		std::cout << "ERROR::Framebuffer is not complete!" << std::endl;
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	mapped = (GLubyte*)glMapBufferRange(GL_UNIFORM_BUFFER, segment * segment_size, segment_size,
+		GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+	used = 0;
 }
 
-void Framebuffer::initGBuffer3(GLsizei w, GLsizei h)
-{
+GLintptr UniformRing::push(const void* data, GLsizeiptr size) {
+	if (!mapped || used + size > segment_size) {
+		std::cerr << "ERROR: Uniform ring block does not fit in segment" << std::endl;
+		return segment * segment_size;
+	}
+	memcpy(mapped + used, data, size);
+	GLintptr offset = segment * segment_size + used;
+	used += align(size);
+	return offset;
+}
 
-	width = w; height = h;
-	//create and bind
-	glGenFramebuffers(1, &(framebuffer));
-	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+void UniformRing::end() {
+	glUnmapBuffer(GL_UNIFORM_BUFFER);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	mapped = nullptr;
+}
 
-	//Phong
-	glGenTextures(1, &(color_textures[0]));
-	glBindTexture(GL_TEXTURE_2D, color_textures[0]);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, width, height, 0, GL_RGB, GL_FLOAT, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color_textures[0], 0);
+void UniformRing::fence() {
+	fences[segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
 
-	//bloom
-	glGenTextures(1, &(color_textures[1]));
-	glBindTexture(GL_TEXTURE_2D, color_textures[1]);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, width, height, 0, GL_RGB, GL_FLOAT, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, color_textures[1], 0);
+void GeometryStore::build(const std::vector<Geometry>& geometries) {
+	//ranges of each geometry in shared buffers
+	ranges.resize(geometries.size());
+	GLuint num_indices = 0, num_vertices = 0;
+	for (size_t i = 0; i < geometries.size(); i++) {
+		const Geometry& g = geometries[i];
+		ranges[i].first_index = num_indices;
+		ranges[i].base_vertex = (GLint)num_vertices;
+		if (!g.ibo) continue;
+		num_indices += g.num_tris * 3;
+		num_vertices += g.num_vertices;
+	}
 
-	//background
-	glGenTextures(1, &(color_textures[2]));
-	glBindTexture(GL_TEXTURE_2D, color_textures[2]);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, width, height, 0, GL_RGB, GL_FLOAT, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, color_textures[2], 0);
+	if (!vao) {
+		glGenVertexArrays(1, &vao);
+		glGenBuffers(3, vbos);
+		glGenBuffers(1, &ibo);
+	}
+	GLSTATE.bindVertexArray(vao);
+	//floats per vertex of positions, uvs and normals
+	const GLint sizes[3] = { 3, 2, 3 };
+	for (int a = 0; a < 3; a++) {
+		glBindBuffer(GL_COPY_WRITE_BUFFER, vbos[a]);
+		glBufferData(GL_COPY_WRITE_BUFFER, num_vertices * sizes[a] * sizeof(GLfloat), nullptr, GL_STATIC_DRAW);
+		for (size_t i = 0; i < geometries.size(); i++) {
+			const Geometry& g = geometries[i];
+			if (!g.ibo) continue;
+			glBindBuffer(GL_COPY_READ_BUFFER, g.vbos[a]);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0,
+				ranges[i].base_vertex * sizes[a] * sizeof(GLfloat), g.num_vertices * sizes[a] * sizeof(GLfloat));
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, vbos[a]);
+		glEnableVertexAttribArray(a);
+		glVertexAttribPointer(a, sizes[a], GL_FLOAT, GL_FALSE, 0, 0);
+	}
+	//indices are not offset, draws add base vertex to them
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, num_indices * sizeof(GLuint), nullptr, GL_STATIC_DRAW);
+	for (size_t i = 0; i < geometries.size(); i++) {
+		const Geometry& g = geometries[i];
+		if (!g.ibo) continue;
+		glBindBuffer(GL_COPY_READ_BUFFER, g.ibo);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_ELEMENT_ARRAY_BUFFER, 0,
+			ranges[i].first_index * sizeof(GLuint), g.num_tris * 3 * sizeof(GLuint));
+	}
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	GLSTATE.bindVertexArray(0);
+}
 
+void TextureBuffer::init(GLenum internal_format) {
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+	glBufferData(GL_TEXTURE_BUFFER, 16, nullptr, GL_STREAM_DRAW);
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_BUFFER, texture);
+	glTexBuffer(GL_TEXTURE_BUFFER, internal_format, buffer);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
 
-	// - tell OpenGL which color attachments we'll use
-	// (of this framebuffer) for rendering
-	unsigned int attachments[3] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 , GL_COLOR_ATTACHMENT2 };
-	//GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
-	glDrawBuffers(3, attachments);
+//texture keeps reading the buffer when its storage is reallocated, so no rebinding is needed
+void TextureBuffer::upload(const void* data, GLsizeiptr size) {
+	glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+	//never empty, texel fetches past the end just return 0
+	glBufferData(GL_TEXTURE_BUFFER, size > 0 ? size : 16, size > 0 ? data : nullptr, GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
 
-	unsigned int rbo;
-	glGenRenderbuffers(1, &rbo);
-	glBindRenderbuffer(GL_RENDERBUFFER, rbo);
-	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
-	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+// ****** GPU TIMER ***** //
 
-	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
-		GL_RENDERBUFFER, rbo);
+void GpuTimer::init() {
+	glGenQueries(NUM_FRAMES, queries);
+}
 
-	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
-		std::cout << "ERROR::Framebuffer is not complete!" << std::endl;
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+void GpuTimer::begin() {
+	GLuint query = queries[frame % NUM_FRAMES];
+	if (frame >= NUM_FRAMES) {
+		GLint available = 0;
+		glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			GLuint64 ns = 0;
+			glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+			milliseconds = (float)(ns / 1.0e6);
+		}
+	}
+	glBeginQuery(GL_TIME_ELAPSED, query);
 }
 
-void Framebuffer::getDephtBuffer(Framebuffer buffer)
-{
-	glBindFramebuffer(GL_READ_FRAMEBUFFER, buffer.framebuffer);
-	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, this->framebuffer);
-	glBlitFramebuffer(
-		0, 0, buffer.width, buffer.height, 0, 0, width, height,
-		GL_DEPTH_BUFFER_BIT, GL_NEAREST
-	);
+void GpuTimer::end() {
+	glEndQuery(GL_TIME_ELAPSED);
+	frame++;
 }
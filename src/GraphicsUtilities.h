@@ -11,6 +11,10 @@ struct Geometry {
 	GLuint vao;
 	GLuint num_tris;
 	AABB aabb;
+	//buffers of vao (positions, uvs, normals), kept to copy them into GeometryStore
+	GLuint vbos[3] = { 0, 0, 0 };
+	GLuint ibo = 0;
+	GLuint num_vertices = 0;
 	
 	//constrctors
 	Geometry() { vao = 0; num_tris = 0; }
@@ -21,6 +25,10 @@ struct Geometry {
 	void createVertexArrays(std::vector<float>& vertices, std::vector<float>& uvs, std::vector<float>& normals, std::vector<unsigned int>& indices);
 	void setAABB(std::vector<GLfloat>& vertices);
 	int createPlaneGeometry();
+	//light volumes: faceted meshes which enclose a unit sphere, and a cone with apex at
+	//origin, axis +z, height 1 and base radius 1
+	int createSphereGeometry(int slices, int stacks);
+	int createConeGeometry(int slices);
 
 	//rendering functions
 	void render();
@@ -28,7 +36,6 @@ struct Geometry {
 
 struct Material {
 	std::string name;
-	int index = -1;
 	int shader_id;
 	lm::vec3 ambient;
 	lm::vec3 diffuse;
@@ -63,8 +70,71 @@ struct Framebuffer {
 	void initDepth(GLsizei width, GLsizei height);
     void initGbuffer(GLsizei width, GLsizei height);
 
-	void initGBuffer2(GLsizei width, GLsizei height);
-	void initGBuffer3(GLsizei width, GLsizei height);
 	void getDephtBuffer(Framebuffer buffer);
 };
 
+
+//Buffer read in shaders through a buffer texture (texelFetch on a samplerBuffer), for
+//arrays too large for a uniform block. Contents are replaced whole on each upload
+struct TextureBuffer {
+	GLuint buffer = 0;
+	GLuint texture = 0;
+	//internal_format is the texel format, e.g. GL_R32UI or GL_RGBA32F
+	void init(GLenum internal_format);
+	void upload(const void* data, GLsizeiptr size);
+};
+
+//All geometries in shared vertex and index buffers, so that draws of any geometry can be
+//issued from one vao, in one multi draw indirect call (GL 4.3). Each geometry's buffers are
+//copied in, and its draws use its first index and base vertex. Attributes 0-2 are as in
+//Geometry, per instance attributes are set by the pass drawing with it
+struct GeometryStore {
+	GLuint vao = 0;
+	GLuint vbos[3] = { 0, 0, 0 };
+	GLuint ibo = 0;
+	struct Range {
+		GLuint first_index;
+		GLint base_vertex;
+	};
+	std::vector<Range> ranges; //one per geometry, same index
+	//copies all geometries, replacing what was stored. Geometries without buffers are left empty
+	void build(const std::vector<Geometry>& geometries);
+};
+
+//Uniform buffer rewritten every frame, split into NUM_FRAMES segments used in turn.
+//A frame's blocks are copied into its segment through an unsynchronized map (GL 3.3 has
+//no persistent mapping), and a fence after the frame's draws guards the segment until it
+//comes round again, so the CPU only waits if the GPU falls NUM_FRAMES - 1 frames behind
+struct UniformRing {
+	static const int NUM_FRAMES = 3;
+	GLuint ubo = 0;
+	GLsizeiptr alignment = 256; //GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+	GLsizeiptr segment_size = 0;
+	int segment = 0;
+	GLsync fences[NUM_FRAMES] = { 0, 0, 0 };
+	GLubyte* mapped = nullptr;
+	GLsizeiptr used = 0;
+
+	void init(GLsizeiptr initial_segment_size);
+	GLsizeiptr align(GLsizeiptr size) const { return (size + alignment - 1) / alignment * alignment; }
+	//waits for next segment to be free (growing buffer if size does not fit) and maps it
+	void begin(GLsizeiptr size);
+	//copies a block into mapped segment, returns its offset in ubo
+	GLintptr push(const void* data, GLsizeiptr size);
+	void end();
+	//call after last draw which reads this frame's blocks
+	void fence();
+};
+
+//GPU time of one section of a frame, with a GL_TIME_ELAPSED query. Queries are used in turn
+//over NUM_FRAMES frames, and each result is read when its query comes round again, so
+//reading never waits for the GPU. Sections timed this way must not overlap
+struct GpuTimer {
+	static const int NUM_FRAMES = 3;
+	GLuint queries[NUM_FRAMES] = { 0, 0, 0 };
+	int frame = 0;
+	float milliseconds = 0.0f; //latest result, NUM_FRAMES frames old
+	void init();
+	void begin();
+	void end();
+};
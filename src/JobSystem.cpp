@@ -0,0 +1,127 @@
+#include "JobSystem.h"
+#include <iostream>
+
+//queue of the thread running the code. Main thread (and any thread not
+//created by the job system) uses queue 0
+static thread_local int tls_queue_index = 0;
+//jobs the running thread is inside of. A job which waits runs other jobs nested in it, whose
+//time is already part of the outer job's
+static thread_local int tls_job_depth = 0;
+
+void JobSystem::init(int num_workers) {
+	if (num_workers < 0) {
+		int cores = (int)std::thread::hardware_concurrency();
+		num_workers = cores > 1 ? cores - 1 : 1;
+	}
+
+	for (int i = 0; i < num_workers + 1; i++)
+		queues_.emplace_back(new Queue());
+	utilization_.assign(queues_.size(), 0.0f);
+
+	running_ = true;
+	for (int i = 1; i <= num_workers; i++)
+		workers_.emplace_back(&JobSystem::workerLoop_, this, i);
+
+	frame_start_ = std::chrono::high_resolution_clock::now();
+	std::cout << "Job system: " << num_workers << " worker threads" << std::endl;
+}
+
+//stops and joins all workers. Jobs still queued are discarded
+void JobSystem::shutdown() {
+	if (!running_) return;
+	running_ = false;
+	wake_cv_.notify_all();
+	for (auto& w : workers_) w.join();
+	workers_.clear();
+	queues_.clear();
+}
+
+void JobSystem::run(Job job, JobCounter* counter) {
+	if (counter) counter->pending++;
+
+	//no threads: run now
+	if (queues_.empty()) {
+		job();
+		if (counter) counter->pending--;
+		return;
+	}
+
+	Queue& q = *queues_[tls_queue_index];
+	{
+		std::lock_guard<std::mutex> lock(q.mutex);
+		q.jobs.push_back({ std::move(job), counter });
+	}
+	queued_jobs_++;
+	wake_cv_.notify_one();
+}
+
+void JobSystem::wait(JobCounter& counter) {
+	while (counter.pending > 0) {
+		if (!tryRunJob())
+			std::this_thread::yield();
+	}
+}
+
+//pops newest job from own queue, or else steals oldest job from another queue
+bool JobSystem::popJob_(int queue_index, QueuedJob& out) {
+	{
+		Queue& own = *queues_[queue_index];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.jobs.empty()) {
+			out = std::move(own.jobs.back());
+			own.jobs.pop_back();
+			return true;
+		}
+	}
+	const int num_queues = (int)queues_.size();
+	for (int i = 1; i < num_queues; i++) {
+		Queue& victim = *queues_[(queue_index + i) % num_queues];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.jobs.empty()) {
+			out = std::move(victim.jobs.front());
+			victim.jobs.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+bool JobSystem::tryRunJob() {
+	if (queues_.empty() || queued_jobs_ == 0) return false;
+
+	QueuedJob qj;
+	if (!popJob_(tls_queue_index, qj)) return false;
+	queued_jobs_--;
+
+	auto t0 = std::chrono::high_resolution_clock::now();
+	tls_job_depth++;
+	qj.job();
+	tls_job_depth--;
+	auto t1 = std::chrono::high_resolution_clock::now();
+	if (tls_job_depth == 0)
+		queues_[tls_queue_index]->busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+
+	if (qj.counter) qj.counter->pending--;
+	return true;
+}
+
+void JobSystem::workerLoop_(int queue_index) {
+	tls_queue_index = queue_index;
+	while (running_) {
+		if (tryRunJob()) continue;
+		//nothing to do: sleep until a job is queued. Timeout covers notifications
+		//sent between our last check and the wait
+		std::unique_lock<std::mutex> lock(wake_mutex_);
+		wake_cv_.wait_for(lock, std::chrono::milliseconds(1), [this] { return queued_jobs_ > 0 || !running_; });
+	}
+}
+
+//converts time spent in jobs into a fraction of the frame, per thread
+void JobSystem::endFrame() {
+	auto now = std::chrono::high_resolution_clock::now();
+	double frame_ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(now - frame_start_).count();
+	frame_start_ = now;
+	if (frame_ns <= 0.0) return;
+	for (size_t i = 0; i < queues_.size(); i++)
+		utilization_[i] = (float)(queues_[i]->busy_ns.exchange(0) / frame_ns);
+}
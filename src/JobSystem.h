@@ -0,0 +1,76 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+//a job is any function with no arguments
+typedef std::function<void()> Job;
+
+//counts jobs which have not finished yet, so a group of jobs can be waited on
+struct JobCounter {
+	std::atomic<int> pending{ 0 };
+};
+
+//Work-stealing thread pool
+//Every thread has its own queue of jobs: queue 0 belongs to the main thread, queues
+//1..N to the worker threads. A thread pushes and pops jobs at the back of its own queue
+//and, when it is empty, steals the oldest job from the front of another queue
+//Threads never block on a JobCounter: wait() keeps running jobs until the counter is 0
+class JobSystem {
+public:
+	~JobSystem() { shutdown(); }
+
+	//starts worker threads. num_workers < 0 uses one per core, minus the main thread
+	void init(int num_workers = -1);
+	void shutdown();
+
+	//queues a job. If counter is not null, it is incremented now and decremented
+	//when the job finishes
+	void run(Job job, JobCounter* counter = nullptr);
+
+	//runs jobs on the calling thread until all jobs of counter have finished
+	void wait(JobCounter& counter);
+
+	//runs one queued job on the calling thread, if there is one
+	bool tryRunJob();
+
+	//number of queues (main thread + workers)
+	int getNumThreads() const { return (int)queues_.size(); }
+
+	//call once per frame to close frame statistics
+	void endFrame();
+	//fraction of last frame that thread i spent running jobs (0 is main thread)
+	float getUtilization(int i) const { return utilization_[i]; }
+
+private:
+	struct QueuedJob {
+		Job job;
+		JobCounter* counter;
+	};
+	struct Queue {
+		std::mutex mutex;
+		std::deque<QueuedJob> jobs;
+		std::atomic<long long> busy_ns{ 0 }; //time spent in jobs this frame
+	};
+
+	std::vector<std::unique_ptr<Queue>> queues_;
+	std::vector<std::thread> workers_;
+	std::vector<float> utilization_;
+
+	//sleeping workers wait on this until there are jobs queued
+	std::mutex wake_mutex_;
+	std::condition_variable wake_cv_;
+	std::atomic<int> queued_jobs_{ 0 };
+	std::atomic<bool> running_{ false };
+
+	std::chrono::high_resolution_clock::time_point frame_start_;
+
+	bool popJob_(int queue_index, QueuedJob& out);
+	void workerLoop_(int queue_index);
+};
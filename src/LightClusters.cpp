@@ -0,0 +1,88 @@
+#include "LightClusters.h"
+#include <algorithm>
+
+//near and far planes are read back from the perspective matrix (see mat4::perspective):
+//M[2][2] = (f + n) / (n - f) and M[3][2] = 2fn / (n - f)
+void LightClusters::buildBounds_(const lm::mat4& p) {
+	near_ = p.M[3][2] / (p.M[2][2] - 1.0f);
+	far_ = p.M[3][2] / (p.M[2][2] + 1.0f);
+
+	aabb_min_.resize(NUM_CLUSTERS);
+	aabb_max_.resize(NUM_CLUSTERS);
+	for (int z = 0; z < DIM_Z; z++) {
+		float d0 = near_ * powf(far_ / near_, (float)z / DIM_Z);
+		float d1 = near_ * powf(far_ / near_, (float)(z + 1) / DIM_Z);
+		for (int y = 0; y < DIM_Y; y++) {
+			//a point at view depth d with ndc y has view y = d * (ndc + M[2][1]) / M[1][1]
+			float y0 = (-1.0f + 2.0f * y / DIM_Y + p.M[2][1]) / p.M[1][1];
+			float y1 = (-1.0f + 2.0f * (y + 1) / DIM_Y + p.M[2][1]) / p.M[1][1];
+			for (int x = 0; x < DIM_X; x++) {
+				float x0 = (-1.0f + 2.0f * x / DIM_X + p.M[2][0]) / p.M[0][0];
+				float x1 = (-1.0f + 2.0f * (x + 1) / DIM_X + p.M[2][0]) / p.M[0][0];
+				//tile edges are straight lines from the eye, so extremes are at the slice's near or far depth
+				int c = x + DIM_X * (y + DIM_Y * z);
+				aabb_min_[c] = lm::vec3(std::min(x0 * d0, x0 * d1), std::min(y0 * d0, y0 * d1), -d1);
+				aabb_max_[c] = lm::vec3(std::max(x1 * d0, x1 * d1), std::max(y1 * d0, y1 * d1), -d0);
+			}
+		}
+	}
+}
+
+//lists, for each cluster of slice z, the lights touching it. Offsets in grid are relative
+//to the slice's own list until build concatenates them
+void LightClusters::assignSlice_(int z, const std::vector<ClusterLight>& lights) {
+	std::vector<GLuint>& out = slice_indices_[z];
+	out.clear();
+
+	//lights whose depth range overlaps the slice
+	const float slice_min_z = aabb_min_[DIM_X * DIM_Y * z].z, slice_max_z = aabb_max_[DIM_X * DIM_Y * z].z;
+	std::vector<GLuint> slice_lights;
+	for (size_t i = 0; i < lights.size(); i++) {
+		const ClusterLight& l = lights[i];
+		if (l.range < 0.0f ||
+			(l.view_center.z - l.range < slice_max_z && l.view_center.z + l.range > slice_min_z))
+			slice_lights.push_back((GLuint)i);
+	}
+
+	for (int c = DIM_X * DIM_Y * z; c < DIM_X * DIM_Y * (z + 1); c++) {
+		const lm::vec3& bmin = aabb_min_[c];
+		const lm::vec3& bmax = aabb_max_[c];
+		GLuint offset = (GLuint)out.size();
+		for (GLuint i : slice_lights) {
+			const ClusterLight& l = lights[i];
+			if (l.range >= 0.0f) {
+				//distance from sphere center to closest point of box
+				float dx = std::max(std::max(bmin.x - l.view_center.x, 0.0f), l.view_center.x - bmax.x);
+				float dy = std::max(std::max(bmin.y - l.view_center.y, 0.0f), l.view_center.y - bmax.y);
+				float dz = std::max(std::max(bmin.z - l.view_center.z, 0.0f), l.view_center.z - bmax.z);
+				if (dx * dx + dy * dy + dz * dz > l.range * l.range) continue;
+			}
+			out.push_back(i);
+		}
+		grid_[c * 2] = offset;
+		grid_[c * 2 + 1] = (GLuint)out.size() - offset;
+	}
+}
+
+void LightClusters::build(const lm::mat4& projection, const std::vector<ClusterLight>& lights, JobSystem& jobs) {
+	buildBounds_(projection);
+	grid_.resize(NUM_CLUSTERS * 2);
+	slice_indices_.resize(DIM_Z);
+
+	JobCounter counter;
+	for (int z = 0; z < DIM_Z; z++)
+		jobs.run([this, z, &lights]() { assignSlice_(z, lights); }, &counter);
+	jobs.wait(counter);
+
+	//concatenate slice lists, moving their offsets
+	indices_.clear();
+	max_lights_per_cluster_ = 0;
+	for (int z = 0; z < DIM_Z; z++) {
+		GLuint base = (GLuint)indices_.size();
+		for (int c = DIM_X * DIM_Y * z; c < DIM_X * DIM_Y * (z + 1); c++) {
+			grid_[c * 2] += base;
+			max_lights_per_cluster_ = std::max(max_lights_per_cluster_, (int)grid_[c * 2 + 1]);
+		}
+		indices_.insert(indices_.end(), slice_indices_[z].begin(), slice_indices_[z].end());
+	}
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include "includes.h"
+#include "JobSystem.h"
+#include <vector>
+
+//a light as seen by clustering: bounding sphere in view space. Lights with no range
+//(directional) touch every cluster
+struct ClusterLight {
+	lm::vec3 view_center;
+	float range; //< 0 if unbounded
+};
+
+//Froxel grid over a perspective camera: DIM_X x DIM_Y screen tiles, and DIM_Z depth
+//slices spaced exponentially between near and far plane (slice k starts at
+//near * (far / near)^(k / DIM_Z)), so clusters are roughly cubic at all depths.
+//Each frame, every cluster gets the list of lights whose sphere touches its view space
+//AABB, so that lighting only evaluates lights which can reach a pixel
+class LightClusters {
+public:
+	static const int DIM_X = 16;
+	static const int DIM_Y = 9;
+	static const int DIM_Z = 24;
+	static const int NUM_CLUSTERS = DIM_X * DIM_Y * DIM_Z;
+
+	//rebuilds cluster bounds from projection, then light lists with one job per depth slice
+	void build(const lm::mat4& projection, const std::vector<ClusterLight>& lights, JobSystem& jobs);
+
+	//per cluster (x fastest, then y, then z): offset in light indices, and light count
+	const std::vector<GLuint>& getGrid() const { return grid_; }
+	//light indices of all clusters, each cluster's list consecutive
+	const std::vector<GLuint>& getLightIndices() const { return indices_; }
+
+	float getNear() const { return near_; }
+	float getFar() const { return far_; }
+	int getMaxLightsPerCluster() const { return max_lights_per_cluster_; }
+
+private:
+	float near_ = 0.1f, far_ = 100.0f;
+	//view space bounds of each cluster
+	std::vector<lm::vec3> aabb_min_, aabb_max_;
+	std::vector<GLuint> grid_;
+	std::vector<GLuint> indices_;
+	std::vector<std::vector<GLuint>> slice_indices_; //written by each slice job
+	int max_lights_per_cluster_ = 0;
+
+	void buildBounds_(const lm::mat4& projection);
+	void assignSlice_(int z, const std::vector<ClusterLight>& lights);
+};
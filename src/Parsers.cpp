@@ -612,14 +612,13 @@ bool Parsers::parseJSONLevel(std::string filename,
     {
         //get parent entity
         int parent_entity_id = ECS.getEntity(relationship.second);
-        Entity& parent = ECS.entities[parent_entity_id];
-        int parent_transform_id = parent.components[0]; //transform component is always in slot 0
+        int parent_transform_id = ECS.getComponentID<Transform>(parent_entity_id);
         
         //get child transform
         Transform& transform_child = ECS.getComponentFromEntity<Transform>(relationship.first);
         
         //link child transform with parent id
-        transform_child.parent = parent_transform_id;
+        transform_child.setParent(parent_transform_id);
     }
     
     return true;
@@ -0,0 +1,352 @@
+#include "RenderGraph.h"
+#include "extern.h"
+#include <sstream>
+#include <algorithm>
+
+//formats render targets can use: pixel format and type to allocate them, and size
+struct TargetFormat {
+	GLenum internal_format, format, type;
+	int bytes;
+};
+static const TargetFormat TARGET_FORMATS[] = {
+	{ GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, 4 },
+	{ GL_RG16, GL_RG, GL_UNSIGNED_SHORT, 4 },
+	{ GL_R16UI, GL_RED_INTEGER, GL_UNSIGNED_SHORT, 2 },
+	{ GL_RGB16F, GL_RGB, GL_FLOAT, 6 },
+	{ GL_RGBA16F, GL_RGBA, GL_FLOAT, 8 },
+	{ GL_DEPTH24_STENCIL8, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, 4 },
+	{ GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_FLOAT, 4 },
+};
+
+static const TargetFormat* findFormat(GLenum internal_format) {
+	for (const TargetFormat& f : TARGET_FORMATS)
+		if (f.internal_format == internal_format) return &f;
+	return nullptr;
+}
+
+static bool isDepthFormat(GLenum internal_format) {
+	return internal_format == GL_DEPTH24_STENCIL8 || internal_format == GL_DEPTH_COMPONENT24;
+}
+
+int RenderGraph::bytesPerPixel(GLenum internal_format) {
+	const TargetFormat* f = findFormat(internal_format);
+	return f ? f->bytes : 0;
+}
+
+void RenderGraph::reset() {
+	resources_.clear();
+	passes_.clear();
+}
+
+void RenderGraph::release() {
+	for (auto& fb : framebuffers_)
+		glDeleteFramebuffers(1, &fb.second);
+	framebuffers_.clear();
+	for (PooledTexture& p : pool_)
+		glDeleteTextures(1, &p.texture);
+	pool_.clear();
+}
+
+int RenderGraph::createTarget(const std::string& name, const RenderTargetDesc& desc) {
+	if (!findFormat(desc.internal_format))
+		std::cerr << "ERROR: Render target " << name << " has unsupported format " << desc.internal_format << std::endl;
+	Resource r;
+	r.name = name;
+	r.desc = desc;
+	resources_.push_back(r);
+	return (int)resources_.size() - 1;
+}
+
+int RenderGraph::importTexture(const std::string& name, GLuint texture, GLsizei width, GLsizei height) {
+	Resource r;
+	r.name = name;
+	r.desc.width = width; r.desc.height = height;
+	r.imported = true;
+	r.texture = texture;
+	resources_.push_back(r);
+	return (int)resources_.size() - 1;
+}
+
+int RenderGraph::addPass(const std::string& name, std::function<void()> execute) {
+	Pass p;
+	p.name = name;
+	p.execute = execute;
+	passes_.push_back(p);
+	return (int)passes_.size() - 1;
+}
+
+//each resource is listed once per pass, e.g. depth which is both tested against and written
+static void addOnce(std::vector<int>& list, int resource) {
+	if (std::find(list.begin(), list.end(), resource) == list.end())
+		list.push_back(resource);
+}
+
+void RenderGraph::read(int pass, int resource) {
+	addOnce(passes_[pass].reads, resource);
+}
+
+void RenderGraph::write(int pass, int resource) {
+	addOnce(passes_[pass].writes, resource);
+}
+
+void RenderGraph::color(int pass, int target, bool clear) {
+	passes_[pass].colors.push_back(target);
+	passes_[pass].clear_colors.push_back(clear);
+	addOnce(passes_[pass].writes, target);
+}
+
+void RenderGraph::depth(int pass, int target, bool write, bool clear) {
+	Pass& p = passes_[pass];
+	p.depth = target;
+	p.depth_write = write || clear;
+	p.clear_depth = clear;
+	if (!clear) addOnce(p.reads, target);
+	if (p.depth_write) addOnce(p.writes, target);
+}
+
+void RenderGraph::compile() {
+	//cull, from last pass back: a pass is kept if it writes an imported resource, or a
+	//resource which a later kept pass reads
+	std::vector<char> needed(resources_.size(), 0);
+	for (int p = (int)passes_.size() - 1; p >= 0; p--) {
+		Pass& pass = passes_[p];
+		pass.culled = true;
+		for (int w : pass.writes)
+			if (resources_[w].imported || needed[w]) pass.culled = false;
+		if (pass.culled) continue;
+		for (int r : pass.reads) needed[r] = 1;
+	}
+
+	//lifetimes of transient targets, over kept passes
+	for (int p = 0; p < (int)passes_.size(); p++) {
+		const Pass& pass = passes_[p];
+		if (pass.culled) continue;
+		for (const std::vector<int>* list : { &pass.reads, &pass.writes }) {
+			for (int r : *list) {
+				if (resources_[r].first_pass < 0) resources_[r].first_pass = p;
+				resources_[r].last_pass = p;
+			}
+		}
+	}
+
+	//textures: a target takes a free pooled texture (or a new one) before its first pass,
+	//and frees it after its last, so later targets with the same description can take it
+	for (PooledTexture& t : pool_)
+		t.in_use = t.used = false;
+	stats_ = Stats();
+	for (int p = 0; p < (int)passes_.size(); p++) {
+		for (Resource& r : resources_) {
+			if (r.imported || r.first_pass != p) continue;
+			r.pooled = acquire_(r.desc);
+			r.texture = pool_[r.pooled].texture;
+		}
+		for (Resource& r : resources_) {
+			if (!r.imported && r.last_pass == p) pool_[r.pooled].in_use = false;
+		}
+	}
+	deleteUnused_();
+
+	//framebuffers of passes with attachments
+	for (Pass& pass : passes_) {
+		pass.framebuffer = 0;
+		if (pass.culled || (pass.colors.empty() && pass.depth < 0)) continue;
+		std::vector<GLuint> colors;
+		for (int c : pass.colors) colors.push_back(resources_[c].texture);
+		GLuint depth = pass.depth >= 0 ? resources_[pass.depth].texture : 0;
+		GLenum depth_format = pass.depth >= 0 ? resources_[pass.depth].desc.internal_format : GL_NONE;
+		pass.framebuffer = framebuffer_(colors, depth, depth_format);
+	}
+
+	stats_.passes = (int)passes_.size();
+	for (const Pass& pass : passes_)
+		if (pass.culled) stats_.culled_passes++;
+	for (const Resource& r : resources_)
+		if (!r.imported && r.first_pass >= 0) stats_.targets++;
+	stats_.textures = (int)pool_.size();
+	for (const PooledTexture& t : pool_)
+		stats_.texture_bytes += (size_t)t.desc.width * t.desc.height * bytesPerPixel(t.desc.internal_format);
+}
+
+int RenderGraph::acquire_(const RenderTargetDesc& desc) {
+	for (size_t i = 0; i < pool_.size(); i++) {
+		if (pool_[i].in_use || !(pool_[i].desc == desc)) continue;
+		pool_[i].in_use = pool_[i].used = true;
+		return (int)i;
+	}
+
+	PooledTexture t;
+	t.desc = desc;
+	t.in_use = t.used = true;
+	const TargetFormat* f = findFormat(desc.internal_format);
+	if (!f) f = &TARGET_FORMATS[0];
+	glGenTextures(1, &t.texture);
+	glBindTexture(GL_TEXTURE_2D, t.texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, desc.internal_format, desc.width, desc.height, 0, f->format, f->type, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, desc.filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, desc.filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	//binding went around GLSTATE
+	GLSTATE.invalidate();
+	stats_.textures_created++;
+	pool_.push_back(t);
+	return (int)pool_.size() - 1;
+}
+
+//deletes pooled textures no target used this frame, and framebuffers with them attached
+void RenderGraph::deleteUnused_() {
+	std::vector<GLuint> deleted;
+	std::vector<int> new_index(pool_.size(), -1);
+	std::vector<PooledTexture> kept;
+	for (size_t i = 0; i < pool_.size(); i++) {
+		if (pool_[i].used) {
+			new_index[i] = (int)kept.size();
+			kept.push_back(pool_[i]);
+		}
+		else deleted.push_back(pool_[i].texture);
+	}
+	if (deleted.empty()) return;
+
+	for (auto it = framebuffers_.begin(); it != framebuffers_.end();) {
+		bool stale = false;
+		for (GLuint t : it->first)
+			if (std::find(deleted.begin(), deleted.end(), t) != deleted.end()) stale = true;
+		if (stale) {
+			glDeleteFramebuffers(1, &it->second);
+			it = framebuffers_.erase(it);
+		}
+		else ++it;
+	}
+	glDeleteTextures((GLsizei)deleted.size(), deleted.data());
+	GLSTATE.invalidate();
+
+	pool_.swap(kept);
+	for (Resource& r : resources_)
+		if (r.pooled >= 0) r.pooled = new_index[r.pooled];
+}
+
+GLuint RenderGraph::framebuffer_(const std::vector<GLuint>& colors, GLuint depth, GLenum depth_format) {
+	std::vector<GLuint> key = colors;
+	key.push_back(depth);
+	auto found = framebuffers_.find(key);
+	if (found != framebuffers_.end()) return found->second;
+
+	GLuint fb;
+	glGenFramebuffers(1, &fb);
+	GLSTATE.bindFramebuffer(GL_FRAMEBUFFER, fb);
+	std::vector<GLenum> draw_buffers;
+	for (size_t i = 0; i < colors.size(); i++) {
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + (GLenum)i, GL_TEXTURE_2D, colors[i], 0);
+		draw_buffers.push_back(GL_COLOR_ATTACHMENT0 + (GLenum)i);
+	}
+	if (draw_buffers.empty()) {
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+	}
+	else glDrawBuffers((GLsizei)draw_buffers.size(), draw_buffers.data());
+	if (depth) {
+		GLenum attachment = depth_format == GL_DEPTH24_STENCIL8 ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT;
+		glFramebufferTexture2D(GL_FRAMEBUFFER, attachment, GL_TEXTURE_2D, depth, 0);
+	}
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		std::cerr << "ERROR: Render graph framebuffer is not complete" << std::endl;
+
+	framebuffers_[key] = fb;
+	return fb;
+}
+
+//clears go through glClearBuffer, so integer targets are cleared too (glClear leaves them undefined)
+void RenderGraph::clear_(const Pass& pass) {
+	GLSTATE.colorMask(true);
+	GLSTATE.depthMask(true);
+	GLSTATE.stencilMask(0xFF);
+	const GLfloat zero[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	const GLuint zero_uint[4] = { 0, 0, 0, 0 };
+	for (size_t i = 0; i < pass.colors.size(); i++) {
+		if (!pass.clear_colors[i]) continue;
+		if (resources_[pass.colors[i]].desc.internal_format == GL_R16UI)
+			glClearBufferuiv(GL_COLOR, (GLint)i, zero_uint);
+		else
+			glClearBufferfv(GL_COLOR, (GLint)i, zero);
+	}
+	if (pass.clear_depth) {
+		if (resources_[pass.depth].desc.internal_format == GL_DEPTH24_STENCIL8)
+			glClearBufferfi(GL_DEPTH_STENCIL, 0, 1.0f, 0);
+		else {
+			const GLfloat one = 1.0f;
+			glClearBufferfv(GL_DEPTH, 0, &one);
+		}
+	}
+}
+
+void RenderGraph::execute() {
+	for (const Pass& pass : passes_) {
+		if (pass.culled) continue;
+		if (pass.framebuffer) {
+			const RenderTargetDesc& size = resources_[pass.colors.empty() ? pass.depth : pass.colors[0]].desc;
+			GLSTATE.viewport(0, 0, size.width, size.height);
+			GLSTATE.bindFramebuffer(GL_FRAMEBUFFER, pass.framebuffer);
+			clear_(pass);
+		}
+		pass.execute();
+	}
+}
+
+GLuint RenderGraph::getTexture(int resource) const {
+	return resources_[resource].texture;
+}
+
+//framebuffer with only resource attached, as color or depth by format
+GLuint RenderGraph::resourceFramebuffer_(int resource) {
+	const Resource& r = resources_[resource];
+	if (isDepthFormat(r.desc.internal_format))
+		return framebuffer_({}, r.texture, r.desc.internal_format);
+	return framebuffer_({ r.texture }, 0, GL_NONE);
+}
+
+void RenderGraph::blitTo(int resource, GLuint framebuffer) {
+	const Resource& r = resources_[resource];
+	GLbitfield mask = isDepthFormat(r.desc.internal_format) ? GL_DEPTH_BUFFER_BIT : GL_COLOR_BUFFER_BIT;
+	GLSTATE.bindFramebuffer(GL_READ_FRAMEBUFFER, resourceFramebuffer_(resource));
+	GLSTATE.bindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer);
+	glBlitFramebuffer(0, 0, r.desc.width, r.desc.height, 0, 0, r.desc.width, r.desc.height, mask, GL_NEAREST);
+}
+
+void RenderGraph::blit(int source, int destination) {
+	const Resource& r = resources_[source];
+	GLbitfield mask = GL_COLOR_BUFFER_BIT;
+	if (r.desc.internal_format == GL_DEPTH24_STENCIL8) mask = GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT;
+	else if (isDepthFormat(r.desc.internal_format)) mask = GL_DEPTH_BUFFER_BIT;
+	GLSTATE.bindFramebuffer(GL_READ_FRAMEBUFFER, resourceFramebuffer_(source));
+	GLSTATE.bindFramebuffer(GL_DRAW_FRAMEBUFFER, resourceFramebuffer_(destination));
+	glBlitFramebuffer(0, 0, r.desc.width, r.desc.height, 0, 0, r.desc.width, r.desc.height, mask, GL_NEAREST);
+}
+
+std::string RenderGraph::toDot() const {
+	std::ostringstream dot;
+	dot << "digraph render_graph {\n";
+	dot << "\trankdir=LR;\n";
+	for (size_t p = 0; p < passes_.size(); p++) {
+		const Pass& pass = passes_[p];
+		dot << "\tpass" << p << " [shape=box, label=\"" << p << ": " << pass.name << "\"";
+		if (pass.culled) dot << ", style=dashed, color=gray";
+		dot << "];\n";
+	}
+	for (size_t r = 0; r < resources_.size(); r++) {
+		const Resource& res = resources_[r];
+		dot << "\tres" << r << " [label=\"" << res.name << "\\n" << res.desc.width << "x" << res.desc.height;
+		if (res.imported)
+			dot << "\\nimported\", style=filled, fillcolor=lightgray];\n";
+		else
+			dot << " 0x" << std::hex << res.desc.internal_format << std::dec << "\\npasses " << res.first_pass << "-" << res.last_pass
+				<< "\\ntexture " << res.texture << "\"];\n";
+	}
+	for (size_t p = 0; p < passes_.size(); p++) {
+		const Pass& pass = passes_[p];
+		for (int r : pass.reads) dot << "\tres" << r << " -> pass" << p << ";\n";
+		for (int r : pass.writes) dot << "\tpass" << p << " -> res" << r << ";\n";
+	}
+	dot << "}\n";
+	return dot.str();
+}
@@ -0,0 +1,131 @@
+#pragma once
+#include "includes.h"
+#include <vector>
+#include <map>
+#include <string>
+#include <functional>
+
+//size and format of a render target. Targets with equal descriptions can share a texture
+struct RenderTargetDesc {
+	GLsizei width = 1, height = 1;
+	GLenum internal_format = GL_RGBA8; //e.g. GL_RGB16F, GL_R16UI or GL_DEPTH24_STENCIL8
+	GLenum filter = GL_NEAREST; //min and mag filter, wrap is always clamp to edge
+	bool operator==(const RenderTargetDesc& o) const {
+		return width == o.width && height == o.height && internal_format == o.internal_format && filter == o.filter;
+	}
+};
+
+//Frame described as passes which declare the targets they read and write, rebuilt every
+//frame. Targets created by the graph are transient: they only exist from the first to the
+//last pass using them, and take a texture from a pool kept across frames. A texture is
+//shared by targets with the same description whose lifetimes do not overlap, and pool
+//textures not used by a frame are deleted, so targets sized to the viewport follow resizes.
+//Passes whose outputs nothing reads are culled, unless they write an imported resource
+//(textures owned elsewhere, e.g. shadow maps or the screen). Passes run in the order they
+//were added. A pass with attachments runs with a framebuffer of them bound (cached by
+//attachments), viewport set to their size, and cleared attachments cleared
+class RenderGraph {
+public:
+	~RenderGraph() { release(); }
+
+	//forgets passes and targets of last frame, keeping pooled textures
+	void reset();
+	//deletes pooled textures and framebuffers
+	void release();
+
+	//returns id of a transient target, or of a resource owned outside the graph (texture 0 is the screen)
+	int createTarget(const std::string& name, const RenderTargetDesc& desc);
+	int importTexture(const std::string& name, GLuint texture, GLsizei width, GLsizei height);
+
+	//adds a pass and returns its id
+	int addPass(const std::string& name, std::function<void()> execute);
+	//pass samples resource
+	void read(int pass, int resource);
+	//pass draws into resource, which it binds itself (for imported resources)
+	void write(int pass, int resource);
+	//next color attachment of pass. Cleared to zero before pass if clear
+	void color(int pass, int target, bool clear = false);
+	//depth (and stencil, by format) attachment of pass. If not write, pass only tests against
+	//it. Cleared to 1 (stencil 0) before pass if clear, otherwise pass uses earlier contents
+	void depth(int pass, int target, bool write, bool clear = false);
+
+	//culls passes and gives each target its texture, then runs passes
+	void compile();
+	void execute();
+
+	//texture of a resource, valid from compile until reset
+	GLuint getTexture(int resource) const;
+	const RenderTargetDesc& getDesc(int resource) const { return resources_[resource].desc; }
+	//copies resource (color or depth, by format) into a framebuffer of same size
+	void blitTo(int resource, GLuint framebuffer);
+	//copies target into another of same size and format, depth and stencil both for depth
+	//formats. Lets a pass attach a copy of a target it samples, as GL has undefined results
+	//when a texture is attached and sampled by the same draw
+	void blit(int source, int destination);
+
+	//size of one pixel of a format, for memory stats
+	static int bytesPerPixel(GLenum internal_format);
+
+	//last compiled frame, for debug
+	struct Stats {
+		int passes = 0;
+		int culled_passes = 0;
+		int targets = 0;
+		int textures = 0; //fewer than targets when targets share textures
+		size_t texture_bytes = 0; //of all pooled textures
+		int textures_created = 0; //this frame, e.g. after a resize
+	};
+	const Stats& getStats() const { return stats_; }
+	int getNumPasses() const { return (int)passes_.size(); }
+	const std::string& getPassName(int pass) const { return passes_[pass].name; }
+	bool isPassCulled(int pass) const { return passes_[pass].culled; }
+	int getNumResources() const { return (int)resources_.size(); }
+	const std::string& getResourceName(int resource) const { return resources_[resource].name; }
+	bool isImported(int resource) const { return resources_[resource].imported; }
+	//first and last pass using a transient target, -1 if culled with its passes
+	int getFirstPass(int resource) const { return resources_[resource].first_pass; }
+	int getLastPass(int resource) const { return resources_[resource].last_pass; }
+
+	//passes and resources of last compiled frame in graphviz dot format, with each target's
+	//lifetime and texture, and culled passes dashed
+	std::string toDot() const;
+
+private:
+	struct Resource {
+		std::string name;
+		RenderTargetDesc desc;
+		bool imported = false;
+		GLuint texture = 0; //imported texture, or pooled texture after compile
+		int pooled = -1;
+		int first_pass = -1, last_pass = -1;
+	};
+	struct Pass {
+		std::string name;
+		std::function<void()> execute;
+		std::vector<int> reads, writes; //writes include attachments
+		std::vector<int> colors;
+		std::vector<bool> clear_colors;
+		int depth = -1;
+		bool depth_write = false, clear_depth = false;
+		bool culled = false;
+		GLuint framebuffer = 0;
+	};
+	struct PooledTexture {
+		GLuint texture = 0;
+		RenderTargetDesc desc;
+		bool in_use = false; //by a target alive at current pass of allocation
+		bool used = false; //by any target this frame
+	};
+	std::vector<Resource> resources_;
+	std::vector<Pass> passes_;
+	std::vector<PooledTexture> pool_;
+	//attachments (colors, then depth) to framebuffer
+	std::map<std::vector<GLuint>, GLuint> framebuffers_;
+	Stats stats_;
+
+	int acquire_(const RenderTargetDesc& desc);
+	void deleteUnused_();
+	GLuint framebuffer_(const std::vector<GLuint>& colors, GLuint depth, GLenum depth_format);
+	GLuint resourceFramebuffer_(int resource);
+	void clear_(const Pass& pass);
+};
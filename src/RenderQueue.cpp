@@ -0,0 +1,56 @@
+#include "RenderQueue.h"
+#include <cstring>
+#include <utility>
+
+//depth is quantized with the top 16 bits of its float representation, which for
+//positive floats increase with the value (8 bits exponent, 7 bits mantissa). So precision
+//is relative to distance, and any range fits in 16 bits
+uint64_t RenderQueue::makeKey(int pass, int shader, int material, int geometry, float view_depth) {
+	if (!(view_depth > 0.0f)) view_depth = 0.0f; //also catches NaN
+	uint32_t depth_bits;
+	memcpy(&depth_bits, &view_depth, sizeof(depth_bits));
+
+	return ((uint64_t)(pass & 0xF) << 60) |
+		((uint64_t)(shader & 0xFFF) << 48) |
+		((uint64_t)(material & 0xFFFF) << 32) |
+		((uint64_t)(geometry & 0xFFFF) << 16) |
+		(uint64_t)(depth_bits >> 16);
+}
+
+void RenderQueue::sort() {
+	const size_t n = items_.size();
+	if (n < 2) return;
+	scratch_.resize(n);
+
+	//histograms of all 8 bytes in one pass over the keys
+	size_t counts[8][256];
+	memset(counts, 0, sizeof(counts));
+	for (size_t i = 0; i < n; i++) {
+		uint64_t key = items_[i].key;
+		for (int b = 0; b < 8; b++)
+			counts[b][(key >> (b * 8)) & 0xFF]++;
+	}
+
+	DrawItem* src = items_.data();
+	DrawItem* dst = scratch_.data();
+	for (int b = 0; b < 8; b++) {
+		size_t* count = counts[b];
+		//all keys have same value for this byte: order would not change
+		if (count[(src[0].key >> (b * 8)) & 0xFF] == n) continue;
+
+		//counts to start offsets
+		size_t offset = 0;
+		for (int d = 0; d < 256; d++) {
+			size_t c = count[d];
+			count[d] = offset;
+			offset += c;
+		}
+		for (size_t i = 0; i < n; i++)
+			dst[count[(src[i].key >> (b * 8)) & 0xFF]++] = src[i];
+		std::swap(src, dst);
+	}
+
+	//odd number of passes leaves result in scratch
+	if (src != items_.data())
+		items_.swap(scratch_);
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+
+//passes which sort draws, highest bits of key
+enum RenderPassType {
+	RenderPassShadow,
+	RenderPassGBuffer
+};
+
+//a draw of one mesh (index in Mesh array) with its sort key
+struct DrawItem {
+	uint64_t key;
+	int mesh;
+};
+
+//List of draws of one view, rebuilt every frame and sorted by a 64 bit key so that
+//draws sharing state are consecutive. From most to least significant bits:
+//   pass (4) | shader (12) | material (16) | geometry (16) | view depth (16)
+//so within the same state, draws go front to back (helps early depth test)
+class RenderQueue {
+public:
+	static uint64_t makeKey(int pass, int shader, int material, int geometry, float view_depth);
+
+	void clear() { items_.clear(); }
+	void add(uint64_t key, int mesh) { items_.push_back({ key, mesh }); }
+
+	//LSD radix sort, 8 bits per pass. Stable, and skips bytes which are the same in all keys
+	void sort();
+
+	const std::vector<DrawItem>& getItems() const { return items_; }
+
+private:
+	std::vector<DrawItem> items_;
+	std::vector<DrawItem> scratch_;
+};
@@ -13,6 +13,20 @@ void ScriptSystem::update(float dt) {
 		scr->update(dt);
 }
 
+ComponentSignature ScriptSystem::getReads() const {
+	ComponentSignature sig = 0;
+	for (auto scr : scripts_)
+		sig |= scr->reads;
+	return sig;
+}
+
+ComponentSignature ScriptSystem::getWrites() const {
+	ComponentSignature sig = 0;
+	for (auto scr : scripts_)
+		sig |= scr->writes;
+	return sig;
+}
+
 //register new script and pass script a pointer to control system
 void ScriptSystem::registerScript(Script* new_script) {
 	scripts_.push_back(new_script); //add to list
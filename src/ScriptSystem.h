@@ -22,6 +22,11 @@ public:
 	//sets pointer to control system
 	void setInput(ControlSystem* cont_sys) { input_ = cont_sys; };
 
+	//component types update() reads and writes, set by derived script constructors so the
+	//frame graph can run other systems alongside scripts. Defaults to everything
+	ComponentSignature reads = ALL_COMPONENTS;
+	ComponentSignature writes = ALL_COMPONENTS;
+
 protected:
 	int owner_; //id of entity which owns this script
 	ControlSystem* input_ = nullptr; //pointer to control system
@@ -38,6 +43,11 @@ public:
 
 	//update all scripts 
 	void update(float dt);
+
+	//component types read and written by all registered scripts together
+	//scripts must be registered before the frame graph is built
+	ComponentSignature getReads() const;
+	ComponentSignature getWrites() const;
 	
 	//register new script
 	void registerScript(Script* new_script);
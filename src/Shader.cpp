@@ -1,7 +1,9 @@
 #include "Shader.h"
+#include "extern.h"
 #include <vector>
 #include <fstream>
 #include <sstream>
+#include <cstring>
 
 
 std::vector<std::string> &split(const std::string &s, char delim, std::vector<std::string> &elems) {
@@ -21,12 +23,25 @@ std::vector<std::string> split(const std::string &s, char delim) {
 
 Shader::Shader() {}
 
+//true if data differs from the last value set for uniform id, which it then replaces
+bool Shader::uniformChanged_(UniformID id, const void* data, size_t size) {
+    GLfloat* cached = &uniform_values_[id * 16];
+    bool changed = !uniform_value_set_[id] || memcmp(cached, data, size) != 0;
+    if (changed) {
+        memcpy(cached, data, size);
+        uniform_value_set_[id] = 1;
+    }
+    GLSTATE.count(GLCallUniform, changed);
+    return changed;
+}
+
 //uniform setters
 //int
 bool Shader::setUniform(UniformID id, const int data) {
     GLint loc = getUniformLocation(id);
     if (loc != -1) {
-        glUniform1i(loc, data);
+        if (uniformChanged_(id, &data, sizeof(data)))
+            glUniform1i(loc, data);
         return true;
     }
     return false;
@@ -35,7 +50,19 @@ bool Shader::setUniform(UniformID id, const int data) {
 bool Shader::setUniform(UniformID id, const float data) {
     GLint loc = getUniformLocation(id);
     if (loc != -1) {
-        glUniform1f(loc, data);
+        if (uniformChanged_(id, &data, sizeof(data)))
+            glUniform1f(loc, data);
+        return true;
+    }
+    return false;
+}
+
+//vec2
+bool Shader::setUniform(UniformID id, const lm::vec2& data) {
+    GLint loc = getUniformLocation(id);
+    if (loc != -1) {
+        if (uniformChanged_(id, data.value_, 2 * sizeof(GLfloat)))
+            glUniform2fv(loc, 1, data.value_);
         return true;
     }
     return false;
@@ -45,7 +72,8 @@ bool Shader::setUniform(UniformID id, const float data) {
 bool Shader::setUniform(UniformID id, const lm::vec3& data) {
     GLint loc = getUniformLocation(id);
     if (loc != -1) {
-        glUniform3fv(loc, 1, data.value_);
+        if (uniformChanged_(id, data.value_, 3 * sizeof(GLfloat)))
+            glUniform3fv(loc, 1, data.value_);
         return true;
     }
     return false;
@@ -55,7 +83,8 @@ bool Shader::setUniform(UniformID id, const lm::vec3& data) {
 bool Shader::setUniform(UniformID id, const lm::mat4& data) {
     GLint loc = getUniformLocation(id);
     if (loc != -1) {
-        glUniformMatrix4fv(loc, 1, GL_FALSE, data.m);
+        if (uniformChanged_(id, data.m, 16 * sizeof(GLfloat)))
+            glUniformMatrix4fv(loc, 1, GL_FALSE, data.m);
         return true;
     }
     return false;
@@ -65,37 +94,42 @@ bool Shader::setUniform(UniformID id, const lm::mat4& data) {
 bool Shader::setUniformBlock(UniformID id, const int binding_point) {
     GLint loc = getUniformLocation(id);
     if (loc != -1) {
-        glUniformBlockBinding(program, loc, binding_point);
+        if (uniformChanged_(id, &binding_point, sizeof(binding_point)))
+            glUniformBlockBinding(program, loc, binding_point);
         return true;
     }
     return false;
 }
 
 //texture
-bool Shader::setTexture(UniformID id, GLuint tex_id, GLuint unit) {
-    //get texture id and bind it
-    glActiveTexture(GL_TEXTURE0 + unit);
-    glBindTexture(GL_TEXTURE_2D, tex_id);
-    // tell sampler which slot its in
-    GLint loc = getUniformLocation(id);
-    if (loc != -1) {
-        glUniform1i(loc, unit);
-        return true;
-    }
-    return false;
+bool Shader::setTexture(UniformID id, GLuint tex_id) {
+    //sampler already reads its unit (set in initUniforms_), so just bind texture there
+    GLint unit = sampler_units_[id];
+    if (unit == -1) return false;
+    GLSTATE.bindTexture((GLuint)unit, GL_TEXTURE_2D, tex_id);
+    return true;
 }
 //texture cube
-bool Shader::setTextureCube(UniformID id, GLuint tex_id, GLuint unit) {
-    //get texture id and bind it
-    glActiveTexture(GL_TEXTURE0 + unit);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, tex_id);
-    // tell sampler which slot its in
-    GLint loc = getUniformLocation(id);
-    if (loc != -1) {
-        glUniform1i(loc, unit);
-        return true;
-    }
-    return false;
+bool Shader::setTextureCube(UniformID id, GLuint tex_id) {
+    //sampler already reads its unit (set in initUniforms_), so just bind texture there
+    GLint unit = sampler_units_[id];
+    if (unit == -1) return false;
+    GLSTATE.bindTexture((GLuint)unit, GL_TEXTURE_CUBE_MAP, tex_id);
+    return true;
+}
+//texture array
+bool Shader::setTextureArray(UniformID id, GLuint tex_id) {
+    GLint unit = sampler_units_[id];
+    if (unit == -1) return false;
+    GLSTATE.bindTexture((GLuint)unit, GL_TEXTURE_2D_ARRAY, tex_id);
+    return true;
+}
+//texture buffer
+bool Shader::setTextureBuffer(UniformID id, GLuint tex_id) {
+    GLint unit = sampler_units_[id];
+    if (unit == -1) return false;
+    GLSTATE.bindTexture((GLuint)unit, GL_TEXTURE_BUFFER, tex_id);
+    return true;
 }
 
 
@@ -110,6 +144,7 @@ std::string Shader::readFile(std::string filename) {
 
 Shader::Shader(std::string vertSource, std::string fragSource) {
     
+	name = vertSource + ", " + fragSource;
 	std::string vertexShaderSourceCode=readFile(vertSource);
 	std::string fragmentShaderSourceCode=readFile(fragSource);
     makeShaderProgram(makeVertexShader(vertexShaderSourceCode.c_str()), makeFragmentShader(fragmentShaderSourceCode.c_str()));
@@ -231,28 +266,95 @@ GLint Shader::bindAttribute(const char* attribute_name) {
     else return attribute_ID;
 }
 
-//first initializes uniform location vector, then maps uniform locations
-//to each id, using the 
+static bool isSamplerType_(GLenum type) {
+	switch (type) {
+	case GL_SAMPLER_1D: case GL_SAMPLER_2D: case GL_SAMPLER_3D: case GL_SAMPLER_CUBE:
+	case GL_SAMPLER_1D_SHADOW: case GL_SAMPLER_2D_SHADOW: case GL_SAMPLER_CUBE_SHADOW:
+	case GL_SAMPLER_2D_ARRAY: case GL_SAMPLER_2D_ARRAY_SHADOW: case GL_SAMPLER_BUFFER:
+	case GL_SAMPLER_2D_MULTISAMPLE: case GL_INT_SAMPLER_2D: case GL_UNSIGNED_INT_SAMPLER_2D:
+	case GL_INT_SAMPLER_BUFFER: case GL_UNSIGNED_INT_SAMPLER_BUFFER:
+		return true;
+	default:
+		return false;
+	}
+}
+
+//reflects the linked program: every active uniform block and uniform is read once, and
+//those named in uniform_string2id_ and uniformblock_string2id_ get their location (or block
+//index) stored by enum. Each sampler (or sampler array element) is given its own texture
+//unit here, so that drawing only binds textures and never sets sampler uniforms
 void Shader::initUniforms_() {
     
 	//initialize uniform location vector to all -1 (not found) 
 	uniform_locations_ = std::vector<GLuint>(UNIFORMS_COUNT, -1);
+	sampler_units_.assign(UNIFORMS_COUNT, -1);
+	uniform_values_.assign(UNIFORMS_COUNT * 16, 0.0f);
+	uniform_value_set_.assign(UNIFORMS_COUNT, 0);
+	uniforms_.clear();
+	blocks_.clear();
+
+	GLchar name_buffer[256];
+
+	//uniform blocks
+	GLint num_blocks = 0;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_BLOCKS, &num_blocks);
+	for (GLint b = 0; b < num_blocks; b++) {
+		ShaderUniformBlock block;
+		glGetActiveUniformBlockName(program, b, sizeof(name_buffer), nullptr, name_buffer);
+		glGetActiveUniformBlockiv(program, b, GL_UNIFORM_BLOCK_DATA_SIZE, &block.data_size);
+		block.name = name_buffer;
+		blocks_.push_back(block);
 
-	//iterate map of all possible uniforms, asking shader if it has them
-	for (std::pair<std::string, UniformID> element : uniform_string2id_)
-	{
-		std::string uniform_name = element.first;
-		UniformID uniform_id = element.second;
-		uniform_locations_[uniform_id] = glGetUniformLocation(program, uniform_name.c_str());
+		auto it = uniformblock_string2id_.find(block.name);
+		if (it != uniformblock_string2id_.end())
+			uniform_locations_[it->second] = b;
 	}
-    
-    //now do the same for uniform blocks
-    for (std::pair<std::string, UniformID> element : uniformblock_string2id_)
-    {
-        std::string uniform_name = element.first;
-        UniformID uniform_id = element.second;
-        uniform_locations_[uniform_id] = glGetUniformBlockIndex(program, uniform_name.c_str());
-    }
+
+	//uniforms, in default block or any uniform block
+	GLint num_uniforms = 0;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &num_uniforms);
+	GLint next_unit = 0;
+	GLSTATE.useProgram(program);
+	auto mapUniform = [this](const std::string& uniform_name, GLint location, GLint unit) {
+		if (unit != -1) glUniform1i(location, unit);
+		auto it = uniform_string2id_.find(uniform_name);
+		if (it != uniform_string2id_.end()) {
+			uniform_locations_[it->second] = location;
+			sampler_units_[it->second] = unit;
+		}
+	};
+	for (GLint i = 0; i < num_uniforms; i++) {
+		ShaderUniform u;
+		GLuint index = (GLuint)i;
+		glGetActiveUniform(program, index, sizeof(name_buffer), nullptr, &u.array_size, &u.type, name_buffer);
+		glGetActiveUniformsiv(program, 1, &index, GL_UNIFORM_BLOCK_INDEX, &u.block);
+		glGetActiveUniformsiv(program, 1, &index, GL_UNIFORM_OFFSET, &u.block_offset);
+		u.name = name_buffer;
+		if (u.name.size() > 3 && u.name.compare(u.name.size() - 3, 3, "[0]") == 0)
+			u.name.resize(u.name.size() - 3);
+		u.location = -1;
+		u.sampler_unit = -1;
+
+		if (u.block == -1) {
+			u.location = glGetUniformLocation(program, name_buffer);
+			if (isSamplerType_(u.type)) {
+				u.sampler_unit = next_unit;
+				next_unit += u.array_size;
+			}
+			//whole uniform, then each element of an array (named "name[k]" in uniform_string2id_)
+			mapUniform(u.name, u.location, u.sampler_unit);
+			for (GLint k = 0; u.array_size > 1 && k < u.array_size; k++) {
+				std::string element = u.name + "[" + std::to_string(k) + "]";
+				mapUniform(element, glGetUniformLocation(program, element.c_str()), u.sampler_unit == -1 ? -1 : u.sampler_unit + k);
+			}
+		}
+		uniforms_.push_back(u);
+	}
+
+	GLint max_units = 0;
+	glGetIntegerv(GL_MAX_COMBINED_TEXTURE_IMAGE_UNITS, &max_units);
+	if (next_unit > max_units)
+		std::cerr << "ERROR: Shader " << name << " has " << next_unit << " samplers, more than " << max_units << " texture units" << std::endl;
 }
 
 //Returns location of uniform with given enum
@@ -260,9 +362,25 @@ GLuint Shader::getUniformLocation(UniformID name) {
 	return uniform_locations_[name];
 }
 
+bool Shader::checkUniformBlock(UniformID id, GLint cpp_size, std::initializer_list<BlockMemberOffset> members) {
+	GLint block = (GLint)getUniformLocation(id);
+	if (block == -1) return true;
 
-
-
-
-
-
+	bool ok = true;
+	if (blocks_[block].data_size != cpp_size) {
+		std::cerr << "ERROR: Shader " << name << " block " << blocks_[block].name << " is " << blocks_[block].data_size
+			<< " bytes, but C++ struct is " << cpp_size << std::endl;
+		ok = false;
+	}
+	for (const BlockMemberOffset& member : members) {
+		for (const ShaderUniform& u : uniforms_) {
+			if (u.block != block || u.name != member.name) continue;
+			if (u.block_offset != member.offset) {
+				std::cerr << "ERROR: Shader " << name << " block member " << member.name << " is at offset " << u.block_offset
+					<< ", but in C++ struct at " << member.offset << std::endl;
+				ok = false;
+			}
+		}
+	}
+	return ok;
+}
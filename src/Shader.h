@@ -3,6 +3,7 @@
 #include "includes.h"
 #include <unordered_map>
 #include <vector>
+#include <initializer_list>
 
 //Uniform IDs are global so that we can access them in Graphics System
 enum UniformID {
@@ -23,6 +24,11 @@ enum UniformID {
 	U_USE_REFLECTION_MAP,
 	U_NUM_LIGHTS,
     U_LIGHTS_UBO,
+    U_VIEW_UBO,
+    U_DRAW_UBO,
+    U_MATERIALS_UBO,
+    U_SHADOW_LAYERS_UBO,
+    U_SHADOW_TILES_UBO,
 	U_SCREEN_TEXTURE,
 	U_NEAR_PLANE,
 	U_FAR_PLANE,
@@ -31,19 +37,34 @@ enum UniformID {
     U_TEX_POSITION,
     U_TEX_NORMAL,
     U_TEX_ALBEDO,
-    U_SHADOW_MAP0,
-    U_SHADOW_MAP1,
-    U_SHADOW_MAP2,
-    U_SHADOW_MAP3,
-    U_SHADOW_MAP4,
-    U_SHADOW_MAP5,
-    U_SHADOW_MAP6,
-    U_SHADOW_MAP7,
+    U_SHADOW_ATLAS,
 	U_BLOOM,
 	U_TEX_AMBIENT,
 	U_TEX_PHONG,
 	U_TEX_BLOOM,
 	U_TEX_BACKGROUND,
+	U_ICON,
+	U_SIZE_SCALE,
+	U_CENTER_MOD,
+	U_DIFFUSE_ARRAY0,
+	U_DIFFUSE_ARRAY1,
+	U_DIFFUSE_ARRAY2,
+	U_DIFFUSE_ARRAY3,
+	U_VIEW,
+	U_LIGHTS,
+	U_CLUSTER_GRID,
+	U_CLUSTER_LIGHTS,
+	U_CLUSTER_DIMS,
+	U_CLUSTER_DEPTH,
+	U_LIGHT_HEATMAP,
+	U_LIGHT_INDEX,
+	U_TEX_DEPTH,
+	U_TEX_MATERIAL,
+	U_INV_VP,
+	U_TEXEL_SIZE,
+	U_BLOOM_RADIUS,
+	U_BLOOM_INTENSITY,
+	U_NUM_LAYERS,
 	UNIFORMS_COUNT
 };
 
@@ -74,31 +95,85 @@ const std::unordered_map<std::string, UniformID> uniform_string2id_ = {
     { "u_tex_position", U_TEX_POSITION },
     { "u_tex_normal", U_TEX_NORMAL },
     { "u_tex_albedo", U_TEX_ALBEDO },
-    { "u_shadow_map[0]", U_SHADOW_MAP0 },
-    { "u_shadow_map[1]", U_SHADOW_MAP1 },
-    { "u_shadow_map[2]", U_SHADOW_MAP2 },
-    { "u_shadow_map[3]", U_SHADOW_MAP3 },
-    { "u_shadow_map[4]", U_SHADOW_MAP4 },
-    { "u_shadow_map[5]", U_SHADOW_MAP5 },
-    { "u_shadow_map[6]", U_SHADOW_MAP6 },
-    { "u_shadow_map[7]", U_SHADOW_MAP7 },
+    { "u_shadow_atlas", U_SHADOW_ATLAS },
 	{ "u_bloom", U_BLOOM },
 	{ "u_tex_ambient", U_TEX_AMBIENT },
 	{ "u_tex_phong", U_TEX_PHONG },
 	{ "u_tex_bloom", U_TEX_BLOOM },
 	{ "u_tex_background", U_TEX_BACKGROUND },
+	{ "u_icon", U_ICON },
+	{ "u_size_scale", U_SIZE_SCALE },
+	{ "u_center_mod", U_CENTER_MOD },
+	{ "u_diffuse_arrays[0]", U_DIFFUSE_ARRAY0 },
+	{ "u_diffuse_arrays[1]", U_DIFFUSE_ARRAY1 },
+	{ "u_diffuse_arrays[2]", U_DIFFUSE_ARRAY2 },
+	{ "u_diffuse_arrays[3]", U_DIFFUSE_ARRAY3 },
+	{ "u_view", U_VIEW },
+	{ "u_lights", U_LIGHTS },
+	{ "u_cluster_grid", U_CLUSTER_GRID },
+	{ "u_cluster_lights", U_CLUSTER_LIGHTS },
+	{ "u_cluster_dims", U_CLUSTER_DIMS },
+	{ "u_cluster_depth", U_CLUSTER_DEPTH },
+	{ "u_light_heatmap", U_LIGHT_HEATMAP },
+	{ "u_light_index", U_LIGHT_INDEX },
+	{ "u_tex_depth", U_TEX_DEPTH },
+	{ "u_tex_material", U_TEX_MATERIAL },
+	{ "u_inv_vp", U_INV_VP },
+	{ "u_texel_size", U_TEXEL_SIZE },
+	{ "u_bloom_radius", U_BLOOM_RADIUS },
+	{ "u_bloom_intensity", U_BLOOM_INTENSITY },
+	{ "u_num_layers", U_NUM_LAYERS },
     
 };
 
 const std::unordered_map<std::string, UniformID> uniformblock_string2id_ = {
     { "u_lights_ubo", U_LIGHTS_UBO },
+    { "u_view_ubo", U_VIEW_UBO },
+    { "u_draw_ubo", U_DRAW_UBO },
+    { "u_materials_ubo", U_MATERIALS_UBO },
+    { "u_shadow_layers_ubo", U_SHADOW_LAYERS_UBO },
+    { "u_shadow_tiles_ubo", U_SHADOW_TILES_UBO },
+};
+
+//active uniform of a linked program, found by reflection. Uniforms in a block have no
+//location but an offset in the block. Arrays are one entry, named without "[0]"
+struct ShaderUniform {
+	std::string name;
+	GLenum type;
+	GLint array_size;
+	GLint location; //-1 in a block
+	GLint block; //index in Shader blocks, -1 for default block
+	GLint block_offset; //bytes, -1 for default block
+	GLint sampler_unit; //unit of first element, -1 if not a sampler
+};
+
+struct ShaderUniformBlock {
+	std::string name;
+	GLint data_size; //bytes, std140 padding included
+};
+
+//offset of a member in the C++ struct which fills a uniform block, see checkUniformBlock
+struct BlockMemberOffset {
+	const char* name;
+	GLint offset;
 };
 
 class Shader {
 private:
-	//stores, for each uniform enum, it's location
+	//stores, for each uniform enum, it's location (uniform block index for blocks)
 	std::vector<GLuint> uniform_locations_;
+	//for each sampler uniform enum, texture unit it reads (-1 if not a sampler)
+	std::vector<GLint> sampler_units_;
+	//reflection of all active uniforms and blocks, read once after linking
+	std::vector<ShaderUniform> uniforms_;
+	std::vector<ShaderUniformBlock> blocks_;
 	void initUniforms_();
+
+	//last value set for each uniform enum (up to 16 floats), so that setting the same value
+	//again is skipped. Values are program state, so they survive switching shaders
+	std::vector<GLfloat> uniform_values_;
+	std::vector<char> uniform_value_set_;
+	bool uniformChanged_(UniformID id, const void* data, size_t size);
     
 public:
     GLuint program;
@@ -117,14 +192,25 @@ public:
     
 	//
     GLuint getUniformLocation(UniformID name);
+	const std::vector<ShaderUniform>& getUniforms() const { return uniforms_; }
+	const std::vector<ShaderUniformBlock>& getUniformBlocks() const { return blocks_; }
+
+	//checks a block against the C++ struct that fills it: its std140 size must match cpp_size,
+	//and each listed member must be at the given offset. Prints each mismatch, and returns
+	//false if there is any. Blocks the shader does not use always pass
+	bool checkUniformBlock(UniformID id, GLint cpp_size, std::initializer_list<BlockMemberOffset> members = {});
     
     bool setUniform(UniformID id, const int data);
     bool setUniform(UniformID id, const float data);
+    bool setUniform(UniformID id, const lm::vec2& data);
     bool setUniform(UniformID id, const lm::vec3& data);
     bool setUniform(UniformID id, const lm::mat4& data);
     bool setUniformBlock(UniformID id, const int binding_point);
-    bool setTexture(UniformID id, GLuint tex_id, GLuint unit);
-    bool setTextureCube(UniformID id, GLuint tex_id, GLuint unit);
+    //bind texture to the unit given to its sampler when linking
+    bool setTexture(UniformID id, GLuint tex_id);
+    bool setTextureCube(UniformID id, GLuint tex_id);
+    bool setTextureArray(UniformID id, GLuint tex_id);
+    bool setTextureBuffer(UniformID id, GLuint tex_id);
     
     
 };
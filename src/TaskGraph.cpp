@@ -0,0 +1,113 @@
+#include "TaskGraph.h"
+#include "extern.h"
+#include <algorithm>
+
+int TaskGraph::addTask(const std::string& name, ComponentSignature reads, ComponentSignature writes,
+	bool main_thread, std::function<void()> func) {
+	std::unique_ptr<Task> task(new Task());
+	task->name = name;
+	task->reads = reads;
+	task->writes = writes;
+	task->main_thread = main_thread;
+	task->func = func;
+	tasks_.push_back(std::move(task));
+	built_ = false;
+	return (int)tasks_.size() - 1;
+}
+
+void TaskGraph::addDependency(int before, int after) {
+	extra_dependencies_.push_back(std::make_pair(before, after));
+	built_ = false;
+}
+
+void TaskGraph::addEdge_(int before, int after) {
+	std::vector<int>& next = tasks_[before]->next;
+	if (std::find(next.begin(), next.end(), after) != next.end()) return;
+	next.push_back(after);
+	tasks_[after]->num_dependencies++;
+}
+
+//create edges from declared component access
+void TaskGraph::build_() {
+	for (auto& t : tasks_) {
+		t->next.clear();
+		t->num_dependencies = 0;
+	}
+
+	int last_main_thread = -1;
+	for (int j = 0; j < (int)tasks_.size(); j++) {
+		Task& b = *tasks_[j];
+		for (int i = 0; i < j; i++) {
+			Task& a = *tasks_[i];
+			bool conflict = (a.writes & (b.reads | b.writes)) || (a.reads & b.writes);
+			if (conflict) addEdge_(i, j);
+		}
+		//main thread tasks share GL state, so keep their order
+		if (b.main_thread) {
+			if (last_main_thread != -1) addEdge_(last_main_thread, j);
+			last_main_thread = j;
+		}
+	}
+	for (auto& d : extra_dependencies_)
+		addEdge_(d.first, d.second);
+
+	built_ = true;
+}
+
+void TaskGraph::schedule_(int i, JobSystem& jobs) {
+	if (tasks_[i]->main_thread) {
+		std::lock_guard<std::mutex> lock(main_mutex_);
+		main_ready_.push_back(i);
+	}
+	else {
+		jobs.run([this, i, &jobs]() { execute_(i, jobs); });
+	}
+}
+
+//runs task, then schedules any task whose dependencies are now all done
+void TaskGraph::execute_(int i, JobSystem& jobs) {
+	Task& t = *tasks_[i];
+	ComponentAccess access;
+	access.name = t.name.c_str();
+	access.reads = t.reads;
+	access.writes = t.writes;
+
+	auto t0 = std::chrono::high_resolution_clock::now();
+	ECS.beginAccess(access);
+	t.func();
+	ECS.endAccess(access);
+	auto t1 = std::chrono::high_resolution_clock::now();
+	t.ms = std::chrono::duration<float, std::milli>(t1 - t0).count();
+
+	for (int n : t.next) {
+		if (--tasks_[n]->remaining == 0)
+			schedule_(n, jobs);
+	}
+	tasks_left_--;
+}
+
+void TaskGraph::run(JobSystem& jobs) {
+	if (!built_) build_();
+	if (tasks_.empty()) return;
+
+	for (auto& t : tasks_) t->remaining = t->num_dependencies;
+	tasks_left_ = (int)tasks_.size();
+	for (int i = 0; i < (int)tasks_.size(); i++)
+		if (tasks_[i]->num_dependencies == 0) schedule_(i, jobs);
+
+	//main thread runs its own tasks, and helps with jobs while waiting for them
+	while (tasks_left_ > 0) {
+		int next_main = -1;
+		{
+			std::lock_guard<std::mutex> lock(main_mutex_);
+			if (!main_ready_.empty()) {
+				next_main = main_ready_.front();
+				main_ready_.pop_front();
+			}
+		}
+		if (next_main != -1)
+			execute_(next_main, jobs);
+		else if (!jobs.tryRunJob())
+			std::this_thread::yield();
+	}
+}
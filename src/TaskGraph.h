@@ -0,0 +1,57 @@
+#pragma once
+#include "Components.h"
+#include "JobSystem.h"
+#include <string>
+
+//Graph of tasks (usually whole system updates) run once per frame on the job system
+//Every task declares the component types it reads and writes. When the graph is built,
+//a task depends on every earlier task it conflicts with (one writes what the other
+//reads or writes), so tasks touching different components run in parallel while
+//conflicting tasks keep the order in which they were added
+//Main thread tasks (anything using GL, GLFW or imGUI) always run on the thread
+//calling run(), in the order they were added
+class TaskGraph {
+public:
+	//adds a task and returns its id
+	int addTask(const std::string& name, ComponentSignature reads, ComponentSignature writes,
+		bool main_thread, std::function<void()> func);
+
+	//forces task 'before' to finish before task 'after' starts, for dependencies
+	//which are not components
+	void addDependency(int before, int after);
+
+	//runs all tasks once, returning when all have finished
+	void run(JobSystem& jobs);
+
+	//time each task took last run, in ms
+	int getNumTasks() const { return (int)tasks_.size(); }
+	const std::string& getTaskName(int i) const { return tasks_[i]->name; }
+	float getTaskTime(int i) const { return tasks_[i]->ms; }
+	bool isMainThreadTask(int i) const { return tasks_[i]->main_thread; }
+
+private:
+	struct Task {
+		std::string name;
+		ComponentSignature reads;
+		ComponentSignature writes;
+		bool main_thread;
+		std::function<void()> func;
+		std::vector<int> next; //tasks which depend on this one
+		int num_dependencies = 0;
+		std::atomic<int> remaining{ 0 }; //dependencies not finished this run
+		float ms = 0.0f;
+	};
+	std::vector<std::unique_ptr<Task>> tasks_;
+	std::vector<std::pair<int, int>> extra_dependencies_;
+	bool built_ = false;
+
+	//main thread tasks ready to run
+	std::mutex main_mutex_;
+	std::deque<int> main_ready_;
+	std::atomic<int> tasks_left_{ 0 };
+
+	void build_();
+	void addEdge_(int before, int after);
+	void schedule_(int i, JobSystem& jobs);
+	void execute_(int i, JobSystem& jobs);
+};
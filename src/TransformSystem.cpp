@@ -0,0 +1,103 @@
+#include "TransformSystem.h"
+#include "extern.h"
+#include <algorithm>
+#include <atomic>
+
+//nothing to initialise so far
+void TransformSystem::init() {
+
+}
+
+//rebuilds world matrices of all dirty transforms and their children
+void TransformSystem::update(float dt) {
+    auto& transforms = ECS.getAllComponents<Transform>();
+
+    //single pass per level only works if transforms are sorted by depth
+    if (!findLevels_()) {
+        sortTransforms_();
+        findLevels_();
+    }
+
+    //as parents are in a previous level, by the time we reach a child its parent's world
+    //matrix (and world_changed flag) is already up to date for this frame. All
+    //transforms in a level are independent, so each level is updated in parallel
+    std::atomic<int> recomputed(0), uniform_scale(0);
+    for (size_t l = 0; l + 1 < level_starts_.size(); l++) {
+        ECS.parallel_each<Transform>(JOBS, 0, writes, 256, level_starts_[l], level_starts_[l + 1],
+                                     [&transforms, &recomputed, &uniform_scale](int i, Transform& t) {
+            bool parent_changed = t.parent != -1 && transforms[t.parent].world_changed;
+            t.world_changed = t.dirty || parent_changed;
+            if (t.world_changed) {
+                if (t.parent != -1)
+                    t.world = transforms[t.parent].world * t;
+                else
+                    t.world = t;
+
+                bool fast_path;
+                t.normal_matrix = lm::Affine3x4(t.world).inverseTranspose(&fast_path).toMat4();
+                recomputed.fetch_add(1, std::memory_order_relaxed);
+                if (fast_path) uniform_scale.fetch_add(1, std::memory_order_relaxed);
+            }
+            t.dirty = false;
+        });
+    }
+    normals_recomputed_ = recomputed;
+    normals_uniform_scale_ = uniform_scale;
+    normals_reused_ = (int)transforms.size() - normals_recomputed_;
+}
+
+//computes depth of each transform and where each depth level starts in the array
+//returns false if array is not sorted by depth (i.e. needs sortTransforms_)
+bool TransformSystem::findLevels_() {
+    auto& transforms = ECS.getAllComponents<Transform>();
+    const int num_transforms = (int)transforms.size();
+
+    depth_.resize(num_transforms);
+    level_starts_.clear();
+    for (int i = 0; i < num_transforms; i++) {
+        int parent = transforms[i].parent;
+        if (parent >= i) return false;
+        depth_[i] = parent == -1 ? 0 : depth_[parent] + 1;
+        if (i > 0 && depth_[i] < depth_[i - 1]) return false;
+        if (i == 0 || depth_[i] != depth_[i - 1]) level_starts_.push_back(i);
+    }
+    level_starts_.push_back(num_transforms);
+    return true;
+}
+
+//reorders transform array by depth, so that every parent comes before its children.
+//We then have to map old indices to new ones in both the parent ids and the owner entities
+void TransformSystem::sortTransforms_() {
+    auto& transforms = ECS.getAllComponents<Transform>();
+    const int num_transforms = (int)transforms.size();
+
+    //depth of each transform in hierarchy (roots are 0)
+    std::vector<int> depth(num_transforms, 0);
+    for (int i = 0; i < num_transforms; i++) {
+        for (int p = transforms[i].parent; p != -1 && depth[i] <= num_transforms; p = transforms[p].parent)
+            depth[i]++;
+    }
+
+    //stable sort by depth, so siblings keep their relative order
+    std::vector<int> order(num_transforms);
+    for (int i = 0; i < num_transforms; i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&depth](int a, int b) {
+        return depth[a] < depth[b];
+    });
+
+    //map old indices to new indices
+    std::vector<int> old_new(num_transforms);
+    for (int i = 0; i < num_transforms; i++) old_new[order[i]] = i;
+
+    //build new array, updating parent and entity ids
+    std::vector<Transform> sorted;
+    sorted.reserve(num_transforms);
+    for (int i = 0; i < num_transforms; i++) {
+        sorted.push_back(transforms[order[i]]);
+        Transform& t = sorted.back();
+        if (t.parent != -1) t.parent = old_new[t.parent];
+        t.dirty = true;
+        if (t.owner >= 0) ECS.setComponentID<Transform>(t.owner, i); //-1 if created without entity
+    }
+    transforms.swap(sorted);
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include "includes.h"
+#include "Components.h"
+#include <vector>
+
+//The transform system maintains the scene graph. Transforms are kept in the ECS
+//array sorted by depth in the hierarchy (so parents come before children), so a single
+//pass per frame can rebuild the world matrix of every transform whose local matrix (or
+//whose parent's world matrix) has changed. Each depth level is updated in parallel. All other systems then read the cached world matrix
+//with Transform::getGlobalMatrix() instead of walking up the hierarchy
+//The normal matrix (inverse transpose of world) is rebuilt at the same time, so static
+//meshes never pay for it
+class TransformSystem {
+public:
+    void init();
+    void update(float dt);
+
+    //component access of update, used to schedule it in Game task graph
+    static constexpr ComponentSignature reads = 0;
+    static constexpr ComponentSignature writes = signatureOf<Transform>();
+
+    //stats of last update: normal matrices recomputed (of which with uniform scale
+    //fast path) and reused from previous frame
+    int getNormalsRecomputed() const { return normals_recomputed_; }
+    int getNormalsUniformScale() const { return normals_uniform_scale_; }
+    int getNormalsReused() const { return normals_reused_; }
+
+private:
+    //depth of each transform, and index where each depth level starts (plus array size at end)
+    std::vector<int> depth_;
+    std::vector<int> level_starts_;
+
+    int normals_recomputed_ = 0;
+    int normals_uniform_scale_ = 0;
+    int normals_reused_ = 0;
+
+    bool findLevels_();
+    void sortTransforms_();
+};
@@ -1,4 +1,8 @@
 #pragma once
 #include "EntityComponentStore.h"
+#include "JobSystem.h"
+#include "GLState.h"
 
-extern EntityComponentStore ECS;
\ No newline at end of file
+extern EntityComponentStore ECS;
+extern JobSystem JOBS;
+extern GLState GLSTATE;
\ No newline at end of file
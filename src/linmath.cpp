@@ -7,6 +7,11 @@
 #include "linmath.h"
 #include <math.h> //atan2
 #include <utility> //for std::swap
+#if defined(LM_AVX2)
+#include <immintrin.h>
+#elif defined(LM_SSE2)
+#include <emmintrin.h>
+#endif
 
 namespace lm {
 
@@ -163,6 +168,9 @@ namespace lm {
 		return *this;
 	}
 
+	// Gauss-Jordan elimination with partial pivoting. Each step scales or subtracts a whole
+	// 4 float column M[i] of temp and final, so SIMD versions apply the same step to 4
+	// (SSE2) or 8 (AVX2, temp and final together) floats at once
 	bool mat4::inverse()
 	{
 		unsigned int i, j, k, swap;
@@ -204,6 +212,37 @@ namespace lm {
 			}
 #undef MATRIX_SINGULAR_THRESHOLD
 			t = 1.0f / temp.M[i][i];
+#if defined(LM_AVX2)
+			__m256 row_i = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(temp.M[i])), _mm_loadu_ps(final.M[i]), 1);
+			row_i = _mm256_mul_ps(row_i, _mm256_set1_ps(t));
+			_mm_storeu_ps(temp.M[i], _mm256_castps256_ps128(row_i));
+			_mm_storeu_ps(final.M[i], _mm256_extractf128_ps(row_i, 1));
+			for (j = 0; j < m; j++)
+			{
+				if (j != i)
+				{
+					t = temp.M[j][i];
+					__m256 row_j = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(temp.M[j])), _mm_loadu_ps(final.M[j]), 1);
+					row_j = _mm256_sub_ps(row_j, _mm256_mul_ps(row_i, _mm256_set1_ps(t)));
+					_mm_storeu_ps(temp.M[j], _mm256_castps256_ps128(row_j));
+					_mm_storeu_ps(final.M[j], _mm256_extractf128_ps(row_j, 1));
+				}
+			}
+#elif defined(LM_SSE2)
+			__m128 temp_i = _mm_mul_ps(_mm_loadu_ps(temp.M[i]), _mm_set1_ps(t));
+			__m128 final_i = _mm_mul_ps(_mm_loadu_ps(final.M[i]), _mm_set1_ps(t));
+			_mm_storeu_ps(temp.M[i], temp_i);
+			_mm_storeu_ps(final.M[i], final_i);
+			for (j = 0; j < m; j++)
+			{
+				if (j != i)
+				{
+					__m128 tv = _mm_set1_ps(temp.M[j][i]);
+					_mm_storeu_ps(temp.M[j], _mm_sub_ps(_mm_loadu_ps(temp.M[j]), _mm_mul_ps(temp_i, tv)));
+					_mm_storeu_ps(final.M[j], _mm_sub_ps(_mm_loadu_ps(final.M[j]), _mm_mul_ps(final_i, tv)));
+				}
+			}
+#else
 			for (k = 0; k < n; k++)//m or n
 			{
 				temp.M[i][k] *= t;
@@ -221,12 +260,38 @@ namespace lm {
 					}
 				}
 			}
+#endif
 		}
 		*this = final;
 
 		return true;
 	}
 
+	// inverse of affine matrix [A t; 0 1] is [inv(A) -inv(A)*t; 0 1]
+	// rows of inv(A) are cross products of the columns of A, divided by determinant
+	bool mat4::inverseAffine()
+	{
+		vec3 c0(m[0], m[1], m[2]);
+		vec3 c1(m[4], m[5], m[6]);
+		vec3 c2(m[8], m[9], m[10]);
+		vec3 t(m[12], m[13], m[14]);
+
+		vec3 r0 = c1.cross(c2);
+		float det = c0.dot(r0);
+		if (fabsf(det) <= 0.00001f) return false; //singular, same threshold as inverse()
+
+		float inv_det = 1.0f / det;
+		r0 = r0 * inv_det;
+		vec3 r1 = c2.cross(c0) * inv_det;
+		vec3 r2 = c0.cross(c1) * inv_det;
+
+		m[0] = r0.x; m[4] = r0.y; m[8] = r0.z; m[12] = -r0.dot(t);
+		m[1] = r1.x; m[5] = r1.y; m[9] = r1.z; m[13] = -r1.dot(t);
+		m[2] = r2.x; m[6] = r2.y; m[10] = r2.z; m[14] = -r2.dot(t);
+		m[3] = 0; m[7] = 0; m[11] = 0; m[15] = 1;
+		return true;
+	}
+
 	// orthogonalizes right and top vector from the front vector
 	// assumes new, normalized front vector has just been set
 	void mat4::orthogonalizeFromFront() {
@@ -456,42 +521,123 @@ namespace lm {
 		return vec3(v4m.x, v4m.y, v4m.z);
 	}
 
+#if defined(LM_AVX2)
+	//same 4 floats in both 128 bit lanes. mat4 is not 16 byte aligned, so load unaligned
+	static inline __m256 broadcast128_(const float* p)
+	{
+		__m128 v = _mm_loadu_ps(p);
+		return _mm256_insertf128_ps(_mm256_castps128_ps256(v), v, 1);
+	}
+#endif
+
 	// multiplies a vec4 with a mat4
+	// result is sum of columns of matrix weighted by x, y, z, w (in that order)
 	vec4 mat4::operator*(const vec4& v) const
 	{
 		vec4 ret;
-
+#if defined(LM_SSE2)
+		__m128 r = _mm_mul_ps(_mm_loadu_ps(&m[0]), _mm_set1_ps(v.x));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(&m[4]), _mm_set1_ps(v.y)));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(&m[8]), _mm_set1_ps(v.z)));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(&m[12]), _mm_set1_ps(v.w)));
+		_mm_storeu_ps(ret.value_, r);
+#else
 		ret.x = v.x*m[0] + v.y*m[4] + v.z*m[8] + v.w*m[12];
 		ret.y = v.x*m[1] + v.y*m[5] + v.z*m[9] + v.w*m[13];
 		ret.z = v.x*m[2] + v.y*m[6] + v.z*m[10] + v.w*m[14];
 		ret.w = v.x*m[3] + v.y*m[7] + v.z*m[11] + v.w*m[15];
-
+#endif
 		return ret;
 	}
 
 	// multiplies column major matrices such that result = this * N
+	// i.e. column i of result is this * (column i of N)
 	mat4 mat4::operator*(const mat4& N) const
 	{
 		mat4 result;
-
+#if defined(LM_AVX2)
+		//two result columns at a time: both 128 bit lanes hold the same column of this
+		__m256 c0 = broadcast128_(M[0]);
+		__m256 c1 = broadcast128_(M[1]);
+		__m256 c2 = broadcast128_(M[2]);
+		__m256 c3 = broadcast128_(M[3]);
+		for (int i = 0; i < 4; i += 2) {
+			__m256 n = _mm256_loadu_ps(N.M[i]); //columns i and i+1 of N
+			__m256 r = _mm256_mul_ps(_mm256_permute_ps(n, 0x00), c0);
+			r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_permute_ps(n, 0x55), c1));
+			r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_permute_ps(n, 0xAA), c2));
+			r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_permute_ps(n, 0xFF), c3));
+			_mm256_storeu_ps(result.M[i], r);
+		}
+#elif defined(LM_SSE2)
+		__m128 c0 = _mm_loadu_ps(M[0]);
+		__m128 c1 = _mm_loadu_ps(M[1]);
+		__m128 c2 = _mm_loadu_ps(M[2]);
+		__m128 c3 = _mm_loadu_ps(M[3]);
+		for (int i = 0; i < 4; i++) {
+			__m128 r = _mm_mul_ps(_mm_set1_ps(N.M[i][0]), c0);
+			r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(N.M[i][1]), c1));
+			r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(N.M[i][2]), c2));
+			r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(N.M[i][3]), c3));
+			_mm_storeu_ps(result.M[i], r);
+		}
+#else
 		unsigned int i, j, k;
 		for (i = 0; i < 4; i++) //column
 		{
 			for (j = 0; j < 4; j++) //row
 			{
-				result.M[i][j] = 0.0; //reset
-				for (k = 0; k < 4; k++) {
-					//k-j iterates row
-					//i-k iterates column
-					//this.row * N.column
+				//k-j iterates row
+				//i-k iterates column
+				//this.row * N.column
+				result.M[i][j] = N.M[i][0] * M[0][j];
+				for (k = 1; k < 4; k++) {
 					result.M[i][j] += N.M[i][k] * M[k][j];
 				}
 			}
 		}
-
+#endif
 		return result;
 	}
 
+	// batched mat4 * vec4, same arithmetic as mat4::operator*(vec4) per vector
+	void transformPoints(const mat4& mat, const vec4* in, vec4* out, size_t n)
+	{
+		size_t i = 0;
+#if defined(LM_AVX2)
+		//two vectors at a time
+		__m256 c0 = broadcast128_(&mat.m[0]);
+		__m256 c1 = broadcast128_(&mat.m[4]);
+		__m256 c2 = broadcast128_(&mat.m[8]);
+		__m256 c3 = broadcast128_(&mat.m[12]);
+		for (; i + 2 <= n; i += 2) {
+			__m256 v = _mm256_loadu_ps(in[i].value_);
+			__m256 r = _mm256_mul_ps(c0, _mm256_permute_ps(v, 0x00));
+			r = _mm256_add_ps(r, _mm256_mul_ps(c1, _mm256_permute_ps(v, 0x55)));
+			r = _mm256_add_ps(r, _mm256_mul_ps(c2, _mm256_permute_ps(v, 0xAA)));
+			r = _mm256_add_ps(r, _mm256_mul_ps(c3, _mm256_permute_ps(v, 0xFF)));
+			_mm256_storeu_ps(out[i].value_, r);
+		}
+#endif
+#if defined(LM_SSE2)
+		__m128 s0 = _mm_loadu_ps(&mat.m[0]);
+		__m128 s1 = _mm_loadu_ps(&mat.m[4]);
+		__m128 s2 = _mm_loadu_ps(&mat.m[8]);
+		__m128 s3 = _mm_loadu_ps(&mat.m[12]);
+		for (; i < n; i++) {
+			__m128 v = _mm_loadu_ps(in[i].value_);
+			__m128 r = _mm_mul_ps(s0, _mm_shuffle_ps(v, v, 0x00));
+			r = _mm_add_ps(r, _mm_mul_ps(s1, _mm_shuffle_ps(v, v, 0x55)));
+			r = _mm_add_ps(r, _mm_mul_ps(s2, _mm_shuffle_ps(v, v, 0xAA)));
+			r = _mm_add_ps(r, _mm_mul_ps(s3, _mm_shuffle_ps(v, v, 0xFF)));
+			_mm_storeu_ps(out[i].value_, r);
+		}
+#else
+		for (; i < n; i++)
+			out[i] = mat * in[i];
+#endif
+	}
+
 	// turns this matrix into a view matrix
 	void mat4::lookAt(const vec3& eye, const vec3& center, const vec3& up) {
 		//create coordinate system of camera
@@ -545,4 +691,107 @@ namespace lm {
 		M[3][3] = 1.0f;
 	}
 
-}
\ No newline at end of file
+	//
+	// Affine3x4
+	//
+
+	Affine3x4::Affine3x4()
+	{
+		for (int r = 0; r < 3; r++)
+			for (int c = 0; c < 4; c++)
+				R[r][c] = r == c ? 1.0f : 0.0f;
+	}
+
+	Affine3x4::Affine3x4(const mat4& mat)
+	{
+		for (int r = 0; r < 3; r++)
+			for (int c = 0; c < 4; c++)
+				R[r][c] = mat.M[c][r];
+	}
+
+	mat4 Affine3x4::toMat4() const
+	{
+		mat4 mat;
+		for (int r = 0; r < 3; r++)
+			for (int c = 0; c < 4; c++)
+				mat.M[c][r] = R[r][c];
+		mat.M[0][3] = mat.M[1][3] = mat.M[2][3] = 0.0f;
+		mat.M[3][3] = 1.0f;
+		return mat;
+	}
+
+	// columns of rotation * uniform scale all have the same length and are orthogonal
+	bool Affine3x4::isUniformScale(float& scale_sq, float tolerance) const
+	{
+		vec3 c0(R[0][0], R[1][0], R[2][0]);
+		vec3 c1(R[0][1], R[1][1], R[2][1]);
+		vec3 c2(R[0][2], R[1][2], R[2][2]);
+		float l0 = c0.dot(c0);
+		if (l0 <= 0.0f) return false;
+		float tol = tolerance * l0;
+		if (fabsf(c1.dot(c1) - l0) > tol || fabsf(c2.dot(c2) - l0) > tol) return false;
+		if (fabsf(c0.dot(c1)) > tol || fabsf(c0.dot(c2)) > tol || fabsf(c1.dot(c2)) > tol) return false;
+		scale_sq = l0;
+		return true;
+	}
+
+	Affine3x4 Affine3x4::inverseTranspose(bool* uniform_scale) const
+	{
+		Affine3x4 result;
+		result.R[0][3] = result.R[1][3] = result.R[2][3] = 0.0f;
+
+		float scale_sq;
+		bool is_uniform = isUniformScale(scale_sq);
+		if (uniform_scale) *uniform_scale = is_uniform;
+		if (is_uniform) {
+			float inv_scale_sq = 1.0f / scale_sq;
+			for (int r = 0; r < 3; r++)
+				for (int c = 0; c < 3; c++)
+					result.R[r][c] = R[r][c] * inv_scale_sq;
+			return result;
+		}
+
+		// inverse transpose = cofactor matrix / determinant
+		// columns of cofactor matrix are cross products of the columns of linear part
+		vec3 c0(R[0][0], R[1][0], R[2][0]);
+		vec3 c1(R[0][1], R[1][1], R[2][1]);
+		vec3 c2(R[0][2], R[1][2], R[2][2]);
+		vec3 x0 = c1.cross(c2);
+		vec3 x1 = c2.cross(c0);
+		vec3 x2 = c0.cross(c1);
+		float det = c0.dot(x0);
+		if (fabsf(det) <= 0.00001f) return result; //singular: identity
+		float inv_det = 1.0f / det;
+		result.R[0][0] = x0.x * inv_det; result.R[0][1] = x1.x * inv_det; result.R[0][2] = x2.x * inv_det;
+		result.R[1][0] = x0.y * inv_det; result.R[1][1] = x1.y * inv_det; result.R[1][2] = x2.y * inv_det;
+		result.R[2][0] = x0.z * inv_det; result.R[2][1] = x1.z * inv_det; result.R[2][2] = x2.z * inv_det;
+		return result;
+	}
+
+	vec3 Affine3x4::transformPoint(const vec3& p) const
+	{
+		return vec3(R[0][0] * p.x + R[0][1] * p.y + R[0][2] * p.z + R[0][3],
+					R[1][0] * p.x + R[1][1] * p.y + R[1][2] * p.z + R[1][3],
+					R[2][0] * p.x + R[2][1] * p.y + R[2][2] * p.z + R[2][3]);
+	}
+
+	vec3 Affine3x4::transformVector(const vec3& v) const
+	{
+		return vec3(R[0][0] * v.x + R[0][1] * v.y + R[0][2] * v.z,
+					R[1][0] * v.x + R[1][1] * v.y + R[1][2] * v.z,
+					R[2][0] * v.x + R[2][1] * v.y + R[2][2] * v.z);
+	}
+
+	// result = this * other, treating both as 4x4 with bottom row 0 0 0 1
+	Affine3x4 Affine3x4::operator*(const Affine3x4& other) const
+	{
+		Affine3x4 result;
+		for (int r = 0; r < 3; r++) {
+			for (int c = 0; c < 4; c++) {
+				result.R[r][c] = R[r][0] * other.R[0][c] + R[r][1] * other.R[1][c] + R[r][2] * other.R[2][c];
+			}
+			result.R[r][3] += R[r][3];
+		}
+		return result;
+	}
+}
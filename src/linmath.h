@@ -5,8 +5,24 @@
 //
 #pragma once
 #include <cmath> //for sqrt (square root) function
+#include <cstddef> //for size_t
 #define DEG2RAD 0.0174532925f
 
+//mat4 multiply, inverse and mat4 * vec4 use SIMD when the compiler targets it:
+//AVX2 if __AVX2__ is defined (e.g. /arch:AVX2, -mavx2), otherwise SSE2 (always on x64).
+//Define LM_NO_SIMD to force the scalar code. Every path does the same float operations
+//in the same order (no fused multiply-add), so all give bit-identical results, as long as
+//the compiler does not fuse them either: build with FP contraction off (-ffp-contract=off,
+//MSVC /fp:precise). tests/linmath_simd_test checks this
+#if !defined(LM_NO_SIMD)
+#if defined(__AVX2__)
+#define LM_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LM_SSE2
+#endif
+#endif
+
 namespace lm {
 
 	class vec2
@@ -125,6 +141,9 @@ namespace lm {
 		mat4& setIdentity();
 		mat4& transpose();
 		bool inverse();
+		//much cheaper inverse, only valid if matrix is affine (bottom row is 0 0 0 1)
+		//e.g. model and view matrices, but NOT projection matrices
+		bool inverseAffine();
 
 		//get base vectors
 		vec3 right() const { return vec3(m[0], m[1], m[2]); }
@@ -171,6 +190,32 @@ namespace lm {
 		void orthogonalizeFromFront();
 	};
 
+	//affine transform, i.e. a mat4 whose bottom row is 0 0 0 1, stored as the 3 rows
+	//that are not constant. The 3x3 part is linear (rotation, scale, shear), column 3 is translation
+	class Affine3x4 {
+	public:
+		float R[3][4]; //[row][column], unlike mat4
+
+		Affine3x4(); //identity
+		Affine3x4(const mat4& mat); //ignores bottom row of mat
+
+		mat4 toMat4() const;
+
+		//true if linear part is a rotation times a uniform scale (within tolerance),
+		//in which case scale_sq is set to the squared scale
+		bool isUniformScale(float& scale_sq, float tolerance = 0.0001f) const;
+
+		//inverse transpose of linear part, with no translation (i.e. the normal matrix)
+		//uniform scale M = s*Rot is a fast path: inverse transpose is M / s^2, with no inverse.
+		//Otherwise uses closed form: cofactor matrix / determinant
+		//if uniform_scale is not null, it is set to whether fast path was used
+		Affine3x4 inverseTranspose(bool* uniform_scale = nullptr) const;
+
+		vec3 transformPoint(const vec3& p) const;
+		vec3 transformVector(const vec3& v) const;
+		Affine3x4 operator * (const Affine3x4& other) const;
+	};
+
 	//vec2 operators
 	vec2 operator * (const vec2& a, float v);
 	vec2 operator + (const vec2& a, const vec2& b);
@@ -189,4 +234,7 @@ namespace lm {
 	quat operator * (const quat& a, float v);
 	quat operator * (const quat& a, const quat& b);
 
+	//out[i] = m * in[i] for n vectors. in and out may be the same array
+	void transformPoints(const mat4& m, const vec4* in, vec4* out, size_t n);
+
 }
\ No newline at end of file
@@ -13,6 +13,10 @@
 Game* GAME = nullptr;
 //initialise global ECS. By including extern.h in any cpp file (NOT .h file!) we can access this variable
 EntityComponentStore ECS;
+//global job system, also accessed via extern.h
+JobSystem JOBS;
+//shadowed GL state, also accessed via extern.h
+GLState GLSTATE;
 
 bool glCheckError() {
     GLenum errCode;
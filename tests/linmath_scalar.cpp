@@ -0,0 +1,48 @@
+//linmath.cpp built again with its scalar code, in its own namespace so it links next to
+//the SIMD build
+#define LM_NO_SIMD
+#define lm lm_scalar
+#include "linmath.cpp"
+#undef lm
+#include "linmath_scalar.h"
+#include <cstring>
+
+namespace scalar {
+
+	//mat4(const float*) is declared but has no definition
+	static lm_scalar::mat4 load_(const float* m) {
+		lm_scalar::mat4 result;
+		memcpy(result.m, m, sizeof(result.m));
+		return result;
+	}
+
+	void multiply(const float* a, const float* b, float* out) {
+		lm_scalar::mat4 result = load_(a) * load_(b);
+		memcpy(out, result.m, sizeof(result.m));
+	}
+
+	void transform(const float* m, const float* v, float* out) {
+		lm_scalar::vec4 result = load_(m) * lm_scalar::vec4(v[0], v[1], v[2], v[3]);
+		memcpy(out, result.value_, sizeof(result.value_));
+	}
+
+	bool inverse(const float* m, float* out) {
+		lm_scalar::mat4 result = load_(m);
+		bool ok = result.inverse();
+		memcpy(out, result.m, sizeof(result.m));
+		return ok;
+	}
+
+	bool inverseAffine(const float* m, float* out) {
+		lm_scalar::mat4 result = load_(m);
+		bool ok = result.inverseAffine();
+		memcpy(out, result.m, sizeof(result.m));
+		return ok;
+	}
+
+	void transformPoints(const float* m, const float* in, float* out, size_t n) {
+		static_assert(sizeof(lm_scalar::vec4) == 4 * sizeof(float), "vec4 is 4 packed floats");
+		lm_scalar::transformPoints(load_(m), reinterpret_cast<const lm_scalar::vec4*>(in),
+			reinterpret_cast<lm_scalar::vec4*>(out), n);
+	}
+}
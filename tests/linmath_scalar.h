@@ -0,0 +1,12 @@
+#pragma once
+#include <cstddef>
+
+//scalar build of linmath (LM_NO_SIMD), on plain float arrays so that it can be called
+//from code which uses the SIMD build. Matrices are 16 floats, column major as lm::mat4
+namespace scalar {
+	void multiply(const float* a, const float* b, float* out);
+	void transform(const float* m, const float* v, float* out);
+	bool inverse(const float* m, float* out);
+	bool inverseAffine(const float* m, float* out);
+	void transformPoints(const float* m, const float* in, float* out, size_t n);
+}
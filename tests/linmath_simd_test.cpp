@@ -0,0 +1,126 @@
+//checks that the SIMD paths of linmath, as built for this target, give exactly the same bits
+//as its scalar paths (see linmath.h), on random general, affine and projection matrices.
+//Prints the first mismatch of each function and returns 1 if there is any
+#include "linmath.h"
+#include "linmath_scalar.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+static const int NUM_MATRICES = 2000;
+
+//deterministic random float in [-range, range]
+static unsigned int random_state_ = 12345u;
+static float random_(float range) {
+	random_state_ = random_state_ * 1664525u + 1013904223u;
+	return ((random_state_ >> 8) / 16777215.0f * 2.0f - 1.0f) * range;
+}
+
+static lm::mat4 randomGeneral_() {
+	lm::mat4 m;
+	for (int i = 0; i < 16; i++) m.m[i] = random_(10.0f);
+	return m;
+}
+
+//rotation, non uniform scale and translation, as model matrices
+static lm::mat4 randomAffine_() {
+	lm::vec3 axis(random_(1.0f), random_(1.0f), random_(1.0f));
+	if (axis.length() < 0.01f) axis = lm::vec3(0.0f, 1.0f, 0.0f);
+	axis.normalize();
+	lm::mat4 m;
+	m.makeRotationMatrix(random_(3.14159f), axis);
+	m.scale(1.5f + random_(1.0f), 1.5f + random_(1.0f), 1.5f + random_(1.0f));
+	m.translate(random_(100.0f), random_(100.0f), random_(100.0f));
+	return m;
+}
+
+static lm::mat4 randomProjection_() {
+	lm::mat4 p, v;
+	p.perspective(1.0f + random_(0.5f), 1.0f + random_(0.5f), 0.1f, 100.0f + random_(50.0f));
+	v.lookAt(lm::vec3(random_(20.0f), random_(20.0f), random_(20.0f)), lm::vec3(0.0f, 0.0f, 0.0f), lm::vec3(0.0f, 1.0f, 0.0f));
+	return p * v;
+}
+
+struct Check {
+	const char* name;
+	int failures = 0;
+	Check(const char* a_name) : name(a_name) {}
+	//compares n floats bit by bit, reports first mismatch
+	void compare(const float* simd, const float* reference, int n, int matrix) {
+		if (memcmp(simd, reference, n * sizeof(float)) == 0) return;
+		if (failures++ > 0) return;
+		for (int i = 0; i < n; i++) {
+			if (memcmp(&simd[i], &reference[i], sizeof(float)) == 0) continue;
+			printf("%s: matrix %d, float %d is %.9g with SIMD, %.9g scalar\n", name, matrix, i, simd[i], reference[i]);
+			return;
+		}
+	}
+	bool report() const {
+		printf("%-16s %s", name, failures ? "FAILED" : "ok");
+		if (failures) printf(" (%d of %d matrices differ)", failures, NUM_MATRICES);
+		printf("\n");
+		return failures == 0;
+	}
+};
+
+int main() {
+#if defined(LM_AVX2)
+	printf("linmath SIMD path: AVX2\n");
+#elif defined(LM_SSE2)
+	printf("linmath SIMD path: SSE2\n");
+#else
+	printf("linmath SIMD path: none, scalar against scalar\n");
+#endif
+
+	Check multiply("mat4 * mat4"), transform("mat4 * vec4"), inverse("inverse"),
+		inverse_affine("inverseAffine"), transform_points("transformPoints");
+
+	//odd count, so AVX2 path also runs its one vector tail
+	const size_t num_points = 33;
+	std::vector<lm::vec4> points(num_points), simd_points(num_points);
+	std::vector<float> scalar_points(num_points * 4);
+
+	for (int i = 0; i < NUM_MATRICES; i++) {
+		lm::mat4 a, b;
+		switch (i % 3) {
+		case 0: a = randomGeneral_(); b = randomGeneral_(); break;
+		case 1: a = randomAffine_(); b = randomAffine_(); break;
+		default: a = randomProjection_(); b = randomAffine_(); break;
+		}
+		float reference[16];
+
+		lm::mat4 product = a * b;
+		scalar::multiply(a.m, b.m, reference);
+		multiply.compare(product.m, reference, 16, i);
+
+		lm::vec4 v(random_(50.0f), random_(50.0f), random_(50.0f), 1.0f);
+		lm::vec4 tv = a * v;
+		scalar::transform(a.m, v.value_, reference);
+		transform.compare(tv.value_, reference, 4, i);
+
+		lm::mat4 inv = a;
+		bool ok = inv.inverse();
+		bool scalar_ok = scalar::inverse(a.m, reference);
+		if (ok != scalar_ok && inverse.failures++ == 0)
+			printf("inverse: matrix %d is singular for only one path\n", i);
+		inverse.compare(inv.m, reference, 16, i);
+
+		if (i % 3 == 1) {
+			lm::mat4 inv_affine = a;
+			inv_affine.inverseAffine();
+			scalar::inverseAffine(a.m, reference);
+			inverse_affine.compare(inv_affine.m, reference, 16, i);
+		}
+
+		for (size_t p = 0; p < num_points; p++)
+			points[p] = lm::vec4(random_(50.0f), random_(50.0f), random_(50.0f), 1.0f);
+		lm::transformPoints(a, points.data(), simd_points.data(), num_points);
+		scalar::transformPoints(a.m, points[0].value_, scalar_points.data(), num_points);
+		transform_points.compare(simd_points[0].value_, scalar_points.data(), (int)num_points * 4, i);
+	}
+
+	bool passed = true;
+	for (const Check* c : { &multiply, &transform, &inverse, &inverse_affine, &transform_points })
+		passed = c->report() && passed;
+	return passed ? 0 : 1;
+}